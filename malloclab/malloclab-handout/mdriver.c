@@ -18,11 +18,15 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef MM_MT
+#include <pthread.h>
+#endif
 
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "clock.h"
 #include "config.h"
 
 /**********************
@@ -43,6 +47,14 @@
 #define WUTIL 2
 #define WPERF 3
 
+/* latency mode (-L) */
+#define LAT_RUNS 5 /* each op's latency is the least over this many replays */
+
+/* multithreaded modes (-T, -X) */
+#define MT_RUNS 3 /* each thread count is timed this many times, best kept */
+#define XQ_BATCH 64 /* -X: blocks handed from producer to consumer at once */
+#define XQ_DEPTH 16 /* -X: batches in flight between a pair */
+
 /******************************
  * The key compound data types
  *****************************/
@@ -92,6 +104,40 @@ typedef struct {
     range_t *ranges;
 } speed_t;
 
+#ifdef MM_MT
+/* The params to mt_replay, one per thread replaying a trace with -T */
+typedef struct {
+    trace_t *trace;
+    char **blocks;              /* this thread's pointer for each id */
+    pthread_barrier_t *start;   /* lines the threads up before timing */
+    int failed;                 /* set if mm_malloc or mm_realloc failed */
+    struct timespec t0, t1;     /* when this thread started and finished */
+} mt_arg_t;
+
+/*
+ * One producer/consumer pair for -X: the producer mallocs a block for
+ * every allocation in the trace and queues it, in batches, for the
+ * consumer to free. Slot count[i] == 0 marks the end of the trace. The
+ * producer goes through the trace twice, the second time only once the
+ * consumer has freed every block of the first, so the second pass should
+ * fit in the heap the first one grew if cross-thread frees come back.
+ */
+typedef struct {
+    trace_t *trace;
+    pthread_barrier_t *start;
+    char *batch[XQ_DEPTH][XQ_BATCH];
+    int count[XQ_DEPTH];        /* blocks in each batch */
+    int head, tail, items;      /* queue of batches, as in sbuf */
+    pthread_mutex_t mutex;
+    pthread_cond_t notempty, notfull;
+    pthread_cond_t drained;     /* the consumer caught up with mallocs */
+    int failed;                 /* set if mm_malloc failed */
+    double mallocs, frees;      /* blocks allocated and freed */
+    size_t heap1;               /* heap size once the first pass was freed */
+    struct timespec t0, t1;     /* producer start, consumer finish */
+} xpair_t;
+#endif
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* set in read_trace */
@@ -178,6 +224,14 @@ static void eval_libc_speed(void *ptr);
 static int eval_mm_valid(trace_t *trace, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum);
 static void eval_mm_speed(void *ptr);
+static void run_latency_tests(int num_tracefiles, const char *tracedir,
+                              char **tracefiles);
+#ifdef MM_MT
+static void run_mt_tests(int num_tracefiles, const char *tracedir,
+                         char **tracefiles, int max_threads);
+static void run_xfree_tests(int num_tracefiles, const char *tracedir,
+                            char **tracefiles, int npairs);
+#endif
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
@@ -266,6 +320,9 @@ int main(int argc, char **argv)
     speed_t speed_params;      /* input parameters to the xx_speed routines */
 
     int run_libc = 0;     /* If set, run libc malloc (set by -l) */
+    int run_latency = 0;  /* If set, time every request (set by -L) */
+    int max_threads = 0;  /* If set, time 1..max_threads threads (-T) */
+    int xfree_pairs = 0;  /* If set, time cross-thread frees (-X) */
     int autograder = 0;   /* if set then called by autograder (-A) */
 
     /* temporaries used to compute the performance index */
@@ -280,7 +337,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hVAlD")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:T:X:hVAlLD")) != EOF) {
         switch (c) {
 
         case 'A': /* Hidden Autolab driver argument */
@@ -318,6 +375,10 @@ int main(int argc, char **argv)
             run_libc = 1;
             break;
 
+        case 'L': /* Time each request of each trace */
+            run_latency = 1;
+            break;
+
         case 'V': /* Increase verbosity level */
             verbose += 1;
             break;
@@ -338,6 +399,24 @@ int main(int argc, char **argv)
             set_timeout = atoi(optarg);
             break;
 
+        case 'T': /* Time the traces in 1, 2, 4, ..., n threads */
+#ifdef MM_MT
+            max_threads = atoi(optarg);
+            break;
+#else
+            fprintf(stderr, "-T needs the thread-safe build, mdriver.mt\n");
+            exit(1);
+#endif
+
+        case 'X': /* Free every block on another thread, in n pairs */
+#ifdef MM_MT
+            xfree_pairs = atoi(optarg);
+            break;
+#else
+            fprintf(stderr, "-X needs the thread-safe build, mdriver.mt\n");
+            exit(1);
+#endif
+
         case 'h': /* Print this message */
             usage();
             exit(0);
@@ -433,6 +512,19 @@ int main(int argc, char **argv)
         }
     }
 
+    if (run_latency && errors == 0)
+        run_latency_tests(num_tracefiles, tracedir, tracefiles);
+
+#ifdef MM_MT
+    if (max_threads > 0 && errors == 0)
+        run_mt_tests(num_tracefiles, tracedir, tracefiles, max_threads);
+    if (xfree_pairs > 0 && errors == 0)
+        run_xfree_tests(num_tracefiles, tracedir, tracefiles, xfree_pairs);
+#else
+    (void)max_threads;
+    (void)xfree_pairs;
+#endif
+
     /*
      * Accumulate the aggregate statistics for the student's mm package
      */
@@ -1121,6 +1213,510 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+#ifdef MM_MT
+/*
+ * mt_replay - Thread routine for -T: run the whole trace against the
+ *    shared mm heap, with this thread's own array of block pointers.
+ */
+static void *mt_replay(void *vargp)
+{
+    mt_arg_t *arg = (mt_arg_t *)vargp;
+    trace_t *trace = arg->trace;
+    char **blocks = arg->blocks;
+    char *p;
+    int i, index;
+
+    pthread_barrier_wait(arg->start);
+    clock_gettime(CLOCK_MONOTONIC, &arg->t0);
+    for (i = 0;  i < trace->num_ops;  i++) {
+        index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+            if ((p = mm_malloc(trace->ops[i].size)) == NULL) {
+                arg->failed = 1;
+                return NULL;
+            }
+            blocks[index] = p;
+            break;
+
+        case REALLOC: /* mm_realloc */
+            p = mm_realloc(blocks[index], trace->ops[i].size);
+            if (p == NULL && trace->ops[i].size != 0) {
+                arg->failed = 1;
+                return NULL;
+            }
+            blocks[index] = p;
+            break;
+
+        case FREE: /* mm_free */
+            mm_free(index < 0 ? NULL : blocks[index]);
+            break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &arg->t1);
+    return NULL;
+}
+
+/*
+ * mt_time - Return the best wall-clock time, over MT_RUNS runs, for
+ *    nthreads threads to each replay trace on one fresh heap, or -1 if
+ *    the package ran out of memory. A run lasts from the first thread
+ *    starting to the last one finishing; the threads time themselves, as
+ *    on a single CPU they can be done before this thread runs again.
+ */
+static double mt_time(trace_t *trace, int nthreads)
+{
+    pthread_t *tids;
+    mt_arg_t *args;
+    pthread_barrier_t start;
+    double t0, t1, secs, best = -1;
+    int run, i, failed;
+
+    tids = malloc(nthreads * sizeof(pthread_t));
+    args = malloc(nthreads * sizeof(mt_arg_t));
+    if (tids == NULL || args == NULL)
+        unix_error("malloc failed in mt_time");
+    for (i = 0; i < nthreads; i++) {
+        args[i].trace = trace;
+        args[i].start = &start;
+        if ((args[i].blocks = malloc(trace->num_ids * sizeof(char *))) == NULL)
+            unix_error("malloc failed in mt_time");
+    }
+
+    for (run = 0; run < MT_RUNS; run++) {
+        mem_reset_brk();
+        if (mm_init() < 0)
+            app_error("mm_init failed in mt_time");
+        pthread_barrier_init(&start, NULL, nthreads + 1);
+        for (i = 0; i < nthreads; i++) {
+            memset(args[i].blocks, 0, trace->num_ids * sizeof(char *));
+            args[i].failed = 0;
+            if (pthread_create(&tids[i], NULL, mt_replay, &args[i]) != 0)
+                app_error("pthread_create failed in mt_time");
+        }
+        pthread_barrier_wait(&start);
+        failed = 0;
+        t0 = DBL_MAX;
+        t1 = 0;
+        for (i = 0; i < nthreads; i++) {
+            pthread_join(tids[i], NULL);
+            failed |= args[i].failed;
+            secs = args[i].t0.tv_sec + args[i].t0.tv_nsec / 1e9;
+            t0 = (secs < t0) ? secs : t0;
+            secs = args[i].t1.tv_sec + args[i].t1.tv_nsec / 1e9;
+            t1 = (secs > t1) ? secs : t1;
+        }
+        pthread_barrier_destroy(&start);
+        if (failed) {
+            best = -1;
+            break;
+        }
+        secs = t1 - t0;
+        if (best < 0 || secs < best)
+            best = secs;
+    }
+
+    for (i = 0; i < nthreads; i++)
+        free(args[i].blocks);
+    free(args);
+    free(tids);
+    return best;
+}
+
+/*
+ * run_mt_tests - Time every trace in 1, 2, 4, ..., max_threads threads,
+ *    each thread replaying the whole trace, and print the throughput of
+ *    each thread count and its speedup over one thread. The totals cover
+ *    the traces weighted for throughput that ran at every thread count.
+ */
+static void run_mt_tests(int num_tracefiles, const char *tracedir,
+                         char **tracefiles, int max_threads)
+{
+    int counts[32], ncounts = 0, i, j, ok;
+    double *secs, sumops[32], sumsecs[32];
+    trace_t *trace;
+    stats_t stats;
+
+    for (i = 1; i < max_threads && ncounts < 31; i *= 2)
+        counts[ncounts++] = i;
+    counts[ncounts++] = max_threads;
+    if ((secs = calloc(ncounts, sizeof(double))) == NULL)
+        unix_error("calloc failed in run_mt_tests");
+    memset(sumops, 0, sizeof(sumops));
+    memset(sumsecs, 0, sizeof(sumsecs));
+
+    printf("Scaling of mm malloc with threads (Kops, best of %d):\n", MT_RUNS);
+    for (j = 0; j < ncounts; j++)
+        printf("%7dT", counts[j]);
+    printf("  trace\n");
+
+    for (i = 0; i < num_tracefiles; i++) {
+        mem_init();
+        trace = read_trace(&stats, tracedir, tracefiles[i]);
+        ok = 1;
+        for (j = 0; j < ncounts; j++) {
+            secs[j] = mt_time(trace, counts[j]);
+            if (secs[j] < 0) {
+                ok = 0;
+                printf("%8s", "-");
+            } else {
+                printf("%8.0f", counts[j] * stats.ops / secs[j] / 1e3);
+            }
+        }
+        printf("  %s\n", trace->filename);
+        if (ok && (stats.weight == WALL || stats.weight == WPERF)) {
+            for (j = 0; j < ncounts; j++) {
+                sumops[j] += counts[j] * stats.ops;
+                sumsecs[j] += secs[j];
+            }
+        }
+        free_trace(trace);
+        mem_deinit();
+    }
+
+    for (j = 0; j < ncounts; j++)
+        printf("%8.0f", sumsecs[j] > 0 ? sumops[j] / sumsecs[j] / 1e3 : 0);
+    printf("  Total\n");
+    for (j = 0; j < ncounts; j++)
+        printf("%8.2f", sumsecs[j] > 0 && sumsecs[0] > 0 ?
+               (sumops[j] / sumsecs[j]) / (sumops[0] / sumsecs[0]) : 0);
+    printf("  Speedup over 1 thread\n\n");
+    free(secs);
+}
+
+/*
+ * xfree_put - Queue the n blocks in batch for the pair's consumer, waiting
+ *    while the queue is full. An empty batch tells the consumer to stop.
+ */
+static void xfree_put(xpair_t *xp, char **batch, int n)
+{
+    pthread_mutex_lock(&xp->mutex);
+    while (xp->items == XQ_DEPTH)
+        pthread_cond_wait(&xp->notfull, &xp->mutex);
+    memcpy(xp->batch[xp->tail], batch, n * sizeof(char *));
+    xp->count[xp->tail] = n;
+    xp->tail = (xp->tail + 1) % XQ_DEPTH;
+    xp->items++;
+    pthread_cond_signal(&xp->notempty);
+    pthread_mutex_unlock(&xp->mutex);
+}
+
+/*
+ * xfree_producer - Thread routine for -X: malloc a block for each
+ *    allocation and reallocation in the trace and pass it on to the
+ *    consumer; the trace's own frees are left out. Runs the trace twice,
+ *    noting the heap size in between, when the consumer has caught up.
+ */
+static void *xfree_producer(void *vargp)
+{
+    xpair_t *xp = (xpair_t *)vargp;
+    trace_t *trace = xp->trace;
+    char *batch[XQ_BATCH];
+    int i, pass, n = 0;
+
+    pthread_barrier_wait(xp->start);
+    clock_gettime(CLOCK_MONOTONIC, &xp->t0);
+    for (pass = 0; pass < 2 && !xp->failed; pass++) {
+        for (i = 0; i < trace->num_ops; i++) {
+            if (trace->ops[i].type == FREE || trace->ops[i].size == 0)
+                continue;
+            if ((batch[n] = mm_malloc(trace->ops[i].size)) == NULL) {
+                xp->failed = 1;
+                break;
+            }
+            xp->mallocs++;
+            if (++n == XQ_BATCH) {
+                xfree_put(xp, batch, n);
+                n = 0;
+            }
+        }
+        if (n > 0)
+            xfree_put(xp, batch, n);
+        n = 0;
+        if (pass == 0) {
+            pthread_mutex_lock(&xp->mutex);
+            while (xp->frees < xp->mallocs)
+                pthread_cond_wait(&xp->drained, &xp->mutex);
+            pthread_mutex_unlock(&xp->mutex);
+            xp->heap1 = mem_heapsize();
+        }
+    }
+    xfree_put(xp, batch, 0);
+    return NULL;
+}
+
+/*
+ * xfree_consumer - Thread routine for -X: free every block the producer
+ *    queues, so that each one is freed by a thread that did not allocate it.
+ */
+static void *xfree_consumer(void *vargp)
+{
+    xpair_t *xp = (xpair_t *)vargp;
+    char *batch[XQ_BATCH];
+    int i, n;
+
+    pthread_barrier_wait(xp->start);
+    do {
+        pthread_mutex_lock(&xp->mutex);
+        while (xp->items == 0)
+            pthread_cond_wait(&xp->notempty, &xp->mutex);
+        n = xp->count[xp->head];
+        memcpy(batch, xp->batch[xp->head], n * sizeof(char *));
+        xp->head = (xp->head + 1) % XQ_DEPTH;
+        xp->items--;
+        pthread_cond_signal(&xp->notfull);
+        pthread_mutex_unlock(&xp->mutex);
+        for (i = 0; i < n; i++)
+            mm_free(batch[i]);
+        pthread_mutex_lock(&xp->mutex);
+        xp->frees += n;
+        pthread_cond_signal(&xp->drained);
+        pthread_mutex_unlock(&xp->mutex);
+    } while (n > 0);
+    clock_gettime(CLOCK_MONOTONIC, &xp->t1);
+    return NULL;
+}
+
+/*
+ * xfree_time - Return the best wall-clock time, over MT_RUNS runs, for
+ *    npairs producer/consumer pairs to each pass every block of trace
+ *    across twice, and set *ops to the mallocs and frees of one run and
+ *    *regrow to the least, over the runs, that the second passes grew the
+ *    heap, in percent of its size after the first; how far a producer gets
+ *    ahead of its consumer varies from run to run. Returns -1 if the
+ *    package ran out of memory.
+ */
+static double xfree_time(trace_t *trace, int npairs, double *ops,
+                         double *regrow)
+{
+    pthread_t *tids;
+    xpair_t *xps;
+    pthread_barrier_t start;
+    double t0, t1, secs, grew, best = -1;
+    size_t heap1;
+    int run, i, failed;
+
+    *regrow = -1;
+    tids = malloc(2 * npairs * sizeof(pthread_t));
+    xps = malloc(npairs * sizeof(xpair_t));
+    if (tids == NULL || xps == NULL)
+        unix_error("malloc failed in xfree_time");
+
+    for (run = 0; run < MT_RUNS; run++) {
+        mem_reset_brk();
+        if (mm_init() < 0)
+            app_error("mm_init failed in xfree_time");
+        pthread_barrier_init(&start, NULL, 2 * npairs + 1);
+        for (i = 0; i < npairs; i++) {
+            memset(&xps[i], 0, sizeof(xpair_t));
+            xps[i].trace = trace;
+            xps[i].start = &start;
+            pthread_mutex_init(&xps[i].mutex, NULL);
+            pthread_cond_init(&xps[i].notempty, NULL);
+            pthread_cond_init(&xps[i].notfull, NULL);
+            pthread_cond_init(&xps[i].drained, NULL);
+            if (pthread_create(&tids[2*i], NULL, xfree_producer, &xps[i]) ||
+                pthread_create(&tids[2*i+1], NULL, xfree_consumer, &xps[i]))
+                app_error("pthread_create failed in xfree_time");
+        }
+        pthread_barrier_wait(&start);
+        failed = 0;
+        t0 = DBL_MAX;
+        t1 = 0;
+        *ops = 0;
+        heap1 = 0;
+        for (i = 0; i < npairs; i++) {
+            pthread_join(tids[2*i], NULL);
+            pthread_join(tids[2*i+1], NULL);
+            failed |= xps[i].failed;
+            *ops += xps[i].mallocs + xps[i].frees;
+            heap1 = (xps[i].heap1 > heap1) ? xps[i].heap1 : heap1;
+            secs = xps[i].t0.tv_sec + xps[i].t0.tv_nsec / 1e9;
+            t0 = (secs < t0) ? secs : t0;
+            secs = xps[i].t1.tv_sec + xps[i].t1.tv_nsec / 1e9;
+            t1 = (secs > t1) ? secs : t1;
+            pthread_mutex_destroy(&xps[i].mutex);
+            pthread_cond_destroy(&xps[i].notempty);
+            pthread_cond_destroy(&xps[i].notfull);
+            pthread_cond_destroy(&xps[i].drained);
+        }
+        pthread_barrier_destroy(&start);
+        grew = heap1 ? 100.0 * (mem_heapsize() - heap1) / heap1 : 0;
+        if (*regrow < 0 || grew < *regrow)
+            *regrow = grew;
+        if (failed) {
+            best = -1;
+            break;
+        }
+        secs = t1 - t0;
+        if (best < 0 || secs < best)
+            best = secs;
+    }
+
+    free(xps);
+    free(tids);
+    return best;
+}
+
+/*
+ * run_xfree_tests - Time every trace with npairs producer/consumer pairs,
+ *    where each block is allocated by one thread and freed by another,
+ *    and print the throughput in mallocs plus frees. The total covers the
+ *    traces weighted for throughput. "regrow" is how much the second pass
+ *    over the trace grew the heap: near 0% when the memory other threads
+ *    freed was reused, 100% or more when it was left stranded.
+ */
+static void run_xfree_tests(int num_tracefiles, const char *tracedir,
+                            char **tracefiles, int npairs)
+{
+    double secs, ops, regrow, sumops = 0, sumsecs = 0;
+    trace_t *trace;
+    stats_t stats;
+    int i;
+
+    printf("Cross-thread frees, %d producer/consumer pair%s "
+           "(Kops, best of %d):\n", npairs, npairs > 1 ? "s" : "", MT_RUNS);
+    printf("%10s%10s%8s%8s  %s\n", "ops", "secs", "Kops", "regrow", "trace");
+    for (i = 0; i < num_tracefiles; i++) {
+        mem_init();
+        trace = read_trace(&stats, tracedir, tracefiles[i]);
+        secs = xfree_time(trace, npairs, &ops, &regrow);
+        if (secs < 0) {
+            printf("%10s%10s%8s%8s  %s\n", "-", "-", "-", "-",
+                   trace->filename);
+        } else {
+            printf("%10.0f%10.6f%8.0f%7.0f%%  %s\n", ops, secs,
+                   ops / secs / 1e3, regrow, trace->filename);
+            if (stats.weight == WALL || stats.weight == WPERF) {
+                sumops += ops;
+                sumsecs += secs;
+            }
+        }
+        free_trace(trace);
+        mem_deinit();
+    }
+    printf("%10.0f%10.6f%8.0f%8s  Total\n\n", sumops, sumsecs,
+           sumsecs > 0 ? sumops / sumsecs / 1e3 : 0, "");
+}
+#endif
+
+/*
+ * eval_mm_latency - Replay the trace on a fresh heap, timing each request
+ *    in cycles, and lower lat[i] to the time of request i if it beat it.
+ */
+static void eval_mm_latency(trace_t *trace, double *lat)
+{
+    int i, index;
+    double cycles;
+    char *p;
+
+    reinit_trace(trace);
+    mem_reset_brk();
+    if (mm_init() < 0)
+        app_error("mm_init failed in eval_mm_latency");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+        index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+            start_counter();
+            p = mm_malloc(trace->ops[i].size);
+            cycles = get_counter();
+            if (p == NULL)
+                app_error("mm_malloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            break;
+
+        case REALLOC: /* mm_realloc */
+            start_counter();
+            p = mm_realloc(trace->blocks[index], trace->ops[i].size);
+            cycles = get_counter();
+            if (p == NULL && trace->ops[i].size != 0)
+                app_error("mm_realloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            break;
+
+        case FREE: /* mm_free */
+            p = (index < 0) ? NULL : trace->blocks[index];
+            start_counter();
+            mm_free(p);
+            cycles = get_counter();
+            break;
+
+        default:
+            app_error("Nonexistent request type in eval_mm_latency");
+        }
+        if (cycles < lat[i])
+            lat[i] = cycles;
+    }
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * run_latency_tests - Print the median, 99th and 99.9th percentile and
+ *    worst latency of the requests in each trace, and the worst request.
+ *    Each request is timed over LAT_RUNS replays and keeps its fastest
+ *    time, so that a timer interrupt or page fault landing on one replay
+ *    does not pass for the allocator's own worst case.
+ */
+static void run_latency_tests(int num_tracefiles, const char *tracedir,
+                              char **tracefiles)
+{
+    double *lat, *sorted, worst_all = 0;
+    int i, j, n, worst;
+    trace_t *trace;
+    stats_t stats;
+    char op[32];
+
+    printf("Latency of mm malloc requests (cycles, best of %d replays):\n",
+           LAT_RUNS);
+    printf("%8s%8s%8s%9s  %-12s %s\n",
+           "median", "p99", "p99.9", "max", "worst op", "trace");
+    for (i = 0; i < num_tracefiles; i++) {
+        mem_init();
+        trace = read_trace(&stats, tracedir, tracefiles[i]);
+        n = trace->num_ops;
+        lat = malloc(n * sizeof(double));
+        sorted = malloc(n * sizeof(double));
+        if (lat == NULL || sorted == NULL)
+            unix_error("malloc failed in run_latency_tests");
+        for (j = 0; j < n; j++)
+            lat[j] = DBL_MAX;
+        for (j = 0; j < LAT_RUNS; j++)
+            eval_mm_latency(trace, lat);
+
+        worst = 0;
+        for (j = 0; j < n; j++)
+            if (lat[j] > lat[worst])
+                worst = j;
+        memcpy(sorted, lat, n * sizeof(double));
+        qsort(sorted, n, sizeof(double), cmp_double);
+        if (trace->ops[worst].type == FREE)
+            sprintf(op, "free");
+        else
+            sprintf(op, "%s %zu", trace->ops[worst].type == ALLOC ?
+                    "malloc" : "realloc", trace->ops[worst].size);
+        printf("%8.0f%8.0f%8.0f%9.0f  %-12s %s\n", sorted[n / 2],
+               sorted[(int)(n * 0.99)], sorted[(int)(n * 0.999)],
+               lat[worst], op, trace->filename);
+        if (lat[worst] > worst_all)
+            worst_all = lat[worst];
+
+        free(lat);
+        free(sorted);
+        free_trace(trace);
+        mem_deinit();
+    }
+    printf("%33.0f  worst of all traces\n\n", worst_all);
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1375,7 +1971,7 @@ void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
  */
 static void usage(void)
 {
-    fprintf(stderr, "Usage: mdriver [-hlVdD] [-f <file>]\n");
+    fprintf(stderr, "Usage: mdriver [-hlLVdD] [-f <file>] [-T <n>] [-X <n>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
     fprintf(stderr, "\t-D         Equivalent to -d2.\n");
@@ -1383,8 +1979,12 @@ static void usage(void)
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Print the latency of requests, and the worst one.\n");
     fprintf(stderr, "\t-V         Print diagnostics as each trace is run.\n");
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-T <n>     Time 1, 2, 4, ..., n threads (mdriver.mt).\n");
+    fprintf(stderr, "\t-X <n>     Time n pairs of threads, one freeing what the other\n"
+                    "\t           allocates (mdriver.mt).\n");
 }
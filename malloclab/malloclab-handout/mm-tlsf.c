@@ -0,0 +1,520 @@
+/*
+ * mm-tlsf.c
+ * chihangw -- Chih-Ang Wang
+ *
+ * A two-level segregated fit (TLSF) allocator, kept beside mm.c so the two
+ * can be compared on the same traces ("make mdriver.tlsf").
+ *
+ * Free blocks are kept in FL_COUNT x SL_COUNT lists. The first level splits
+ * sizes by power of two, the second splits each power of two into SL_COUNT
+ * equal ranges; sizes below SMALL_LIMIT share first level 0, in steps of
+ * DSIZE. One bit per first level says which of them has a non-empty list,
+ * and one bit per list says which of its lists do, so
+ *
+ *   - free inserts into the list of the range its size falls in,
+ *   - malloc rounds the request up to the start of the next range, so any
+ *     block of that range or above fits, and takes the first block of the
+ *     lowest non-empty list at or above it: two find-first-set operations,
+ *
+ * and neither ever walks a list. Every call does a bounded amount of work,
+ * apart from mem_sbrk, which is what makes TLSF the allocator of choice
+ * where worst-case latency matters. The price is the rounding: a block in
+ * the request's own range may fit and be skipped, so malloc looks at the
+ * first block of that list before rounding, but never at the others.
+ *
+ * Blocks have a 4-byte header and footer as in mm.c. The free-list links
+ * are 4-byte offsets from the start of the heap rather than pointers,
+ * which brings the minimum block down to 16 bytes:
+ *
+ *   free block: | hdr(4) | prev(4) | next(4) | ... | ftr(4) |
+ *
+ * The control block (both bitmaps and all list heads) sits at the start
+ * of the heap, so offset 0 never names a block and stands for NULL.
+ * realloc is the plain malloc-copy-free of mm.c, so that the comparison
+ * measures the free-block index and nothing else.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "contracts.h"
+
+#include "mm.h"
+#include "memlib.h"
+
+/* Basic constants */
+#define WSIZE       4       /* Word and header/footer size (bytes) */
+#define DSIZE       8       /* Doubleword size (bytes) */
+#define MINI_BLOCK 16       /* hdr(4) prev(4) next(4) ftr(4) */
+#define CHUNKSIZE 168       /* Extend heap by at least this much, as mm.c */
+#define CURRENT_ALLOC 1
+
+/* Free-block index */
+#define SL_LOG2         4                 /* second-level lists per power */
+#define SL_COUNT        (1 << SL_LOG2)
+#define SMALL_LIMIT     (SL_COUNT * DSIZE)    /* 128: below it, one level */
+#define FL_SHIFT        7                 /* log2(SMALL_LIMIT) */
+#define FL_COUNT        25                /* block sizes below 2^31 */
+
+typedef struct {
+    uint32_t fl_map;                      /* bit f: sl_map[f] != 0 */
+    uint32_t sl_map[FL_COUNT];            /* bit s: heads[f][s] != 0 */
+    uint32_t heads[FL_COUNT][SL_COUNT];   /* offsets of the list heads */
+} control_t;
+
+// Global variables
+static char *heap_base = NULL;            /* mem_heap_lo(), offset 0 */
+static control_t *ctl = NULL;             /* at heap_base */
+static char *heap_listp = NULL;           /* prologue block */
+
+// Create aliases for driver tests
+// DO NOT CHANGE THE FOLLOWING!
+#ifdef DRIVER
+#define malloc mm_malloc
+#define free mm_free
+#define realloc mm_realloc
+#define calloc mm_calloc
+#endif
+
+/*
+ *  Logging Functions
+ *  -----------------
+ *  - dbg_printf acts like printf, but will not be run in a release build.
+ *  - checkheap acts like mm_checkheap, but prints the line it failed on and
+ *    exits if it fails.
+ */
+
+#ifndef NDEBUG
+#define dbg_printf(...) printf(__VA_ARGS__)
+#define checkheap(verbose) do {if (mm_checkheap(verbose)) {  \
+                             printf("Checkheap failed on line %d\n", __LINE__);\
+                             exit(-1);  \
+                        }}while(0)
+#else
+#define dbg_printf(...)
+#define checkheap(...)
+#endif
+
+/*
+ *  Helper functions
+ *  ----------------
+ */
+
+// Return whether the pointer is in the heap.
+static inline int in_heap(const void* p) {
+    return p <= mem_heap_hi() && p >= mem_heap_lo();
+}
+
+/* Pack the size (bytes) and allocated bit into a word */
+static inline uint32_t PACK(uint32_t size, int alloc) {
+    return (size | alloc);
+}
+
+/* Read / Write a word at address p */
+static inline void PUT_WORD(void *p, uint32_t val) {
+    *((uint32_t *)p) = val;
+}
+
+static inline uint32_t GET_WORD(void *p) {
+    return *((uint32_t *)p);
+}
+
+/* Read the size (bytes) and allocated fields from address p */
+static inline uint32_t GET_SIZE(void *p) {
+    return (GET_WORD(p) & ~0x7);
+}
+
+static inline uint32_t GET_ALLOC(void *p) {
+    return (GET_WORD(p) & 0x1);
+}
+
+/* Given block ptr bp, compute address of its header and footer */
+static inline void *HDRP(void *bp) {
+    return (void *)((char *)bp - WSIZE);
+}
+
+static inline void *FTRP(void *bp) {
+    return (void *)((char *)bp + GET_SIZE(HDRP(bp)) - DSIZE);
+}
+
+/* Given block ptr bp, compute address of next and previous blocks */
+static inline void *NEXT_BLKP(void *bp) {
+    return (void *)((char *)bp + GET_SIZE((char *)bp - WSIZE));
+}
+
+static inline void *PREV_BLKP(void *bp) {
+    return (void *)((char *)bp - GET_SIZE((char *)bp - DSIZE));
+}
+
+/* Write the header and footer of block bp */
+static inline void SET_BLOCK(void *bp, uint32_t size, int alloc) {
+    PUT_WORD(HDRP(bp), PACK(size, alloc));
+    PUT_WORD((char *)bp + size - DSIZE, PACK(size, alloc));
+}
+
+/* Convert between block pointers and the offsets kept in the lists */
+static inline uint32_t TO_OFF(void *bp) {
+    return bp ? (uint32_t)((char *)bp - heap_base) : 0;
+}
+
+static inline void *TO_PTR(uint32_t off) {
+    return off ? heap_base + off : NULL;
+}
+
+/* Given free block bp, read / write its previous and next list links */
+static inline void *PREDECESSOR(void *bp) {
+    return TO_PTR(GET_WORD(bp));
+}
+
+static inline void *SUCCESSOR(void *bp) {
+    return TO_PTR(GET_WORD((char *)bp + WSIZE));
+}
+
+static inline void SET_PREDECESSOR(void *bp, void *p) {
+    PUT_WORD(bp, TO_OFF(p));
+}
+
+static inline void SET_SUCCESSOR(void *bp, void *p) {
+    PUT_WORD((char *)bp + WSIZE, TO_OFF(p));
+}
+
+/* Index of the most significant set bit of x > 0 */
+static inline int msb(uint32_t x) {
+    return 31 - __builtin_clz(x);
+}
+
+/*
+ *  Free-block index
+ *  ----------------
+ */
+
+/* The list a free block of the given size belongs in */
+static inline void mapping_insert(uint32_t size, int *fl, int *sl) {
+    if(size < SMALL_LIMIT) {
+        *fl = 0;
+        *sl = size / DSIZE;
+    } else {
+        int t = msb(size);
+        *fl = t - FL_SHIFT + 1;
+        *sl = (size >> (t - SL_LOG2)) ^ SL_COUNT;
+    }
+}
+
+/* The lowest list whose every block holds size bytes */
+static inline void mapping_search(uint32_t size, int *fl, int *sl) {
+    if(size >= SMALL_LIMIT)
+        size += (1 << (msb(size) - SL_LOG2)) - 1;
+    mapping_insert(size, fl, sl);
+}
+
+/* Insert the free block bp at the head of its list */
+static void insertList(void *bp) {
+    int fl, sl;
+    mapping_insert(GET_SIZE(HDRP(bp)), &fl, &sl);
+    void *head = TO_PTR(ctl->heads[fl][sl]);
+
+    SET_PREDECESSOR(bp, NULL);
+    SET_SUCCESSOR(bp, head);
+    if(head != NULL)
+        SET_PREDECESSOR(head, bp);
+    ctl->heads[fl][sl] = TO_OFF(bp);
+    ctl->fl_map |= 1u << fl;
+    ctl->sl_map[fl] |= 1u << sl;
+}
+
+/* Unlink the free block bp from its list */
+static void removeList(void *bp) {
+    int fl, sl;
+    mapping_insert(GET_SIZE(HDRP(bp)), &fl, &sl);
+    void *prev = PREDECESSOR(bp);
+    void *next = SUCCESSOR(bp);
+
+    if(next != NULL)
+        SET_PREDECESSOR(next, prev);
+    if(prev != NULL) {
+        SET_SUCCESSOR(prev, next);
+        return;
+    }
+    ctl->heads[fl][sl] = TO_OFF(next);
+    if(next == NULL) {
+        ctl->sl_map[fl] &= ~(1u << sl);
+        if(ctl->sl_map[fl] == 0)
+            ctl->fl_map &= ~(1u << fl);
+    }
+}
+
+/*
+ * A free block of at least asize bytes, or NULL. The first block of
+ * asize's own list is taken if it is big enough; otherwise the first
+ * block of the lowest non-empty list above, every block of which fits.
+ * Looking at that one head keeps a block of just the right size from
+ * being passed over by the rounding, and keeps the search O(1).
+ */
+static void *find_fit(uint32_t asize) {
+    int fl, sl;
+    void *bp;
+
+    mapping_insert(asize, &fl, &sl);
+    bp = TO_PTR(ctl->heads[fl][sl]);
+    if(bp != NULL && GET_SIZE(HDRP(bp)) >= asize)
+        return bp;
+
+    mapping_search(asize, &fl, &sl);
+    uint32_t map = fl < FL_COUNT ? ctl->sl_map[fl] & (~0u << sl) : 0;
+    if(map == 0) {
+        uint32_t fmap = fl + 1 < FL_COUNT ? ctl->fl_map & (~0u << (fl + 1)) : 0;
+        if(fmap == 0)
+            return NULL;
+        fl = __builtin_ctz(fmap);
+        map = ctl->sl_map[fl];
+    }
+    sl = __builtin_ctz(map);
+    return TO_PTR(ctl->heads[fl][sl]);
+}
+
+/*
+ *  Block functions
+ *  ---------------
+ */
+
+/* Merge the free block bp with free neighbours and insert the result */
+static void *coalesce(void *bp) {
+    uint32_t size = GET_SIZE(HDRP(bp));
+    void *prev = PREV_BLKP(bp);
+    void *next = NEXT_BLKP(bp);
+
+    if(!GET_ALLOC(HDRP(next))) {
+        removeList(next);
+        size += GET_SIZE(HDRP(next));
+    }
+    if(!GET_ALLOC(HDRP(prev))) {
+        removeList(prev);
+        size += GET_SIZE(HDRP(prev));
+        bp = prev;
+    }
+    SET_BLOCK(bp, size, 0);
+    insertList(bp);
+    return bp;
+}
+
+/*
+ * Grow the heap so that a free block of at least asize bytes ends at its
+ * top, taking at least CHUNKSIZE bytes from mem_sbrk, which is a system
+ * call. A free block already at the top is extended rather than left
+ * behind; it may even be big enough as it is, if find_fit skipped it.
+ */
+static void *extend_heap(uint32_t asize) {
+    char *epilogue = (char *)mem_heap_hi() + 1 - WSIZE;
+    uint32_t last = GET_WORD(epilogue - WSIZE);  /* footer of the top block */
+    uint32_t grow;
+    char *bp;
+
+    if(!(last & CURRENT_ALLOC)) {
+        last &= ~0x7;
+        bp = epilogue - last + WSIZE;
+        removeList(bp);
+        if(last >= asize)
+            return bp;
+    } else {
+        last = 0;
+        bp = epilogue + WSIZE;
+    }
+    grow = asize - last > CHUNKSIZE ? asize - last : CHUNKSIZE;
+    if(mem_sbrk(grow) == (void *)-1) {
+        if(last)
+            insertList(bp);
+        return NULL;
+    }
+    SET_BLOCK(bp, last + grow, 0);
+    PUT_WORD(HDRP(NEXT_BLKP(bp)), PACK(0, CURRENT_ALLOC));
+    return bp;
+}
+
+/* Allocate asize bytes at the start of the unlisted free block bp */
+static void place(void *bp, uint32_t asize) {
+    uint32_t csize = GET_SIZE(HDRP(bp));
+
+    if(csize - asize >= MINI_BLOCK) {
+        SET_BLOCK(bp, asize, CURRENT_ALLOC);
+        void *rest = NEXT_BLKP(bp);
+        SET_BLOCK(rest, csize - asize, 0);
+        insertList(rest);
+    } else {
+        SET_BLOCK(bp, csize, CURRENT_ALLOC);
+    }
+}
+
+/*
+ * Initialize: return -1 on error, 0 on success.
+ */
+int mm_init(void) {
+    /* Control block, then pad(4) prologue(8) epilogue(4) */
+    if((heap_base = mem_sbrk(sizeof(control_t) + 2*DSIZE)) == (void *)-1)
+        return -1;
+    ctl = (control_t *)heap_base;
+    memset(ctl, 0, sizeof(control_t));
+
+    heap_listp = heap_base + sizeof(control_t);
+    PUT_WORD(heap_listp, 0);
+    PUT_WORD(heap_listp + 1*WSIZE, PACK(DSIZE, CURRENT_ALLOC));
+    PUT_WORD(heap_listp + 2*WSIZE, PACK(DSIZE, CURRENT_ALLOC));
+    PUT_WORD(heap_listp + 3*WSIZE, PACK(0,     CURRENT_ALLOC));
+    heap_listp += DSIZE;
+    return 0;
+}
+
+/*
+ * malloc
+ */
+void *malloc (size_t size) {
+    uint32_t asize;
+    void *bp;
+
+    if(size == 0 || size > (1u << 31) - 2*DSIZE)
+        return NULL;
+
+    /* Room for the header and footer, rounded up to a multiple of DSIZE */
+    asize = DSIZE * ((size + DSIZE + (DSIZE-1)) / DSIZE);
+    if(asize < MINI_BLOCK)
+        asize = MINI_BLOCK;
+
+    if((bp = find_fit(asize)) != NULL)
+        removeList(bp);
+    else if((bp = extend_heap(asize)) == NULL)
+        return NULL;
+    place(bp, asize);
+    checkheap(0);
+    return bp;
+}
+
+/*
+ * free
+ */
+void free (void *ptr) {
+    if(ptr == NULL)
+        return;
+    SET_BLOCK(ptr, GET_SIZE(HDRP(ptr)), 0);
+    coalesce(ptr);
+    checkheap(0);
+}
+
+/*
+ * realloc - malloc, copy and free, as in mm.c
+ */
+void *realloc(void *oldptr, size_t size) {
+    size_t oldsize;
+    void *newptr;
+
+    if(size == 0) {
+        free(oldptr);
+        return 0;
+    }
+    if(oldptr == NULL)
+        return malloc(size);
+
+    if((newptr = malloc(size)) == NULL)
+        return 0;
+    oldsize = GET_SIZE(HDRP(oldptr)) - DSIZE;
+    memcpy(newptr, oldptr, size < oldsize ? size : oldsize);
+    free(oldptr);
+    return newptr;
+}
+
+/*
+ * calloc
+ */
+void *calloc (size_t nmemb, size_t size) {
+    size_t bytes = nmemb * size;
+    void *newptr;
+
+    if((newptr = malloc(bytes)) != NULL)
+        memset(newptr, 0, bytes);
+    return newptr;
+}
+
+/*
+ * mm_checkheap - Check every block, every list and both bitmaps; print
+ *    what is wrong and return 1 if anything is.
+ */
+int mm_checkheap(int verbose) {
+    unsigned int fcount_by_iteration = 0;
+    unsigned int fcount_by_traversal = 0;
+    int fl, sl;
+    void *bp;
+
+    /* [CHECK 1] Prologue, and each block up to the epilogue */
+    if(GET_WORD(HDRP(heap_listp)) != PACK(DSIZE, CURRENT_ALLOC)) {
+        printf("Bad prologue header\n");
+        return 1;
+    }
+    for(bp = NEXT_BLKP(heap_listp); GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+        if(verbose)
+            printf("%p: [%u:%c]\n", bp, GET_SIZE(HDRP(bp)),
+                   GET_ALLOC(HDRP(bp)) ? 'a' : 'f');
+        if((size_t)bp % DSIZE || GET_SIZE(HDRP(bp)) < MINI_BLOCK) {
+            printf("Error: %p is misaligned or too small\n", bp);
+            return 1;
+        }
+        if(GET_WORD(HDRP(bp)) != GET_WORD(FTRP(bp))) {
+            printf("Error: header of %p does not match footer\n", bp);
+            return 1;
+        }
+        if(!GET_ALLOC(HDRP(bp))) {
+            fcount_by_iteration++;
+            if(!GET_ALLOC(HDRP(NEXT_BLKP(bp)))) {
+                printf("Consecutive free blocks in the heap\n");
+                return 1;
+            }
+        }
+    }
+    if((char *)HDRP(bp) != (char *)mem_heap_hi() + 1 - WSIZE) {
+        printf("Bad epilogue header\n");
+        return 1;
+    }
+
+    /* [CHECK 2] The lists, their links and classes, and both bitmaps */
+    for(fl = 0; fl < FL_COUNT; fl++) {
+        if(((ctl->fl_map >> fl) & 1) != (ctl->sl_map[fl] != 0)) {
+            printf("First level %d disagrees with fl_map\n", fl);
+            return 1;
+        }
+        for(sl = 0; sl < SL_COUNT; sl++) {
+            bp = TO_PTR(ctl->heads[fl][sl]);
+            if(((ctl->sl_map[fl] >> sl) & 1) != (bp != NULL)) {
+                printf("List %d.%d disagrees with sl_map\n", fl, sl);
+                return 1;
+            }
+            if(bp != NULL && PREDECESSOR(bp) != NULL) {
+                printf("Head of list %d.%d has a predecessor\n", fl, sl);
+                return 1;
+            }
+            for(; bp != NULL; bp = SUCCESSOR(bp)) {
+                int f, s;
+                fcount_by_traversal++;
+                if(!in_heap(bp) || GET_ALLOC(HDRP(bp))) {
+                    printf("%p in list %d.%d is not a free block\n", bp, fl, sl);
+                    return 1;
+                }
+                mapping_insert(GET_SIZE(HDRP(bp)), &f, &s);
+                if(f != fl || s != sl) {
+                    printf("%p is in list %d.%d, not %d.%d\n", bp, fl, sl, f, s);
+                    return 1;
+                }
+                if(SUCCESSOR(bp) != NULL && PREDECESSOR(SUCCESSOR(bp)) != bp) {
+                    printf("Next pointer not consistent\n");
+                    return 1;
+                }
+            }
+        }
+    }
+
+    if(fcount_by_iteration != fcount_by_traversal) {
+        printf("%u free blocks in the heap, %u in the lists\n",
+               fcount_by_iteration, fcount_by_traversal);
+        return 1;
+    }
+    return 0;
+}
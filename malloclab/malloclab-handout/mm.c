@@ -11,18 +11,27 @@
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#ifdef MM_MT
+#include <pthread.h>
+#endif
 #include "contracts.h"
 
 #include "mm.h"
 #include "memlib.h"
 
 // Global variables and macros
+#ifdef MM_MT
+static __thread char *heap_start = NULL;  /* class heads of the locked arena */
+#else
 static char *heap_start = NULL;
 static char *heap_listp = NULL;
+#endif
+static char *heap_lo = NULL;  /* mem_heap_lo(): free-list links are offsets */
 
 /* We put the address on the front of the heap. The first 13 x DSIZE bytes */
 /* are used to keep track the head of each size class. Below we define the */
-/* offset in order to access these size class head */
+/* offset in order to access these size class head. The DSIZE after them */
+/* holds a bitmap with bit i set while class i+1 has a free block */
 #define CLASS_1_OFFSET    0
 #define CLASS_2_OFFSET    8
 #define CLASS_3_OFFSET    16
@@ -36,14 +45,17 @@ static char *heap_listp = NULL;
 #define CLASS_11_OFFSET   80
 #define CLASS_12_OFFSET   88
 #define CLASS_13_OFFSET   96
+#define CLASS_MAP_OFFSET 104
 
 /* Basic constants and macros */
 #define WSIZE       4       /* Word and header/footer size (bytes) */ 
 #define DSIZE       8       /* Doubleword size (bytes) */
 #define CHUNKSIZE  169   /* Extend heap by this amount (bytes) */
-#define MINI_BLOCK 24       /* hdr(4) prev_ptr(8) next_ptr(8) ftr(4) */
+#define MINI_BLOCK 16       /* hdr(4) prev_off(4) next_off(4) ftr(4) */
 
-/* bit tricks to flag allocated/free */
+/* bit tricks to flag allocated/free. Only free blocks have a footer, so */
+/* whether the block before is allocated is kept in PREVIOUS_ALLOC, and */
+/* the footer is read only when that bit is clear */
 #define CURRENT_ALLOC     1
 #define PREVIOUS_ALLOC    2
 #define NEXT_ALLOC        4
@@ -64,6 +76,147 @@ static char *heap_listp = NULL;
 #define SEG_CLASS_12    61440
 #define SEG_CLASS_13   128880
 
+/*
+ *  Thread-safe mode (-DMM_MT)
+ *  --------------------------
+ *  The heap is split into one arena per CPU, up to MM_ARENAS, each a
+ *  seglist with its own 13 class heads and lock. Threads are dealt out to
+ *  the arenas round robin, and heap_start points at the class heads of
+ *  the arena the thread has locked, so the seglist code below works on
+ *  one arena at a time.
+ *
+ *  An arena grows in chunks taken from mem_sbrk under sbrk_lock. A chunk
+ *  is a multiple of ARENA_UNIT bytes, starts on a unit boundary, and is
+ *  fenced by its own prologue and epilogue, so blocks never coalesce into
+ *  another arena; if the arena's newest chunk is at the top of the heap it
+ *  is extended in place instead. arena_map records the arena of every
+ *  unit, which gives the owner of any block in O(1):
+ *
+ *      chunk: | next chunk(8) | pad(4) | prologue(8) | blocks | epilogue(4) |
+ *
+ *  A block freed by a thread of another arena is pushed with a CAS onto
+ *  the owner's remote list rather than taking the owner's lock. Whoever
+ *  next locks the arena takes the whole list with one exchange and frees
+ *  its blocks there, so cross-thread frees are paid for in batches. The
+ *  list is taken again before the arena grows and when a thread exits,
+ *  so blocks that arrive while it is locked are not left behind.
+ *
+ *  In front of its arena every thread keeps a cache of small blocks, one
+ *  bin per block size from MINI_BLOCK to TC_MAXSIZE. Cached blocks stay
+ *  marked allocated in the heap and are chained through their first 8
+ *  bytes, so malloc and free of a small block touch only the calling
+ *  thread's bins. An empty bin is refilled with TC_BATCH blocks, and a bin
+ *  holding more than TC_MAX blocks gives TC_BATCH of them back, under one
+ *  acquisition of the arena lock each time. mm_init bumps mm_gen, which
+ *  tells every thread its bins point into the old heap; mm_init itself
+ *  must not race other calls.
+ */
+#ifdef MM_MT
+#define TC_MAXSIZE     256  /* largest block size (bytes) kept in a cache */
+#define TC_NBINS       ((TC_MAXSIZE - MINI_BLOCK) / DSIZE + 1)
+#define TC_BATCH         8  /* blocks moved per refill or flush */
+#define TC_MAX          32  /* most blocks a bin holds before flushing */
+
+typedef struct {
+    void *head[TC_NBINS];   /* singly linked through each block's payload */
+    int count[TC_NBINS];
+    unsigned gen;           /* mm_gen the bins were filled under */
+    int registered;         /* tc_key set, so thread exit flushes the bins */
+    struct arena *arena;    /* the arena this thread allocates from */
+} tcache_t;
+
+#ifndef MM_ARENAS
+#define MM_ARENAS        8  /* most independent heaps, at most 256 */
+#endif
+#define ARENA_UNIT    1024  /* chunks are multiples of this (bytes) */
+#define ARENA_MAXUNITS (1 << 17)  /* arena_map covers 128 MB of heap */
+#define CHUNK_OVERHEAD  24  /* next(8) pad(4) prologue(8) epilogue(4) */
+
+typedef struct arena {
+    size_t heads[N_SIZE_CLASS + 1]; /* class heads and map, as at heap_start */
+    pthread_mutex_t lock;
+    void *remote;           /* blocks freed by other arenas' threads */
+    char *chunks;           /* newest chunk, linked to the ones before it */
+    char *chunk_end;        /* first byte past the newest chunk */
+} arena_t;
+
+static arena_t arenas[MM_ARENAS];
+static unsigned char arena_map[ARENA_MAXUNITS];
+static pthread_mutex_t sbrk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static pthread_once_t tc_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tc_key;
+static unsigned mm_gen;
+static unsigned next_arena;
+static int narenas;             /* arenas in use: CPUs, up to MM_ARENAS */
+static __thread tcache_t tcache;
+
+#define ARENA_OF(p) \
+    (&arenas[arena_map[((char *)(p) - (char *)mem_heap_lo()) / ARENA_UNIT]])
+
+#define LOCK()   arena_lock()
+#define UNLOCK() pthread_mutex_unlock(&tcache.arena->lock)
+#else
+#define LOCK()
+#define UNLOCK()
+#endif
+
+/*
+ *  Small-object slabs
+ *  ------------------
+ *  A request of up to SLAB_MAXSIZE bytes is rounded up to a multiple of
+ *  DSIZE and, once its class has seen SLAB_HOT requests, served from a
+ *  slab page holding objects of that one size with no header or footer.
+ *  A page is an allocated block of SLAB_PAGE bytes whose payload starts
+ *  on a SLAB_PAGE boundary of the heap, so the page of an object is its
+ *  address rounded down, and slab_map has a bit for each boundary where
+ *  a page starts. The page's metadata sits in front of its objects:
+ *
+ *      page: | next(4) prev(4) size(2) used(2) avail(2) bump(2) | objects |
+ *
+ *  Pages with a free object are linked on their class's partial list, and
+ *  freed objects on their page's free list by index. A page whose last
+ *  object is freed goes on slab_empty for any class to reuse, up to
+ *  SLAB_KEEP pages, and is freed into the seglist to coalesce beyond
+ *  that; malloc_block gives the kept pages back too before it grows the
+ *  heap. Until a class is hot its requests take ordinary blocks, so a
+ *  trace with a handful of small requests does not pay for a whole page.
+ *  A page that is only partly empty cannot be given back, which is what
+ *  a slab costs on traces that free most of one size and then ask for
+ *  another. SLAB_HOT and SLAB_KEEP can be set with -D; build with
+ *  -DMM_NOSLAB to leave slabs out. MM_MT never has them.
+ */
+#if !defined(MM_MT) && !defined(MM_NOSLAB)
+#define MM_SLAB
+#define SLAB_PAGE     1024  /* page size and alignment (bytes) */
+#define SLAB_MAXSIZE   128  /* largest request served from a page */
+#define SLAB_NCLASS   (SLAB_MAXSIZE / DSIZE)
+#define SLAB_HDR        16  /* page metadata in front of the objects */
+#define SLAB_CAP(size)  ((SLAB_PAGE - WSIZE - SLAB_HDR) / (size))
+#ifndef SLAB_HOT
+#define SLAB_HOT       256  /* requests a class takes before it gets pages */
+#endif
+#ifndef SLAB_KEEP
+#define SLAB_KEEP        1  /* empty pages kept; the rest are freed at once */
+#endif
+#define SLAB_NONE   0xffff  /* end of a page's free list */
+#define SLAB_MAXPAGES (1 << 17)  /* slab_map covers 128 MB of heap */
+
+typedef struct {
+    uint32_t next, prev;    /* partial list, as offsets from mem_heap_lo() */
+    uint16_t size;          /* object size (bytes) */
+    uint16_t used;          /* objects allocated */
+    uint16_t avail;         /* index of the first freed object */
+    uint16_t bump;          /* objects from here on were never handed out */
+} slab_t;
+
+static uint32_t slab_partial[SLAB_NCLASS];  /* pages with a free object */
+static uint32_t slab_empty;     /* pages with none used, linked by next */
+static int slab_nempty;         /* pages on slab_empty, up to SLAB_KEEP */
+static unsigned slab_seen[SLAB_NCLASS];     /* requests, up to SLAB_HOT */
+static uint64_t slab_map[SLAB_MAXPAGES / 64];
+#endif
+
 // Create aliases for driver tests
 // DO NOT CHANGE THE FOLLOWING!
 #ifdef DRIVER
@@ -98,12 +251,12 @@ static char *heap_listp = NULL;
  */
 
 // Align p to a multiple of w bytes
-static inline void* align(const void const* p, unsigned char w) {
+static inline void* align(const void *p, unsigned char w) {
     return (void*)(((uintptr_t)(p) + (w-1)) & ~(w-1));
 }
 
 // Check if the given pointer is 8-byte aligned
-static inline int aligned(const void const* p) {
+static inline int aligned(const void *p) {
     return align(p, 8) == p;
 }
 
@@ -161,6 +314,15 @@ static inline uint32_t GET_NXT_ALLOC(void *p) {
     return (GET_WORD(p) & 0x4);
 }
 
+/* Set / clear the previous-allocated bit in the header of block bp */
+static inline void SET_PRE_ALLOC(void *bp) {
+    PUT_WORD((char *)bp - WSIZE, GET_WORD((char *)bp - WSIZE) | PREVIOUS_ALLOC);
+}
+
+static inline void CLR_PRE_ALLOC(void *bp) {
+    PUT_WORD((char *)bp - WSIZE, GET_WORD((char *)bp - WSIZE) & ~PREVIOUS_ALLOC);
+}
+
 /* Given block ptr bp, compute address of its header and footer */
 static inline void *HDRP(void *bp) {
     return (void *)((char *)bp - WSIZE);
@@ -172,6 +334,7 @@ static inline void *FTRP(void *bp) {
 
 /* Given block ptr bp, compute address of next and previous blocks */
 /* We still need these functions for coalescing adjacent blocks !! */
+/* PREV_BLKP reads the previous block's footer: only if it is free */
 static inline void *NEXT_BLKP(void *bp) {
     return (void *)((char *)bp + GET_SIZE((char *)bp - WSIZE));
 }
@@ -180,13 +343,24 @@ static inline void *PREV_BLKP(void *bp) {
     return (void *)((char *)bp - GET_SIZE((char *)bp - DSIZE));
 }
 
-/* Given block ptr bp, return address to previous/next block */
+/* Given block ptr bp, return address to previous/next block. The links */
+/* are stored as 4-byte offsets from heap_lo, 0 for NULL */
 static inline size_t PREDECESSOR(void *bp) {
-    return *((size_t *)bp);
+    uint32_t off = GET_WORD(bp);
+    return off ? (size_t)(heap_lo + off) : 0;
 }
 
 static inline size_t SUCCESSOR(void *bp) {
-    return *((size_t *)bp + 1);
+    uint32_t off = GET_WORD((char *)bp + WSIZE);
+    return off ? (size_t)(heap_lo + off) : 0;
+}
+
+static inline void SET_PREDECESSOR(void *bp, void *p) {
+    PUT_WORD(bp, p ? (uint32_t)((char *)p - heap_lo) : 0);
+}
+
+static inline void SET_SUCCESSOR(void *bp, void *p) {
+    PUT_WORD((char *)bp + WSIZE, p ? (uint32_t)((char *)p - heap_lo) : 0);
 }
 
 /* Return Max / Min of pair a, b */
@@ -208,37 +382,31 @@ static inline size_t MIN(size_t a, size_t b) {
  *  The following functions help decouple dependency in my code.
  */
 
+/* Classify the given size (bytes) into a class index, 0 for Class 1. */
+/* Classes 1-4 are multiples of SEG_CLASS_1, and Classes 5-11 double from */
+/* SEG_CLASS_5, so the index is a division or the bit length of a quotient */
+static inline int getClassIndex(size_t size) {
+    size_t q;
+
+    if(size <= SEG_CLASS_4)
+        return (size - 1) / SEG_CLASS_1;
+    if(size > SEG_CLASS_12)
+        return 12;
+    if(size > SEG_CLASS_11)
+        return 11;
+    q = (size - 1) / SEG_CLASS_5;
+    return 4 + (q ? 64 - __builtin_clzl(q) : 0);
+}
+
+/* Return address of the bitmap of non-empty classes */
+static inline uint32_t *getClassMap(void) {
+    return (uint32_t *)(heap_start + CLASS_MAP_OFFSET);
+}
+
 /* Classify the given size (bytes) and return address where we store */
 /* the pointer to head of the class */
-static void *getClassHead(size_t size) {
-    char *head;
-    if(size <= SEG_CLASS_1)
-        head = heap_start + CLASS_1_OFFSET;
-    else if(size <= SEG_CLASS_2)
-        head = heap_start + CLASS_2_OFFSET;
-    else if(size <= SEG_CLASS_3)
-        head = heap_start + CLASS_3_OFFSET;
-    else if(size <= SEG_CLASS_4)
-        head = heap_start + CLASS_4_OFFSET;
-    else if(size <= SEG_CLASS_5)
-        head = heap_start + CLASS_5_OFFSET;
-    else if(size <= SEG_CLASS_6)
-        head = heap_start + CLASS_6_OFFSET;
-    else if(size <= SEG_CLASS_7)
-        head = heap_start + CLASS_7_OFFSET;
-    else if(size <= SEG_CLASS_8)
-        head = heap_start + CLASS_8_OFFSET;
-    else if(size <= SEG_CLASS_9)
-        head = heap_start + CLASS_9_OFFSET;
-    else if(size <= SEG_CLASS_10)
-        head = heap_start + CLASS_10_OFFSET;
-    else if(size <= SEG_CLASS_11)
-        head = heap_start + CLASS_11_OFFSET;
-    else if(size <= SEG_CLASS_12)
-        head = heap_start + CLASS_12_OFFSET;
-    else
-        head = heap_start + CLASS_13_OFFSET;
-    return (void *)head;
+static inline void *getClassHead(size_t size) {
+    return (void *)(heap_start + getClassIndex(size) * DSIZE);
 }
 
 /* Insert the list pointed by bp into corresponding size class. The insertion */
@@ -247,7 +415,8 @@ static void insertList(void *bp) {
     size_t size = GET_SIZE(HDRP(bp));
 
     /* Get address of the Class Head that *bp (new first block) belongs to */
-    size_t *class_head = (size_t *)getClassHead(size); 
+    int class = getClassIndex(size);
+    size_t *class_head = (size_t *)(heap_start + class * DSIZE);
 
     /* Preserve the original address where the Class Head points */
     size_t *buffer = (size_t *)(*class_head);
@@ -255,13 +424,16 @@ static void insertList(void *bp) {
     *class_head = (size_t)bp;
 
     /* The new first block's prev_ptr points to Class Head, which is NULL */
-    *((size_t *)bp) = 0;
+    SET_PREDECESSOR(bp, NULL);
     /* The new first block's next_ptr points to the previous first block */
-    *((size_t *)bp + 1) = (size_t)buffer; 
+    SET_SUCCESSOR(bp, buffer);
     /* if the previous first block is not NULL, we should update its prev_ptr */
     /* The previous first block's prev_ptr points to the current first block */
     if(buffer != NULL) {
-        *(buffer) = (size_t)bp;   
+        SET_PREDECESSOR(buffer, bp);
+    }
+    else {
+        *getClassMap() |= 1u << class;
     }
 }
 
@@ -274,9 +446,10 @@ static void removeList(void *bp) {
     /* if the current block is the only block in the list */
     if(!predecessor_bp && !successor_bp) {
         size_t size = GET_SIZE(HDRP(bp));
-        size_t *class_head = (size_t *)getClassHead(size);
-        /* the class head points to NULL */
-        *class_head = (size_t)NULL;
+        int class = getClassIndex(size);
+        /* the class head points to NULL, and the class is now empty */
+        PUT_DSIZE(heap_start + class * DSIZE, 0);
+        *getClassMap() &= ~(1u << class);
     }
     /* if the current is in the head of the list */
     else if(!predecessor_bp && successor_bp) {
@@ -285,29 +458,30 @@ static void removeList(void *bp) {
         /* the class head points to the successor of the current block */
         *class_head = (size_t)successor_bp;
         /* the successor's prev_ptr points to the class head, which is NULL */
-        *((size_t *) successor_bp) = (size_t)NULL;
+        SET_PREDECESSOR(successor_bp, NULL);
     }
     /* if the current block is in the end of the list */
     else if(predecessor_bp && !successor_bp) {
         /* the predecessor's next_ptr points to NULL */
-        *((size_t *)predecessor_bp + 1) = (size_t)NULL;
+        SET_SUCCESSOR(predecessor_bp, NULL);
     }
     /* if the current block is in the middle of the list */
     else {
         /* Update predecessor's next_ptr to the successor */
-        *((size_t *)predecessor_bp + 1) = (size_t)successor_bp;
+        SET_SUCCESSOR(predecessor_bp, successor_bp);
 
         /* Update successor's prev_ptr to the predecessor */
-        *((size_t *)successor_bp) = (size_t)predecessor_bp;
+        SET_PREDECESSOR(successor_bp, predecessor_bp);
     }
 }
 
 /* Coalesce the adjacent blocks. There're 4 Cases here. We remove the current */
 /* block and possible left and right blocks from their size class list. Then, */
 /* merge the lists and insert back into the corresponding class head based on */
-/* the resulting size class it belongs to */
+/* the resulting size class it belongs to. The block before a free block */
+/* is always allocated, so the merged block has PREVIOUS_ALLOC set */
 static void *coalesce(void *bp) {
-    uint32_t prev_alloc = GET_ALLOC(HDRP(PREV_BLKP(bp)));
+    uint32_t prev_alloc = GET_PRE_ALLOC(HDRP(bp));
     uint32_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
     uint32_t size       = GET_SIZE(HDRP(bp));
 
@@ -320,8 +494,8 @@ static void *coalesce(void *bp) {
         removeList(bp);
         removeList(NEXT_BLKP(bp));
 
-        PUT_WORD(HDRP(bp), PACK(size, 0));
-        PUT_WORD(FTRP(bp), PACK(size, 0));
+        PUT_WORD(HDRP(bp), PACK(size, PREVIOUS_ALLOC));
+        PUT_WORD(FTRP(bp), PACK(size, PREVIOUS_ALLOC));
 
         insertList(bp);
     }
@@ -331,8 +505,8 @@ static void *coalesce(void *bp) {
         removeList(bp);
         removeList(PREV_BLKP(bp));
 
-        PUT_WORD(FTRP(bp), PACK(size, 0));
-        PUT_WORD(HDRP(PREV_BLKP(bp)), PACK(size, 0));
+        PUT_WORD(FTRP(bp), PACK(size, PREVIOUS_ALLOC));
+        PUT_WORD(HDRP(PREV_BLKP(bp)), PACK(size, PREVIOUS_ALLOC));
 
         bp = PREV_BLKP(bp);
         insertList(bp);
@@ -345,8 +519,8 @@ static void *coalesce(void *bp) {
         removeList(PREV_BLKP(bp));
         removeList(NEXT_BLKP(bp));
 
-        PUT_WORD(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-        PUT_WORD(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
+        PUT_WORD(HDRP(PREV_BLKP(bp)), PACK(size, PREVIOUS_ALLOC));
+        PUT_WORD(FTRP(NEXT_BLKP(bp)), PACK(size, PREVIOUS_ALLOC));
 
         bp = PREV_BLKP(bp);
         insertList(bp);
@@ -355,18 +529,68 @@ static void *coalesce(void *bp) {
     return bp;
 }
 
+#ifdef MM_MT
+/* Get at least *sizep bytes for the thread's arena. Returns the bp of a */
+/* block whose header is the arena's old epilogue or a new chunk's, and */
+/* sets *sizep to that block's size; the caller writes the block out */
+static void *arena_sbrk(size_t *sizep) {
+    arena_t *a = tcache.arena;
+    char *lo = mem_heap_lo();
+    char *brk, *bp;
+    size_t size = *sizep;
+    int grow;
+
+    pthread_mutex_lock(&sbrk_lock);
+    brk = (char *)mem_heap_hi() + 1;
+    grow = (a->chunk_end == brk);
+    if(!grow)
+        size += CHUNK_OVERHEAD;
+    size = (size + ARENA_UNIT - 1) & ~(size_t)(ARENA_UNIT - 1);
+    if((size_t)(brk - lo) + size > (size_t)ARENA_MAXUNITS * ARENA_UNIT ||
+       (bp = mem_sbrk(size)) == (void *)-1) {
+        pthread_mutex_unlock(&sbrk_lock);
+        return NULL;
+    }
+    memset(arena_map + (brk - lo) / ARENA_UNIT, a - arenas, size / ARENA_UNIT);
+    pthread_mutex_unlock(&sbrk_lock);
+
+    a->chunk_end = bp + size;
+    if(!grow) {
+        /* Link the chunk in and fence it off with a prologue */
+        PUT_DSIZE(bp, (size_t)a->chunks);
+        PUT_WORD(bp + DSIZE, 0);
+        PUT_WORD(bp + DSIZE + 1*WSIZE, PACK(DSIZE, CURRENT_ALLOC));
+        PUT_WORD(bp + DSIZE + 2*WSIZE, PACK(DSIZE, CURRENT_ALLOC));
+        PUT_WORD(bp + DSIZE + 3*WSIZE, PACK(0, CURRENT_ALLOC | PREVIOUS_ALLOC));
+        a->chunks = bp;
+        bp += CHUNK_OVERHEAD;
+        size -= CHUNK_OVERHEAD;
+    }
+    *sizep = size;
+    return bp;
+}
+#endif
+
 static void *extend_heap(size_t words) {
     char *bp;
     size_t size;
 
     /* Allocate multiple of DSIZE to maintain alignment */
     size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
+#ifdef MM_MT
+    if ((bp = arena_sbrk(&size)) == NULL)
+        return NULL;
+#else
     if ((long)(bp = mem_sbrk(size)) == -1)
         return NULL;
+#endif
 
-    /* Initialize free block header/footer and the epilogue header */
-    PUT_WORD(HDRP(bp), PACK(size, 0));
-    PUT_WORD(FTRP(bp), PACK(size, 0));
+    /* Initialize free block header/footer and the epilogue header. The */
+    /* old epilogue header, now the block's, knows if the block before is */
+    /* allocated */
+    uint32_t prev_alloc = GET_PRE_ALLOC(HDRP(bp));
+    PUT_WORD(HDRP(bp), PACK(size, prev_alloc));
+    PUT_WORD(FTRP(bp), PACK(size, prev_alloc));
     PUT_WORD(HDRP(NEXT_BLKP(bp)), PACK(0, CURRENT_ALLOC));
 
     /* Build the list for particular Size Class */
@@ -377,51 +601,9 @@ static void *extend_heap(size_t words) {
 }
 
 /* Find a block with asize (bytes) within particular Size Class */ 
-/* based on the arg (class) */
-static void *findInClass(size_t asize, int class) {
-    void *bp = NULL;
-
-    switch(class) {
-        case 1:
-            bp = (void *)(*((size_t *)(heap_start + CLASS_1_OFFSET)));
-            break; 
-        case 2:
-            bp = (void *)((*(size_t *)(heap_start + CLASS_2_OFFSET)));
-            break;
-        case 3:
-            bp = (void *)((*(size_t *)(heap_start + CLASS_3_OFFSET)));
-            break;
-        case 4:
-            bp = (void *)((*(size_t *)(heap_start + CLASS_4_OFFSET)));
-            break;
-        case 5:
-            bp = (void *)((*(size_t *)(heap_start + CLASS_5_OFFSET)));
-            break;
-        case 6:
-            bp = (void *)((*(size_t *)(heap_start + CLASS_6_OFFSET)));
-            break;
-        case 7:
-            bp = (void *)((*(size_t *)(heap_start + CLASS_7_OFFSET)));
-            break;
-        case 8:
-            bp = (void *)((*(size_t *)(heap_start + CLASS_8_OFFSET)));
-            break;
-        case 9:
-            bp = (void *)((*(size_t *)(heap_start + CLASS_9_OFFSET)));
-            break;
-        case 10:
-            bp = (void *)((*(size_t *)(heap_start + CLASS_10_OFFSET)));
-            break;
-        case 11:
-            bp = (void *)((*(size_t *)(heap_start + CLASS_11_OFFSET)));
-            break;
-        case 12:
-            bp = (void *)((*(size_t *)(heap_start + CLASS_12_OFFSET)));
-            break;
-        case 13:
-            bp = (void *)((*(size_t *)(heap_start + CLASS_13_OFFSET)));
-        break;
-    }
+/* based on the arg (class index) */
+static inline void *findInClass(size_t asize, int class) {
+    void *bp = (void *)GET_DSIZE(heap_start + class * DSIZE);
 
     while(bp != NULL) {
         if(GET_SIZE(HDRP(bp)) >= asize)
@@ -434,132 +616,497 @@ static void *findInClass(size_t asize, int class) {
 
 /* Find the block larger than asize (bytes) from the lowest size class to */ 
 /* the highest. Return the bp of the block if found. Otherwise, return NULL */
+/* Only the non-empty classes in the bitmap are visited, lowest first, and */
+/* every block in a class above asize's own is big enough */
 static void *find_fit(size_t asize) {
+    int class = getClassIndex(asize);
+    uint32_t map = *getClassMap() & (~0u << class);
     void *bp;
-    int i = 0;
-    if(asize <= SEG_CLASS_1) {
-        for(i = 1; i <= N_SIZE_CLASS; i++) {
-            bp = findInClass(asize, i);
-            if(bp != NULL)
-                break;
-        }
+
+    while(map) {
+        if((bp = findInClass(asize, __builtin_ctz(map))) != NULL)
+            return bp;
+        map &= map - 1;
     }
-    else if(asize <= SEG_CLASS_2) {
-        for(i = 2; i <= N_SIZE_CLASS; i++) {
-            bp = findInClass(asize, i);
-            if(bp != NULL)
-                break;
-        }
+    return NULL;
+}
+
+/* Allocate asize bytes of memory from Ptr bp to the user. If the remaining */
+/* size is larger than the MINI_BLOCK, we insert the remaining block back to */
+/* the list. Otherwise, just give them all */
+static void place(void *bp, size_t asize) {
+    size_t csize = GET_SIZE(HDRP(bp));
+    size_t remaining_size = csize - asize;
+
+    /* remove the block at bp from its size class list */
+    removeList(bp);
+
+    if(remaining_size >= MINI_BLOCK) {
+        /* Update the asize block; allocated blocks have no footer */
+        PUT_WORD(HDRP(bp), PACK(asize, CURRENT_ALLOC | PREVIOUS_ALLOC));
+
+        bp = NEXT_BLKP(bp);
+        PUT_WORD(HDRP(bp), PACK(remaining_size, PREVIOUS_ALLOC));
+        PUT_WORD(FTRP(bp), PACK(remaining_size, PREVIOUS_ALLOC));
+
+        insertList(bp);
     }
-    else if(asize <= SEG_CLASS_3) {
-        for(i = 3; i <= N_SIZE_CLASS; i++) {
-            bp = findInClass(asize, i);
-            if(bp != NULL)
-                break;
-        }
+    else {
+        PUT_WORD(HDRP(bp), PACK(csize, CURRENT_ALLOC | PREVIOUS_ALLOC));
+        SET_PRE_ALLOC(NEXT_BLKP(bp));
     }
-    else if(asize <= SEG_CLASS_4) {
-        for(i = 4; i <= N_SIZE_CLASS; i++) {
-            bp = findInClass(asize, i);
-            if(bp != NULL)
-                break;
-        }
+
+    return;
+}
+
+#ifdef MM_SLAB
+static int slab_release(void);
+#endif
+#ifdef MM_MT
+static int arena_drain(void);
+#endif
+
+/* Find or make room for an asize (bytes) block and allocate it. The */
+/* caller holds heap_lock in thread-safe mode */
+static void *malloc_block(size_t asize) {
+    size_t extendsize; /* Amount to extend heap if no fit */
+    char *bp;
+
+    /* Search for the free list */
+    if ((bp = find_fit(asize)) != NULL) {
+        place(bp, asize);
+        checkheap(1);  // Let's make sure the heap is ok!
+        if (!aligned(bp))
+            printf("Not aligned (Found)\n");
+        return bp;
     }
-    else if(asize <= SEG_CLASS_5) {
-        for(i = 5; i <= N_SIZE_CLASS; i++) {
-            bp = findInClass(asize, i);
-            if(bp != NULL)
-                break;
-        }
+#ifdef MM_SLAB
+    /* Give the empty slab pages back and look again before growing */
+    if (slab_release() && (bp = find_fit(asize)) != NULL) {
+        place(bp, asize);
+        checkheap(1);
+        return bp;
     }
-    else if(asize <= SEG_CLASS_6) {
-        for(i = 6; i <= N_SIZE_CLASS; i++) {
-            bp = findInClass(asize, i);
-            if(bp != NULL)
-                break;
-        }
+#endif
+#ifdef MM_MT
+    /* Free what other threads handed back since the lock, and look again */
+    if (arena_drain() && (bp = find_fit(asize)) != NULL) {
+        place(bp, asize);
+        checkheap(1);
+        return bp;
     }
-    else if(asize <= SEG_CLASS_7) {
-        for(i = 7; i <= N_SIZE_CLASS; i++) {
-            bp = findInClass(asize, i);
-            if(bp != NULL)
-                break;
+#endif
+    /* No fit found. Get more memory and place the block */
+    extendsize = MAX(asize, CHUNKSIZE);
+    if((bp = extend_heap(extendsize/WSIZE)) == NULL)
+        return NULL;
+    if (!aligned(bp))
+        printf("Not aligned (Not Found)\n");
+    place(bp, asize);
+    checkheap(1);      // Let's make sure the heap is ok!
+    return bp;
+}
+
+/* Mark the allocated block at ptr free and put it back in its size class. */
+/* The caller holds heap_lock in thread-safe mode */
+static void free_block(void *ptr) {
+    /* update the header and footer of the block's a/f bit, and tell the */
+    /* next block this one is free */
+    size_t size = GET_SIZE(HDRP(ptr));
+    uint32_t prev_alloc = GET_PRE_ALLOC(HDRP(ptr));
+    PUT_WORD(HDRP(ptr), PACK(size, prev_alloc));
+    PUT_WORD(FTRP(ptr), PACK(size, prev_alloc));
+    CLR_PRE_ALLOC(NEXT_BLKP(ptr));
+
+    /* insert the block back into the list */
+    insertList(ptr);
+    coalesce(ptr);
+}
+
+/* Resize the allocated block at bp to asize bytes without moving it, and */
+/* return bp, or NULL if it has to move. A shrink splits the tail off as a */
+/* free block; a growth takes in a free block after bp and, if bp then */
+/* ends at the epilogue, sbrks the rest. Build with -DMM_REALLOC_GROW=n to */
+/* let a block keep asize/n spare bytes, sbrked ahead of time when it grows */
+/* at the top, so its next growths need no sbrk. The caller holds heap_lock */
+static void *realloc_block(void *bp, size_t asize) {
+    size_t csize = GET_SIZE(HDRP(bp));
+    void *next = NEXT_BLKP(bp);
+    size_t spare = 0;
+
+#ifdef MM_REALLOC_GROW
+    spare = DSIZE * (asize / MM_REALLOC_GROW / DSIZE);
+#endif
+    if(asize > csize) {
+        size_t room = csize;
+
+        if(!GET_ALLOC(HDRP(next)))
+            room += GET_SIZE(HDRP(next));
+        if(room < asize) {
+#ifdef MM_MT
+            return NULL;
+#else
+            /* Short, but bp ends at the epilogue: sbrk the rest */
+            if(GET_SIZE(HDRP((char *)bp + room)) != 0 ||
+               (long)mem_sbrk(asize + spare - room) == -1)
+                return NULL;
+            room = asize + spare;
+            PUT_WORD(HDRP((char *)bp + room), PACK(0, CURRENT_ALLOC));
+#endif
         }
+        if(!GET_ALLOC(HDRP(next)))
+            removeList(next);
+        csize = room;
+        PUT_WORD(HDRP(bp), PACK(csize, GET_PRE_ALLOC(HDRP(bp)) | CURRENT_ALLOC));
+        SET_PRE_ALLOC(NEXT_BLKP(bp));
     }
-    else if(asize <= SEG_CLASS_8) {
-        for(i = 8; i <= N_SIZE_CLASS; i++) {
-            bp = findInClass(asize, i);
-            if(bp != NULL)
-                break;
-        }
+
+    /* Give the tail back if it makes a block of its own */
+    asize += spare;
+    if(csize > asize && csize - asize >= MINI_BLOCK) {
+        PUT_WORD(HDRP(bp), PACK(asize, GET_PRE_ALLOC(HDRP(bp)) | CURRENT_ALLOC));
+        next = NEXT_BLKP(bp);
+        PUT_WORD(HDRP(next), PACK(csize - asize, CURRENT_ALLOC | PREVIOUS_ALLOC));
+        free_block(next);
     }
-    else if(asize <= SEG_CLASS_9) {
-        for(i = 9; i <= N_SIZE_CLASS; i++) {
-            bp = findInClass(asize, i);
-            if(bp != NULL)
-                break;
-        }
+    checkheap(1);
+    return bp;
+}
+
+#ifdef MM_SLAB
+/* Convert between slab pages and the offsets kept in their lists */
+static inline slab_t *SLAB_AT(uint32_t off) {
+    return off ? (slab_t *)((char *)mem_heap_lo() + off) : NULL;
+}
+
+static inline uint32_t SLAB_OFF(slab_t *page) {
+    return (char *)page - (char *)mem_heap_lo();
+}
+
+/* Return whether ptr lies in a slab page, and the page it lies in */
+static inline int is_slab(const void *ptr) {
+    size_t i = ((char *)ptr - (char *)mem_heap_lo()) / SLAB_PAGE;
+    return i < SLAB_MAXPAGES && ((slab_map[i / 64] >> (i % 64)) & 1);
+}
+
+static inline slab_t *slab_of(const void *ptr) {
+    size_t off = (char *)ptr - (char *)mem_heap_lo();
+    return SLAB_AT(off - off % SLAB_PAGE);
+}
+
+static inline void slab_mark(slab_t *page, int on) {
+    size_t i = SLAB_OFF(page) / SLAB_PAGE;
+    if(on)
+        slab_map[i / 64] |= (uint64_t)1 << (i % 64);
+    else
+        slab_map[i / 64] &= ~((uint64_t)1 << (i % 64));
+}
+
+/* Put page at the front of the partial list of class, or take it off */
+static void slab_link(int class, slab_t *page) {
+    slab_t *head = SLAB_AT(slab_partial[class]);
+
+    page->prev = 0;
+    page->next = slab_partial[class];
+    if(head != NULL)
+        head->prev = SLAB_OFF(page);
+    slab_partial[class] = SLAB_OFF(page);
+}
+
+static void slab_unlink(int class, slab_t *page) {
+    if(page->prev)
+        SLAB_AT(page->prev)->next = page->next;
+    else
+        slab_partial[class] = page->next;
+    if(page->next)
+        SLAB_AT(page->next)->prev = page->prev;
+}
+
+/* Return where the first page boundary in the free block at bp that can */
+/* start a page is, leaving 0 or at least MINI_BLOCK bytes in front of it */
+static inline char *slab_room(char *bp) {
+    char *lo = mem_heap_lo();
+    char *page = lo + ((bp - lo + SLAB_PAGE - 1) & ~(size_t)(SLAB_PAGE - 1));
+
+    if(page > bp && page - bp < MINI_BLOCK)
+        page += SLAB_PAGE;
+    return page;
+}
+
+/* Allocate a page out of the free block at bp, which has room for one. */
+/* What is left of the block before and after the page stays free */
+static slab_t *slab_carve(char *bp) {
+    char *page = slab_room(bp);
+    char *end = NEXT_BLKP(bp);
+    size_t size = SLAB_PAGE;
+
+    removeList(bp);
+    if(page > bp) {
+        PUT_WORD(HDRP(bp), PACK(page - bp, PREVIOUS_ALLOC));
+        PUT_WORD(FTRP(bp), PACK(page - bp, PREVIOUS_ALLOC));
+        insertList(bp);
     }
-    else if(asize <= SEG_CLASS_10) {
-        for(i = 10; i <= N_SIZE_CLASS; i++) {
-            bp = findInClass(asize, i);
-            if(bp != NULL)
-                break;
+    if(end - (page + SLAB_PAGE) < MINI_BLOCK) {
+        size = end - page;  /* too little left to free; the page keeps it */
+        SET_PRE_ALLOC(end);
+    } else {
+        char *rest = page + SLAB_PAGE;
+        PUT_WORD(HDRP(rest), PACK(end - rest, PREVIOUS_ALLOC));
+        PUT_WORD(FTRP(rest), PACK(end - rest, PREVIOUS_ALLOC));
+        insertList(rest);
+    }
+    PUT_WORD(HDRP(page), PACK(size, CURRENT_ALLOC |
+                                    (page > bp ? 0 : PREVIOUS_ALLOC)));
+    slab_mark((slab_t *)page, 1);
+    return (slab_t *)page;
+}
+
+/* Make a new page: out of a free block big enough to hold one on a page */
+/* boundary, or else out of the top of the heap, growing it only as far */
+/* as the page needs past the free block already at the top */
+static slab_t *slab_new_page(void) {
+    char *lo = mem_heap_lo();
+    char *brk = (char *)mem_heap_hi() + 1;
+    char *bp;
+    size_t size;
+
+    bp = find_fit(2*SLAB_PAGE + MINI_BLOCK);
+    if(bp == NULL || slab_room(bp) + SLAB_PAGE > (char *)NEXT_BLKP(bp)) {
+        /* Grow the block at the top, free or new, to fit a page */
+        bp = GET_PRE_ALLOC(brk - WSIZE) ? brk : brk - GET_SIZE(brk - DSIZE);
+        size = slab_room(bp) + SLAB_PAGE - bp;
+        if(bp + size > brk) {
+            if(bp + size - lo > (long)SLAB_MAXPAGES * SLAB_PAGE ||
+               mem_sbrk(bp + size - brk) == (void *)-1)
+                return NULL;
+            if(bp < brk)
+                removeList(bp);
+            PUT_WORD(HDRP(bp), PACK(size, PREVIOUS_ALLOC));
+            PUT_WORD(FTRP(bp), PACK(size, PREVIOUS_ALLOC));
+            PUT_WORD(HDRP(NEXT_BLKP(bp)), PACK(0, CURRENT_ALLOC));
+            insertList(bp);
         }
     }
-    else if(asize <= SEG_CLASS_11) {
-        for(i = 11; i <= N_SIZE_CLASS; i++) {
-            bp = findInClass(asize, i);
-            if(bp != NULL)
-                break;
+    if(slab_room(bp) + SLAB_PAGE - lo > (long)SLAB_MAXPAGES * SLAB_PAGE)
+        return NULL;
+    return slab_carve(bp);
+}
+
+/* Allocate an object for a request of size bytes from a page of its */
+/* class. Return NULL if the class is not hot yet or no page can be had */
+static void *slab_malloc(size_t size) {
+    int class = (size - 1) / DSIZE;
+    slab_t *page = SLAB_AT(slab_partial[class]);
+    char *obj;
+
+    if(page == NULL) {
+        if(slab_seen[class] < SLAB_HOT) {
+            slab_seen[class]++;
+            return NULL;
+        }
+        if(slab_empty) {
+            page = SLAB_AT(slab_empty);
+            slab_empty = page->next;
+            slab_nempty--;
+        } else if((page = slab_new_page()) == NULL) {
+            return NULL;
         }
+        page->size = (class + 1) * DSIZE;
+        page->used = 0;
+        page->avail = SLAB_NONE;
+        page->bump = 0;
+        slab_link(class, page);
     }
-    else if(asize <= SEG_CLASS_12) {
-        for(i = 12; i <= N_SIZE_CLASS; i++) {
-            bp = findInClass(asize, i);
-            if(bp != NULL)
-                break;
+
+    if(page->avail != SLAB_NONE) {
+        obj = (char *)page + SLAB_HDR + page->avail * page->size;
+        page->avail = *(uint16_t *)obj;
+    } else {
+        obj = (char *)page + SLAB_HDR + page->bump++ * page->size;
+    }
+    if(++page->used == SLAB_CAP(page->size))
+        slab_unlink(class, page);
+    return obj;
+}
+
+/* Free the object at ptr into its page. Once its last object is gone the */
+/* page goes onto slab_empty, or back to the seglist if SLAB_KEEP are there */
+static void slab_free(void *ptr) {
+    slab_t *page = slab_of(ptr);
+    int class = page->size / DSIZE - 1;
+
+    if(page->used-- == SLAB_CAP(page->size))
+        slab_link(class, page);
+    *(uint16_t *)ptr = page->avail;
+    page->avail = ((char *)ptr - (char *)page - SLAB_HDR) / page->size;
+    if(page->used == 0) {
+        slab_unlink(class, page);
+        if(slab_nempty < SLAB_KEEP) {
+            page->next = slab_empty;
+            slab_empty = SLAB_OFF(page);
+            slab_nempty++;
+        } else {
+            slab_mark(page, 0);
+            free_block(page);
         }
     }
-    else {
-        for(i = 13; i <= N_SIZE_CLASS; i++) {
-            bp = findInClass(asize, i);
-            if(bp != NULL)
-                break;
+}
+
+/* Give every empty page back to the seglist. Return whether there were */
+/* any */
+static int slab_release(void) {
+    slab_t *page;
+
+    if(!slab_empty)
+        return 0;
+    while((page = SLAB_AT(slab_empty)) != NULL) {
+        slab_empty = page->next;
+        slab_mark(page, 0);
+        free_block(page);
+    }
+    slab_nempty = 0;
+    return 1;
+}
+#endif
+
+#ifdef MM_MT
+static void arena_init(void) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    narenas = (ncpus < 1) ? 1 : (ncpus > MM_ARENAS) ? MM_ARENAS : ncpus;
+    for(int i = 0; i < MM_ARENAS; i++)
+        pthread_mutex_init(&arenas[i].lock, NULL);
+}
+
+static void tc_destroy(void *arg);
+
+static void tc_key_init(void) {
+    pthread_key_create(&tc_key, tc_destroy);
+}
+
+/* Return the calling thread's cache, emptied if it belongs to an old heap */
+static tcache_t *tc_get(void) {
+    tcache_t *tc = &tcache;
+    unsigned gen = __atomic_load_n(&mm_gen, __ATOMIC_ACQUIRE);
+
+    if(tc->gen != gen) {
+        memset(tc->head, 0, sizeof(tc->head));
+        memset(tc->count, 0, sizeof(tc->count));
+        tc->gen = gen;
+        if(!tc->registered) {
+            pthread_once(&tc_once, tc_key_init);
+            pthread_setspecific(tc_key, tc);
+            tc->arena = &arenas[__atomic_fetch_add(&next_arena, 1,
+                                    __ATOMIC_RELAXED) % narenas];
+            tc->registered = 1;
         }
     }
+    return tc;
+}
 
-    return bp;
+/* Free the blocks other threads have pushed on the remote list of the */
+/* thread's arena, which it holds locked. Returns 0 if there were none */
+static int arena_drain(void) {
+    arena_t *a = tcache.arena;
+    void *bp, *next;
+
+    if(__atomic_load_n(&a->remote, __ATOMIC_RELAXED) == NULL)
+        return 0;
+    bp = __atomic_exchange_n(&a->remote, NULL, __ATOMIC_ACQUIRE);
+    for(; bp != NULL; bp = next) {
+        next = (void *)GET_DSIZE(bp);
+        free_block(bp);
+    }
+    return 1;
 }
 
-/* Allocate asize bytes of memory from Ptr bp to the user. If the remaining */
-/* size is larger than the MINI_BLOCK, we insert the remaining block back to */
-/* the list. Otherwise, just give them all */
-static void place(void *bp, size_t asize) {
-    size_t csize = GET_SIZE(HDRP(bp));
-    size_t remaining_size = csize - asize;
+/* Lock the thread's arena and point heap_start at its class heads. Then */
+/* free the blocks other threads have pushed on its remote list */
+static void arena_lock(void) {
+    arena_t *a = tc_get()->arena;
 
-    /* remove the block at bp from its size class list */
-    removeList(bp);
+    pthread_mutex_lock(&a->lock);
+    heap_start = (char *)a->heads;
+    arena_drain();
+}
 
-    if(remaining_size >= MINI_BLOCK) {
-        /* Update the asize block */
-        PUT_WORD(HDRP(bp), PACK(asize, CURRENT_ALLOC));
-        PUT_WORD(FTRP(bp), PACK(asize, CURRENT_ALLOC));
+/* Hand the block at ptr back to arena a, which another thread owns */
+static void remote_free(arena_t *a, void *ptr) {
+    void *head = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
 
-        bp = NEXT_BLKP(bp);
-        PUT_WORD(HDRP(bp), PACK(remaining_size, 0));
-        PUT_WORD(FTRP(bp), PACK(remaining_size, 0));
+    do {
+        PUT_DSIZE(ptr, (size_t)head);
+    } while(!__atomic_compare_exchange_n(&a->remote, &head, ptr, 1,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
 
-        insertList(bp);
+/* Give every block in the exiting thread's bins back to the heap, with */
+/* whatever other threads freed into its arena while it was flushing */
+static void tc_destroy(void *arg) {
+    tcache_t *tc = (tcache_t *)arg;
+    void *bp;
+
+    if(tc->gen != __atomic_load_n(&mm_gen, __ATOMIC_ACQUIRE))
+        return;
+    LOCK();
+    for(int i = 0; i < TC_NBINS; i++) {
+        while((bp = tc->head[i]) != NULL) {
+            tc->head[i] = (void *)GET_DSIZE(bp);
+            free_block(bp);
+        }
+        tc->count[i] = 0;
     }
-    else {
-        PUT_WORD(HDRP(bp), PACK(csize, CURRENT_ALLOC));
-        PUT_WORD(FTRP(bp), PACK(csize, CURRENT_ALLOC));
+    arena_drain();
+    UNLOCK();
+}
+
+/* Allocate a small asize (bytes) block from the thread's cache, refilling */
+/* its bin with TC_BATCH blocks from the heap when it is empty */
+static void *tc_malloc(size_t asize) {
+    tcache_t *tc = tc_get();
+    int bin = (asize - MINI_BLOCK) / DSIZE;
+    void *bp;
+
+    if(tc->head[bin] == NULL) {
+        LOCK();
+        for(int i = 0; i < TC_BATCH; i++) {
+            if((bp = malloc_block(asize)) == NULL)
+                break;
+            PUT_DSIZE(bp, (size_t)tc->head[bin]);
+            tc->head[bin] = bp;
+            tc->count[bin]++;
+        }
+        UNLOCK();
+        if(tc->head[bin] == NULL)
+            return NULL;
     }
+    bp = tc->head[bin];
+    tc->head[bin] = (void *)GET_DSIZE(bp);
+    tc->count[bin]--;
+    return bp;
+}
 
-    return;
+/* Put a small block of size bytes in the thread's cache, handing TC_BATCH */
+/* blocks back to the heap when its bin grows past TC_MAX */
+static void tc_free(void *ptr, size_t size) {
+    tcache_t *tc = tc_get();
+    int bin = (size - MINI_BLOCK) / DSIZE;
+    void *bp;
+
+    PUT_DSIZE(ptr, (size_t)tc->head[bin]);
+    tc->head[bin] = ptr;
+    if(++tc->count[bin] <= TC_MAX)
+        return;
+    LOCK();
+    for(int i = 0; i < TC_BATCH; i++) {
+        bp = tc->head[bin];
+        tc->head[bin] = (void *)GET_DSIZE(bp);
+        free_block(bp);
+    }
+    UNLOCK();
+    tc->count[bin] -= TC_BATCH;
 }
+#endif
 
 /*
  *  End Self defined helper Functions by Chih-Ang
@@ -575,8 +1122,24 @@ static void place(void *bp, size_t asize) {
  * Initialize: return -1 on error, 0 on success.
  */
 int mm_init(void) {
-    /* Create 13*DSZIE bytes to store address to 13 Class Head */
-    if ((heap_start = mem_sbrk(13*DSIZE)) == (void *)-1)
+    heap_lo = mem_heap_lo();
+#ifdef MM_MT
+    /* Chunks start on a unit boundary, as arena_map assumes */
+    size_t pad = -mem_heapsize() & (ARENA_UNIT - 1);
+    if (pad && mem_sbrk(pad) == (void *)-1)
+       return -1;
+    pthread_once(&arena_once, arena_init);
+    for (int i = 0; i < MM_ARENAS; i++) {
+        memset(arenas[i].heads, 0, sizeof(arenas[i].heads));
+        arenas[i].remote = NULL;
+        arenas[i].chunks = NULL;
+        arenas[i].chunk_end = NULL;
+    }
+    __atomic_fetch_add(&mm_gen, 1, __ATOMIC_RELEASE);
+    return 0;
+#else
+    /* Create 14*DSZIE bytes to store address to 13 Class Head and the map */
+    if ((heap_start = mem_sbrk(14*DSIZE)) == (void *)-1)
        return -1;
     /* initialize the class heads to NULL */    
     PUT_DSIZE(heap_start + CLASS_1_OFFSET,  0);
@@ -592,6 +1155,7 @@ int mm_init(void) {
     PUT_DSIZE(heap_start + CLASS_11_OFFSET, 0);
     PUT_DSIZE(heap_start + CLASS_12_OFFSET, 0);
     PUT_DSIZE(heap_start + CLASS_13_OFFSET, 0);
+    PUT_DSIZE(heap_start + CLASS_MAP_OFFSET, 0);
 
     /* Create 4*WSIZE bytes to initialize the heap list */
     if ((heap_listp = mem_sbrk(4*WSIZE)) == (void *)-1)
@@ -603,14 +1167,31 @@ int mm_init(void) {
     /* Prologue footer */  
     PUT_WORD(heap_listp + 2*WSIZE, PACK(DSIZE, CURRENT_ALLOC));
     /* Epilogue header */   
-    PUT_WORD(heap_listp + 3*WSIZE, PACK(0,     CURRENT_ALLOC));
+    PUT_WORD(heap_listp + 3*WSIZE, PACK(0, CURRENT_ALLOC | PREVIOUS_ALLOC));
 
     heap_listp += DSIZE;
 
+#ifdef MM_SLAB
+    memset(slab_partial, 0, sizeof(slab_partial));
+    memset(slab_seen, 0, sizeof(slab_seen));
+    memset(slab_map, 0, sizeof(slab_map));
+    slab_empty = 0;
+    slab_nempty = 0;
+#endif
+
     if(extend_heap(CHUNKSIZE/WSIZE) == NULL) {
         return -1;
     }
     return 0;
+#endif
+}
+
+/* Adjust block size to include the header and alignment reqs. */
+static inline size_t adjust_size(size_t size) {
+    if (size <= MINI_BLOCK - WSIZE)
+       return MINI_BLOCK;
+    /* Force asize to be rounded (up) to a multiple of DSIZE in bytes */
+    return DSIZE * ((size + (WSIZE) + (DSIZE-1)) / DSIZE);
 }
 
 /*
@@ -618,35 +1199,24 @@ int mm_init(void) {
  */
 void *malloc (size_t size) {
     size_t asize;      /* Adjusted block size */
-    size_t extendsize; /* Amount to extend heap if no fit */
     char *bp; 
     
     if (size == 0)
         return NULL;
 
-    /* Adjust block size to include overhead and alignment reqs. */
-    if (size <= 2*DSIZE)                                         
-       asize = MINI_BLOCK;                                        
-    else
-    /* Force asize to be rounded (up) to a multiple of DSIZE in bytes */
-       asize = DSIZE * ((size + (DSIZE) + (DSIZE-1)) / DSIZE); 
-
-    /* Search for the free list */
-    if ((bp = find_fit(asize)) != NULL) {
-        place(bp, asize);
-        checkheap(1);  // Let's make sure the heap is ok!
-        if (!aligned(bp))
-            printf("Not aligned (Found)\n");
+#ifdef MM_SLAB
+    if (size <= SLAB_MAXSIZE && (bp = slab_malloc(size)) != NULL)
         return bp;
-    }
-    /* No fit found. Get more memory and place the block */
-    extendsize = MAX(asize, CHUNKSIZE);
-    if((bp = extend_heap(extendsize/WSIZE)) == NULL)
-        return NULL;
-    if (!aligned(bp))
-        printf("Not aligned (Not Found)\n");
-    place(bp, asize);
-    checkheap(1);      // Let's make sure the heap is ok!
+#endif
+
+    asize = adjust_size(size);
+#ifdef MM_MT
+    if (asize <= TC_MAXSIZE)
+        return tc_malloc(asize);
+#endif
+    LOCK();
+    bp = malloc_block(asize);
+    UNLOCK();
     return bp;
 }
 
@@ -658,23 +1228,37 @@ void free (void *ptr) {
     if (ptr == NULL) {
         return;
     }
+#ifdef MM_SLAB
+    if (is_slab(ptr)) {
+        slab_free(ptr);
+        return;
+    }
+#endif
     /* check if ptr was retruned by an eariler call to malloc-family */
      if (FTRP(ptr) != (void *)((char *)ptr + GET_SIZE(HDRP(ptr)) - DSIZE)) {
          printf("Error: %p is illegal pointer\n", ptr);
          return;
      }
-    /* update the header and footer of the block's a/f bit */
+#ifdef MM_MT
+    arena_t *a = ARENA_OF(ptr);
+    if (a != tc_get()->arena) {
+        remote_free(a, ptr);
+        return;
+    }
     size_t size = GET_SIZE(HDRP(ptr));
-    PUT_WORD(HDRP(ptr), PACK(size, 0));
-    PUT_WORD(FTRP(ptr), PACK(size, 0));
-
-    /* insert the block back into the list */
-    insertList(ptr);
-    coalesce(ptr);
+    if (size <= TC_MAXSIZE) {
+        tc_free(ptr, size);
+        return;
+    }
+#endif
+    LOCK();
+    free_block(ptr);
+    UNLOCK();
 }
 
 /*
- * realloc - you may want to look at mm-naive.c
+ * realloc - resize the block in place if there is room, otherwise move
+ * it: malloc a new block, copy the data over and free the old one
  */
 void *realloc(void *oldptr, size_t size) {
     size_t oldsize;
@@ -691,6 +1275,43 @@ void *realloc(void *oldptr, size_t size) {
        return malloc(size);
     }
 
+#ifdef MM_SLAB
+    /* A request of the same size class keeps its slab object */
+    if(is_slab(oldptr)) {
+        oldsize = slab_of(oldptr)->size;
+        if(size <= oldsize && size > oldsize - DSIZE)
+            return oldptr;
+    }
+    else
+#endif
+    {
+#ifdef MM_MT
+        /* Only the calling thread's arena can be resized under its lock */
+        if(ARENA_OF(oldptr) == tc_get()->arena)
+#endif
+        {
+            LOCK();
+            newptr = realloc_block(oldptr, adjust_size(size));
+            UNLOCK();
+            if(newptr)
+                return newptr;
+        }
+    }
+
+    /* NOTE: without size for HEADER */
+#ifdef MM_SLAB
+    if(is_slab(oldptr))
+        oldsize = slab_of(oldptr)->size;
+    else
+#endif
+    oldsize = GET_SIZE(HDRP(oldptr)) - WSIZE;
+
+#ifdef MM_REALLOC_GROW
+    /* A block that moves to grow takes its spare room along */
+    if(size > oldsize)
+        newptr = malloc(size + size / MM_REALLOC_GROW);
+    else
+#endif
     newptr = malloc(size);
 
     /* If realloc() fails, the original block is left untouched  */
@@ -698,8 +1319,7 @@ void *realloc(void *oldptr, size_t size) {
        return 0;
     }
 
-    /* Copy the old data. NOTE: without size for HEADER */
-    oldsize = GET_SIZE(HDRP(oldptr)) - WSIZE;
+    /* Copy the old data */
     oldsize = MIN(size, oldsize);
     memcpy(newptr, oldptr, oldsize);
 
@@ -726,7 +1346,7 @@ static void checkblock(void *bp)
 {
     if ((size_t)bp % 8)
        printf("Error: %p is not doubleword aligned\n", bp);
-    if (GET_WORD(HDRP(bp)) != GET_WORD(FTRP(bp)))
+    if (!GET_ALLOC(HDRP(bp)) && GET_WORD(HDRP(bp)) != GET_WORD(FTRP(bp)))
        printf("Error: header does not match footer\n");
 }
 
@@ -736,55 +1356,39 @@ static void printblock(void *bp)
 
     hsize = GET_SIZE(HDRP(bp));
     halloc = GET_ALLOC(HDRP(bp));  
-    fsize = GET_SIZE(FTRP(bp));
-    falloc = GET_ALLOC(FTRP(bp));  
 
     if (hsize == 0) {
         printf("%p: EOL\n", bp);
         return;
     }
+    if (halloc) {
+        printf("%p: header: [%ld:a%s]\n", bp, hsize,
+               GET_PRE_ALLOC(HDRP(bp)) ? "" : " after f");
+        return;
+    }
+    fsize = GET_SIZE(FTRP(bp));
+    falloc = GET_ALLOC(FTRP(bp));
 
     printf("%p: header: [%ld:%c] footer: [%ld:%c]\n", bp, 
             hsize, (halloc ? 'a' : 'f'), 
             fsize, (falloc ? 'a' : 'f'));
 }
 
-int mm_checkheap(int verbose) {
-
-    unsigned int fcount_by_iteration = 0;
-    unsigned int fcount_by_traversal = 0;
-    
-    /* [CHECK 1] 
-     *  Check 13 Class Heads on the front of the heap. Make sure
-     *  the address stored on heap is within the heap boundary. 
-     */
-    for(int i=0; i<N_SIZE_CLASS; i++) {
-        void *bp = (void *)(*((size_t *)(heap_start + i * DSIZE)));
-
-        if(bp != NULL) {     
-            if(!in_heap(bp)) {
-                if(verbose) {
-                    printf("heap_hi: [%p] heap_lo: [%p] \n", mem_heap_hi(),
-                         mem_heap_lo());
-                    printf("Head in Size Class %d: [%p] is out of heap\n", i+1, bp);
-                }
-                return 1;
-            }
-        }
-    }
-
+/* [CHECK 2] and [CHECK 3] for the blocks from the prologue at listp up */
+/* to the epilogue, counting free blocks into *fcount */
+static int checkchunk(char *listp, int verbose, unsigned int *fcount) {
     /* [CHECK 2]
      *  Check Epilogue and Prologue blocks.
      */
     if (verbose)
-        printf("Heap (%p):\n", heap_listp);
-    if ((GET_SIZE(HDRP(heap_listp)) != DSIZE) || !GET_ALLOC(HDRP(heap_listp))) {
+        printf("Heap (%p):\n", listp);
+    if ((GET_SIZE(HDRP(listp)) != DSIZE) || !GET_ALLOC(HDRP(listp))) {
         printf("Bad prologue header\n");
         return 1;
     }
-    checkblock(heap_listp);
+    checkblock(listp);
     if(verbose)
-        printblock(heap_listp);
+        printblock(listp);
 
         
     /*  [CHECK 3] - Block Iteration
@@ -792,15 +1396,23 @@ int mm_checkheap(int verbose) {
      *  allocate/free bit consistency, head/footer matching each other.
      *  Also, count the number of free blocks when interating blocks.
      *  Check coalescing: no two consecutive free blocks in the heap.
+     *  Check every header's PREVIOUS_ALLOC bit, the epilogue's included,
+     *  against the block before it.
      */
-    void *bp = (void *)(heap_listp + DSIZE);
+    void *bp = (void *)(listp + DSIZE);
+    uint32_t prev_alloc = 1;  /* the prologue */
     for(; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
         checkblock(bp);
         if(verbose)
             printblock(bp);
-        if(!GET_ALLOC(HDRP(bp))) {
-            fcount_by_iteration += 1;
-            if(!GET_ALLOC(HDRP(PREV_BLKP(bp))) || 
+        if(!GET_PRE_ALLOC(HDRP(bp)) != !prev_alloc) {
+            printf("Previous-allocated bit of %p is wrong\n", bp);
+            return 1;
+        }
+        prev_alloc = GET_ALLOC(HDRP(bp));
+        if(!prev_alloc) {
+            *fcount += 1;
+            if(!GET_PRE_ALLOC(HDRP(bp)) ||
                !GET_ALLOC(HDRP(NEXT_BLKP(bp)))) {
                 printf("Consecutive free blocks in the heap\n");
                 return 1;
@@ -812,6 +1424,59 @@ int mm_checkheap(int verbose) {
         printf("Bad epilogue header\n");
         return 1;
     }
+    if(!GET_PRE_ALLOC(HDRP(bp)) != !prev_alloc) {
+        printf("Previous-allocated bit of the epilogue is wrong\n");
+        return 1;
+    }
+    return 0;
+}
+
+int mm_checkheap(int verbose) {
+
+    unsigned int fcount_by_iteration = 0;
+    unsigned int fcount_by_traversal = 0;
+
+#ifdef MM_MT
+    /* Check the calling thread's arena */
+    arena_t *a = tc_get()->arena;
+    heap_start = (char *)a->heads;
+#endif
+    
+    /* [CHECK 1] 
+     *  Check 13 Class Heads on the front of the heap. Make sure
+     *  the address stored on heap is within the heap boundary, and
+     *  that the class map marks exactly the non-empty classes. 
+     */
+    for(int i=0; i<N_SIZE_CLASS; i++) {
+        void *bp = (void *)(*((size_t *)(heap_start + i * DSIZE)));
+
+        if((bp != NULL) != ((*getClassMap() >> i) & 1)) {
+            if(verbose)
+                printf("Size Class %d disagrees with the class map\n", i+1);
+            return 1;
+        }
+        if(bp != NULL) {     
+            if(!in_heap(bp)) {
+                if(verbose) {
+                    printf("heap_hi: [%p] heap_lo: [%p] \n", mem_heap_hi(),
+                         mem_heap_lo());
+                    printf("Head in Size Class %d: [%p] is out of heap\n", i+1, bp);
+                }
+                return 1;
+            }
+        }
+    }
+
+    /* [CHECK 2] and [CHECK 3] on each chunk of the heap */
+#ifdef MM_MT
+    for(char *c = a->chunks; c != NULL; c = (char *)GET_DSIZE(c))
+        if(checkchunk(c + 2*DSIZE, verbose, &fcount_by_iteration))
+            return 1;
+#else
+    if(checkchunk(heap_listp, verbose, &fcount_by_iteration))
+        return 1;
+#endif
+
     /*  [CHECK 4] - Free List Traversal
      *  1. All the previous/next pointers are consistent.
      *  2. All free list pointers are within the heap.
@@ -867,5 +1532,47 @@ int mm_checkheap(int verbose) {
         }
     }
 
+#ifdef MM_SLAB
+    /*  [CHECK 5] - Slab Pages
+     *  Every page on a partial list is a marked page of its class with a
+     *  free object, whose free list holds the objects handed out and given
+     *  back; every page on slab_empty is marked and has none in use.
+     */
+    for(i=0; i<SLAB_NCLASS; i++) {
+        uint32_t prev = 0;
+        for(slab_t *page = SLAB_AT(slab_partial[i]); page != NULL;
+            page = SLAB_AT(page->next)) {
+            unsigned nfree = 0;
+            if(!is_slab(page) || page->prev != prev ||
+               page->size != (i + 1) * DSIZE ||
+               page->used >= SLAB_CAP(page->size) ||
+               page->bump > SLAB_CAP(page->size)) {
+                printf("Slab page %p of class %d is corrupt\n", (void *)page, i);
+                return 1;
+            }
+            for(uint16_t f = page->avail; f != SLAB_NONE;
+                f = *(uint16_t *)((char *)page + SLAB_HDR + f * page->size)) {
+                if(f >= page->bump || ++nfree > page->bump) {
+                    printf("Slab page %p has a bad free list\n", (void *)page);
+                    return 1;
+                }
+            }
+            if(nfree + page->used != page->bump) {
+                printf("Slab page %p has %u objects used, %u free of %u\n",
+                       (void *)page, page->used, nfree, page->bump);
+                return 1;
+            }
+            prev = SLAB_OFF(page);
+        }
+    }
+    for(slab_t *page = SLAB_AT(slab_empty); page != NULL;
+        page = SLAB_AT(page->next)) {
+        if(!is_slab(page) || page->used != 0) {
+            printf("Empty slab page %p is in use\n", (void *)page);
+            return 1;
+        }
+    }
+#endif
+
     return 0;
 }
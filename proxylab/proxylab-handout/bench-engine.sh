@@ -0,0 +1,80 @@
+#!/bin/bash
+#
+# bench-engine.sh - compare the proxy's I/O engines
+#
+#     For each engine (threads, epoll, uring) this measures the system
+#     calls the proxy makes per request, using syscount, and the request
+#     rate and latency it sustains without tracing, using loadgen and its
+#     built-in origin. Two workloads are run: "hit" fetches one small
+#     object from the cache, "miss" fetches an object larger than
+#     MAX_OBJECT_SIZE, which is never cached and is relayed from the
+#     origin every time.
+#
+#     usage: ./bench-engine.sh [requests] [concurrency]
+#
+
+REQUESTS=${1:-2000}
+CONCURRENCY=${2:-8}
+ENGINES="threads epoll uring"
+COUNTS=/tmp/bench-engine.$$
+
+if [ ! -x ./proxy ] || [ ! -x ./syscount ] || [ ! -x ./loadgen ]; then
+    echo "Build first: make proxy syscount loadgen"
+    exit 1
+fi
+trap "rm -f ${COUNTS}" EXIT
+
+function free_port {
+    echo $(( (RANDOM % 30000) + 20000 ))
+}
+
+function wait_for_port {
+    for i in `seq 50`; do
+        (echo > /dev/tcp/localhost/$1) 2>/dev/null && return 0
+        sleep 0.1
+    done
+    return 1
+}
+
+# json_field <json> <name> - print a numeric field of loadgen's output
+function json_field {
+    echo "$1" | sed -n "s/.*\"$2\":\([0-9.]*\).*/\1/p"
+}
+
+printf "%-8s %-5s %13s %9s %9s %9s\n" engine load syscalls/req req/s \
+    p50_us p99_us
+for engine in ${ENGINES}; do
+    for load in hit miss; do
+        if [ ${load} == "hit" ]; then
+            objects="-u 1 -z 1024"
+        else
+            objects="-u 1 -z 204800"
+        fi
+
+        # System calls over the load phase, including its one warm-up
+        proxy_port=`free_port`
+        ./syscount -o ${COUNTS} ./proxy -e ${engine} ${proxy_port} > /dev/null 2>&1 &
+        count_pid=$!
+        wait_for_port ${proxy_port} || { echo "proxy did not start"; exit 1; }
+        kill -USR1 ${count_pid}; sleep 0.2
+        ./loadgen -p localhost:${proxy_port} ${objects} \
+            -n ${REQUESTS} -c ${CONCURRENCY} -w 1 > /dev/null
+        kill -USR2 ${count_pid}; sleep 0.2
+        kill -TERM ${count_pid}; wait ${count_pid} 2>/dev/null
+        calls=`awk '/^total/ { print $2 }' ${COUNTS}`
+
+        # Throughput and latency, without the tracing overhead
+        proxy_port=`free_port`
+        ./proxy -e ${engine} ${proxy_port} > /dev/null 2>&1 &
+        proxy_pid=$!
+        wait_for_port ${proxy_port} || { echo "proxy did not start"; exit 1; }
+        result=`./loadgen -p localhost:${proxy_port} ${objects} \
+            -n ${REQUESTS} -c ${CONCURRENCY} -w 1`
+        kill ${proxy_pid}; wait ${proxy_pid} 2>/dev/null
+
+        printf "%-8s %-5s %13s %9s %9s %9s\n" ${engine} ${load} \
+            `awk -v c=${calls} -v n=${REQUESTS} 'BEGIN { printf "%.1f", c / n }'` \
+            `json_field "${result}" req_per_s` \
+            `json_field "${result}" p50` `json_field "${result}" p99`
+    done
+done
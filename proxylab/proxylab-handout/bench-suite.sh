@@ -0,0 +1,50 @@
+#!/bin/bash
+#
+# bench-suite.sh - standard throughput and latency runs for the proxy
+#
+#     Runs loadgen against each engine with a Zipf mix of objects served
+#     by its built-in origin, once closed-loop and once open-loop, and
+#     prints one JSON object per run. Save the output before and after a
+#     change to the cache or an engine and compare.
+#
+#     usage: ./bench-suite.sh [seconds] [open-loop rate] [engines]
+#
+
+SECONDS_PER_RUN=${1:-5}
+RATE=${2:-2000}
+ENGINES=${3:-"threads epoll uring"}
+MIX="-u 200 -s 1.0 -z 1024:204800 -w 400"
+
+if [ ! -x ./proxy ] || [ ! -x ./loadgen ]; then
+    echo "Build first: make proxy loadgen"
+    exit 1
+fi
+
+function free_port {
+    echo $(( (RANDOM % 30000) + 20000 ))
+}
+
+function wait_for_port {
+    for i in `seq 50`; do
+        (echo > /dev/tcp/localhost/$1) 2>/dev/null && return 0
+        sleep 0.1
+    done
+    return 1
+}
+
+# run <engine> <workload> <loadgen args...> - one run on a fresh proxy
+function run {
+    local engine=$1 workload=$2 port=`free_port` pid result
+    shift 2
+    ./proxy -e ${engine} ${port} > /dev/null 2>&1 &
+    pid=$!
+    wait_for_port ${port} || { echo "proxy did not start" >&2; exit 1; }
+    result=`./loadgen -p localhost:${port} "$@"`
+    kill ${pid}; wait ${pid} 2>/dev/null
+    echo "{\"engine\":\"${engine}\",\"workload\":\"${workload}\",\"result\":${result}}"
+}
+
+for engine in ${ENGINES}; do
+    run ${engine} zipf-closed ${MIX} -c 16 -d ${SECONDS_PER_RUN}
+    run ${engine} zipf-open ${MIX} -c 64 -r ${RATE} -d ${SECONDS_PER_RUN}
+done
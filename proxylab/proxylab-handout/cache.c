@@ -1,26 +1,57 @@
 #include "cache.h"
 #include "csapp.h"
+#include "metrics.h"
 #include <string.h>
 
 /* Based on the readers-writers problem in CSAPP textbook */
 static int readcnt;
 static sem_t mutex;
-static sem_t w;  
+static sem_t w;
+static sem_t pin_mutex; /* protects refcnt and pins of the bodies */
+
+/* States of a chunked body, see fill_append */
+enum { FILL_SIZE, FILL_DATA, FILL_DATA_END, FILL_TRAILER, FILL_DONE };
 
 static void age_cache(cache_head *cache);
+static cache_node *pick_victim(cache_head *cache);
+static void make_room(cache_head *cache, int cost);
+static int  trim_body(cache_head *cache, cache_node *node, int need);
+static void evict_node(cache_head *cache, cache_node *node);
+static cache_body *find_body(cache_head *cache, cache_fill *f);
+static cache_body *hold_body(cache_head *cache, cache_body *body,
+                             cache_fill *f);
+static void release_body(cache_head *cache, cache_body *body);
+static void free_body(cache_body *body);
+static void free_segs(cache_seg *seg);
+static void fill_body(cache_fill *f, char *buf, int n);
+static void fill_line(cache_fill *f);
+static void fill_drop(cache_fill *f);
+static int  fill_finish(cache_fill *f, int eof);
+static int  is_chunked(char *hdr, int size);
 
 void cache_init(cache_head *cache) {
 	cache->total_object = 0;
 	cache->total_size = 0;
 	cache->head = NULL;
+	cache->bodies = NULL;
+	cache->total_body = 0;
+	cache->dedup_saved = 0;
+	cache->dedup_hits = 0;
+	cache->trims = 0;
+	cache->resumes = 0;
+	cache->prefetch_hits = 0;
+	cache->prefetch_wasted = 0;
     readcnt = 0;
 	sem_init(&mutex, 0, 1);
 	sem_init(&w, 0, 1);
+	sem_init(&pin_mutex, 0, 1);
 }
 
 void cache_deinit(cache_head *cache) {
 	cache_node *c = cache->head;
 	cache_node *next;
+	cache_body *b = cache->bodies;
+	cache_body *next_body;
 	while(c != NULL) {
 		free(c->tag);
 		free(c->content);
@@ -28,11 +59,18 @@ void cache_deinit(cache_head *cache) {
 		free(c);
 		c = next;
 	}
+	while(b != NULL) {
+		next_body = b->next;
+		free_body(b);
+		b = next_body;
+	}
 }
 
 /* reader */
-/* Return 1 if cache hit and buf and size will be filled. Otherwise, -1. */
-int find_cache(cache_head *cache, char *uri, char *buf, int *size) {
+/* Return 1 if cache hit: ref gets a copy of the headers and the body,   */
+/* which stays valid even if it is evicted meanwhile, until the caller   */
+/* calls release_cache. Sending it needs no lock. Otherwise, -1.         */
+int lookup_cache(cache_head *cache, char *uri, cache_ref *ref) {
 	P(&mutex);
 	readcnt ++;
 	if(readcnt == 1)   /* First in */
@@ -52,7 +90,7 @@ int find_cache(cache_head *cache, char *uri, char *buf, int *size) {
 		}
 		else{
 			/* Aging the node if not be hit */
-			c->age += 1; 
+			c->age += 1;
 		}
 		c = c->next;
 	}
@@ -64,8 +102,21 @@ int find_cache(cache_head *cache, char *uri, char *buf, int *size) {
 	/* cache hit */
 	else {
         printf("cache hit\n");
-		*size = return_node->size;
-		memcpy(buf, return_node->content, return_node->size);
+		/* Readers run concurrently: only one may count the first use */
+		if(__sync_bool_compare_and_swap(&return_node->prefetched, 1, 0))
+			__sync_fetch_and_add(&cache->prefetch_hits, 1);
+		ref->hdr_size = return_node->hdr_size;
+		memcpy(ref->hdr, return_node->content, return_node->hdr_size);
+		ref->body = return_node->body;
+		ref->size = 0;
+		ref->complete = 1;
+		if(ref->body != NULL) {
+			ref->size = ref->body->size;
+			ref->complete = ref->body->complete;
+			P(&pin_mutex);
+			ref->body->pins++;
+			V(&pin_mutex);
+		}
 		rtn = 1;
 	}
 	/* $Critical Section END */
@@ -79,90 +130,501 @@ int find_cache(cache_head *cache, char *uri, char *buf, int *size) {
 	return rtn;
 }
 
-/* writer */
-void store_cache(cache_head *cache, char *uri, char *buf, int size) {
-	P(&w);
+/* Copy the object found by lookup_cache to buf, which must hold   */
+/* ref->hdr_size + ref->size bytes. Return the number of bytes.    */
+int read_cache(cache_ref *ref, char *buf) {
+	cache_seg *seg;
+	int len = ref->hdr_size;
 
-	/* $Critical Section START */
-	if(size <= MAX_OBJECT_SIZE) {
-		if(cache->total_size + size > MAX_CACHE_SIZE) {
-			/* eviction occurs */
-			cache_node *c = cache->head;
-			cache_node *evicted_node;
-			int max_age = 0;
-			int max_size = 0;
-
-			/* find the node that is the oldest and then */
-            /* the largest to be evicted. Evicting large cached object */
-            /* can release more space for larger object. */
-			while(c != NULL) {
-				if(c->age >= max_age) {
-					if(c->age == max_age) {
-					    if(c->size > max_size) {
-                        	max_size = c->size;
-						    max_age = c->age;
-						    evicted_node = c;
-                        }
-					}
-                    else {
-						max_size = c->size;
-						max_age = c->age;
-						evicted_node = c;
-					}
-				}
-				c = c->next;
-			}
+	memcpy(buf, ref->hdr, ref->hdr_size);
+	for(seg = ref->body ? ref->body->segs : NULL; seg != NULL; seg = seg->next) {
+		memcpy(buf + len, seg->data, seg->len);
+		len += seg->len;
+	}
+	return len;
+}
+
+/* Unpin the body of an object found by lookup_cache. The last reader */
+/* of a body that was evicted meanwhile frees it.                     */
+void release_cache(cache_ref *ref) {
+	cache_body *body = ref->body;
+	int dead;
 
-			/* Check if the toal size after eviction is within MAX_CACHE_SIZE */
-			int new_size = cache->total_size - evicted_node->size + size;
-            
-			if(new_size <= MAX_CACHE_SIZE){
-				/* eviction begins */
+	if(body == NULL)
+		return;
+	P(&pin_mutex);
+	dead = --body->pins == 0 && body->refcnt == 0;
+	V(&pin_mutex);
+	if(dead)
+		free_body(body);
+	ref->body = NULL;
+}
 
-				/* Update the evicted cache node */
-				evicted_node->tag = realloc(evicted_node->tag, strlen(uri)+1);
-				strcpy(evicted_node->tag, uri);
+/* reader */
+/* Return 1 if uri is cached whole, 0 otherwise. Unlike lookup_cache,    */
+/* this neither copies the object nor ages the entries, so it is cheap   */
+/* enough for the acceptor to call on every new connection. An object    */
+/* that lost its tail counts as a miss: serving it needs the origin.     */
+int probe_cache(cache_head *cache, char *uri) {
+	P(&mutex);
+	readcnt ++;
+	if(readcnt == 1)   /* First in */
+		P(&w);
+	V(&mutex);
+
+	int rtn = 0;
+
+	/* $Critical Section START */
+	cache_node *c = cache->head;
+	while(c != NULL) {
+		if(!strcmp(uri, c->tag)) {
+			rtn = c->body == NULL || c->body->complete;
+			break;
+		}
+		c = c->next;
+	}
+	/* $Critical Section END */
+
+	P(&mutex);
+	readcnt--;
+	if(readcnt == 0)   /* Last out */
+		V(&w);
+	V(&mutex);
 
-				evicted_node->content = realloc(evicted_node->content, size);
-				memcpy(evicted_node->content, buf, size);
+	return rtn;
+}
 
-				evicted_node->size = size;
+void fill_init(cache_fill *f) {
+	f->hdr_size = 0;
+	f->hdr_done = 0;
+	f->head = f->tail = NULL;
+	f->size = 0;
+	f->hash = 14695981039346656037ULL;
+	f->chunked = 0;
+	f->state = FILL_SIZE;
+	f->chunk_left = 0;
+	f->linelen = 0;
+	f->ok = 1;
+}
 
-				/* Update the cache head */
-				cache->total_size = new_size;
+/* Append n bytes of a response as received from the origin. The status */
+/* line and headers are kept apart from the body, which goes into        */
+/* segments and is de-chunked on the way if the origin sent it chunked.  */
+void fill_append(cache_fill *f, char *buf, int n) {
+	int len;
 
-				/* Aging each node */
-				age_cache(cache);
-				evicted_node->age = 0;
+	/* Headers, up to and including the blank line */
+	while(f->ok && !f->hdr_done && n > 0) {
+		if(f->hdr_size == CACHE_HDR_SIZE) {
+			fill_drop(f);
+			return;
+		}
+		f->hdr[f->hdr_size++] = *buf++;
+		n--;
+		if(f->hdr_size >= 4 &&
+		   !memcmp(f->hdr + f->hdr_size - 4, "\r\n\r\n", 4)) {
+			/* Only a 200 is the object; a 206 or 304 is not */
+			if(f->hdr_size < 12 || strncmp(f->hdr + 8, " 200", 4)) {
+				fill_drop(f);
+				return;
 			}
-            else {
-                printf("No Enough space for this object\n");
-                printf("Eviction not occur !\n");
-            }
+			f->hdr_done = 1;
+			f->chunked = is_chunked(f->hdr, f->hdr_size);
+		}
+	}
+	if(!f->chunked) {
+		fill_body(f, buf, n);
+		return;
+	}
+
+	/* chunk-size line, chunk data, CRLF, ..., "0" line, trailers, CRLF */
+	while(f->ok && n > 0 && f->state != FILL_DONE) {
+		if(f->state == FILL_DATA) {
+			len = n < f->chunk_left ? n : f->chunk_left;
+			fill_body(f, buf, len);
+			buf += len;
+			n -= len;
+			if((f->chunk_left -= len) == 0)
+				f->state = FILL_DATA_END;
+		}
+		else if(*buf == '\n') {
+			f->line[f->linelen] = '\0';
+			fill_line(f);
+			f->linelen = 0;
+			buf++;
+			n--;
 		}
 		else {
-			/* simply store the current object in the head of the list */
-			cache_node *node = malloc(sizeof(cache_node));
-			node->tag = malloc(strlen(uri) + 1); /* +1 for '\0' */
-			node->content = malloc(size);
-			strcpy(node->tag, uri);
-			memcpy(node->content, buf, size);
-			node->size = size;
-            /* Update the linked list */
-			node->next = cache->head;
-			cache->head = node;
-			cache->total_size += size;
-			cache->total_object += 1;
-
-			/* Aging each node */
-			age_cache(cache);
-			node->age = 0;
+			if(f->linelen < (int)sizeof(f->line) - 1)
+				f->line[f->linelen++] = *buf;
+			buf++;
+			n--;
 		}
 	}
+}
+
+/* Copy the response in f to buf if it fits in size bytes. Return its */
+/* size, or -1.                                                       */
+int fill_copy(cache_fill *f, char *buf, int size) {
+	cache_seg *seg;
+	int len = f->hdr_size;
+
+	if(!f->ok || f->hdr_size + f->size > size)
+		return -1;
+	memcpy(buf, f->hdr, f->hdr_size);
+	for(seg = f->head; seg != NULL; seg = seg->next) {
+		memcpy(buf + len, seg->data, seg->len);
+		len += seg->len;
+	}
+	return len;
+}
+
+void fill_free(cache_fill *f) {
+	free_segs(f->head);
+	f->head = f->tail = NULL;
+}
+
+/* writer */
+/* Store the response in f under uri if it is complete: the origin      */
+/* closed the connection cleanly (eof) or sent the last chunk. Bodies   */
+/* are shared with every object whose body has the same content, so a   */
+/* body reachable under several URIs counts only once against the cache */
+/* size. f is left empty. Return 1 if stored.                           */
+int store_fill(cache_head *cache, char *uri, cache_fill *f, int eof,
+               int prefetched) {
+	cache_node *c, *node;
+	cache_body *body;
+	int cost;
+
+	if(!fill_finish(f, eof) || f->hdr_size + f->size > MAX_CACHE_SIZE) {
+		fill_free(f);
+		return 0;
+	}
+
+	P(&w);
+
+	/* $Critical Section START */
+	body = find_body(cache, f);
+	/* Space the object needs: nothing for a body already cached */
+	cost = f->hdr_size + (body ? 0 : f->size);
+	body = hold_body(cache, body, f);
+
+	/* A fetch of a cached uri, e.g. to complete it, replaces the old copy */
+	for(c = cache->head; c != NULL && strcmp(uri, c->tag); c = c->next)
+		;
+	if(c != NULL)
+		evict_node(cache, c);
+	make_room(cache, cost);
+
+	/* store the current object in the head of the list */
+	node = malloc(sizeof(cache_node));
+	node->tag = malloc(strlen(uri) + 1); /* +1 for '\0' */
+	node->content = malloc(f->hdr_size);
+	strcpy(node->tag, uri);
+	memcpy(node->content, f->hdr, f->hdr_size);
+	node->hdr_size = f->hdr_size;
+	node->body = body;
+	node->size = f->hdr_size + f->size;
+	node->prefetched = prefetched;
+	/* Update the linked list */
+	node->next = cache->head;
+	cache->head = node;
+	cache->total_size += cost;
+	cache->total_object += 1;
+
+	/* Aging each node */
+	age_cache(cache);
+	node->age = 0;
 	/* $Critical Section END */
-	
+
 	V(&w);
-	return;
+	fill_free(f);
+	return 1;
+}
+
+/* Append object, body and deduplication counters to buf */
+int cache_format(cache_head *cache, char *buf, int size) {
+	return stats_printf(buf, size,
+	                    "cache.objects %d\ncache.bodies %d\n"
+	                    "cache.bytes %d\ncache.dedup.hits %lld\n"
+	                    "cache.dedup.saved_bytes %d\n"
+	                    "cache.partial.trims %lld\n"
+	                    "cache.partial.resumes %lld\n",
+	                    cache->total_object, cache->total_body,
+	                    cache->total_size, cache->dedup_hits,
+	                    cache->dedup_saved, cache->trims, cache->resumes);
+}
+
+/* Called by writer. The victim is the oldest, then the largest node.  */
+/* Evicting large cached object can release more space for larger one. */
+static cache_node *pick_victim(cache_head *cache) {
+	cache_node *c = cache->head;
+	cache_node *evicted_node = cache->head;
+	int max_age = 0;
+	int max_size = 0;
+
+	while(c != NULL) {
+		if(c->age > max_age || (c->age == max_age && c->size > max_size)) {
+			max_size = c->size;
+			max_age = c->age;
+			evicted_node = c;
+		}
+		c = c->next;
+	}
+	return evicted_node;
+}
+
+/* Called by writer. Evict until cost more bytes fit in the cache */
+static void make_room(cache_head *cache, int cost) {
+	cache_node *victim;
+
+	while(cache->total_size + cost > MAX_CACHE_SIZE && cache->head != NULL) {
+		victim = pick_victim(cache);
+		if(!trim_body(cache, victim,
+		              cache->total_size + cost - MAX_CACHE_SIZE))
+			evict_node(cache, victim);
+	}
+}
+
+/* Called by writer. Free at least need bytes from the tail of the body  */
+/* of node, keeping its head, which can still be served while the rest   */
+/* is fetched again with a Range request. Only a body no other node      */
+/* shares and no reader is sending can be cut. Return the bytes freed.   */
+static int trim_body(cache_head *cache, cache_node *node, int need) {
+	cache_body *body = node->body;
+	cache_seg *seg;
+	int keep, freed;
+
+	if(body == NULL || body->refcnt != 1 || body->pins != 0 ||
+	   body->size - need < CACHE_SEG_SIZE)
+		return 0;
+	/* All segments but the last are full */
+	keep = (body->size - need) / CACHE_SEG_SIZE;
+	for(seg = body->segs; --keep > 0; seg = seg->next)
+		;
+	free_segs(seg->next);
+	seg->next = NULL;
+	freed = body->size - (body->size - need) / CACHE_SEG_SIZE * CACHE_SEG_SIZE;
+	body->size -= freed;
+	body->complete = 0;
+	node->size -= freed;
+	cache->total_size -= freed;
+	cache->trims++;
+	return freed;
+}
+
+/* Called by writer. Remove node from the cache */
+static void evict_node(cache_head *cache, cache_node *node) {
+	cache_node **p;
+
+	for(p = &cache->head; *p != node; p = &(*p)->next)
+		;
+	*p = node->next;
+	if(node->prefetched)
+		cache->prefetch_wasted++;
+	release_body(cache, node->body);
+	cache->total_size -= node->hdr_size;
+	cache->total_object -= 1;
+	free(node->tag);
+	free(node->content);
+	free(node);
+}
+
+/* Called by writer. Return the complete cached body with the content */
+/* of the body in f, NULL if none.                                    */
+static cache_body *find_body(cache_head *cache, cache_fill *f) {
+	cache_body *b;
+	cache_seg *s, *t;
+
+	for(b = cache->bodies; b != NULL; b = b->next) {
+		if(!b->complete || b->hash != f->hash || b->size != f->size)
+			continue;
+		/* Both are cut into full segments the same way */
+		for(s = b->segs, t = f->head; s != NULL; s = s->next, t = t->next) {
+			if(memcmp(s->data, t->data, s->len))
+				break;
+		}
+		if(s == NULL)
+			return b;
+	}
+	return NULL;
+}
+
+/* Called by writer. Take a reference to body or, if NULL, to a new body  */
+/* made of the segments of f. An empty body is not stored at all.         */
+static cache_body *hold_body(cache_head *cache, cache_body *body,
+                             cache_fill *f) {
+	if(f->size == 0)
+		return NULL;
+	if(body != NULL) {
+		body->refcnt++;
+		cache->dedup_hits++;
+		cache->dedup_saved += body->size;
+		return body;
+	}
+	body = malloc(sizeof(cache_body));
+	body->hash = f->hash;
+	body->segs = f->head;
+	body->size = f->size;
+	body->complete = 1;
+	body->refcnt = 1;
+	body->pins = 0;
+	body->next = cache->bodies;
+	cache->bodies = body;
+	cache->total_body++;
+	f->head = f->tail = NULL;
+	return body;
+}
+
+/* Called by writer. Drop a reference to body. With the last one it  */
+/* leaves the cache, and is freed once no reader is sending it.       */
+static void release_body(cache_head *cache, cache_body *body) {
+	cache_body **p;
+	int dead;
+
+	if(body == NULL)
+		return;
+	P(&pin_mutex);
+	body->refcnt--;
+	dead = body->refcnt == 0 && body->pins == 0;
+	V(&pin_mutex);
+	if(body->refcnt > 0) {
+		cache->dedup_saved -= body->size;
+		return;
+	}
+	for(p = &cache->bodies; *p != body; p = &(*p)->next)
+		;
+	*p = body->next;
+	cache->total_body--;
+	cache->total_size -= body->size;
+	if(dead)
+		free_body(body);
+}
+
+static void free_body(cache_body *body) {
+	free_segs(body->segs);
+	free(body);
+}
+
+static void free_segs(cache_seg *seg) {
+	cache_seg *next;
+	while(seg != NULL) {
+		next = seg->next;
+		free(seg);
+		seg = next;
+	}
+}
+
+/* Append n body bytes to the segments of f, and to its hash (FNV-1a) */
+static void fill_body(cache_fill *f, char *buf, int n) {
+	cache_seg *seg;
+	int i, len;
+
+	if(!f->ok)
+		return;
+	if(f->hdr_size + f->size + n > MAX_CACHE_SIZE) {
+		fill_drop(f);   /* larger than the whole cache */
+		return;
+	}
+	for(i = 0; i < n; i++) {
+		f->hash ^= (unsigned char)buf[i];
+		f->hash *= 1099511628211ULL;
+	}
+	while(n > 0) {
+		if(f->tail == NULL || f->tail->len == CACHE_SEG_SIZE) {
+			seg = malloc(sizeof(cache_seg));
+			seg->next = NULL;
+			seg->len = 0;
+			if(f->tail != NULL)
+				f->tail->next = seg;
+			else
+				f->head = seg;
+			f->tail = seg;
+		}
+		len = CACHE_SEG_SIZE - f->tail->len;
+		if(len > n)
+			len = n;
+		memcpy(f->tail->data + f->tail->len, buf, len);
+		f->tail->len += len;
+		f->size += len;
+		buf += len;
+		n -= len;
+	}
+}
+
+/* A line of the chunked encoding is complete in f->line */
+static void fill_line(cache_fill *f) {
+	char *end;
+	long size;
+
+	switch(f->state) {
+	case FILL_SIZE:
+		size = strtol(f->line, &end, 16);
+		if(end == f->line || size < 0 || size > MAX_CACHE_SIZE) {
+			fill_drop(f);
+			return;
+		}
+		f->chunk_left = size;
+		f->state = size ? FILL_DATA : FILL_TRAILER;
+		break;
+	case FILL_DATA_END:
+		f->state = FILL_SIZE;
+		break;
+	case FILL_TRAILER:
+		if(!strcmp(f->line, "\r") || !strcmp(f->line, ""))
+			f->state = FILL_DONE;
+		break;
+	}
+}
+
+/* The response cannot be cached: stop keeping it */
+static void fill_drop(cache_fill *f) {
+	f->ok = 0;
+	fill_free(f);
+}
+
+/* Return 1 if f holds a complete response. A de-chunked body gets a */
+/* Content-length header in place of Transfer-Encoding.              */
+static int fill_finish(cache_fill *f, int eof) {
+	char hdr[CACHE_HDR_SIZE], *p, *eol;
+	char *end = f->hdr + f->hdr_size - 2;  /* before the blank line */
+	int len = 0;
+
+	if(!f->ok)
+		return 0;
+	if(!f->chunked)
+		return eof;
+	if(f->state != FILL_DONE)
+		return 0;
+	for(p = f->hdr; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if(strncasecmp(p, "Transfer-Encoding:", 18)) {
+			memcpy(hdr + len, p, eol - p + 1);
+			len += eol - p + 1;
+		}
+	}
+	len += snprintf(hdr + len, CACHE_HDR_SIZE - len,
+	                "Content-length: %d\r\n\r\n", f->size);
+	if(len >= CACHE_HDR_SIZE)
+		return 0;
+	memcpy(f->hdr, hdr, len);
+	f->hdr_size = len;
+	return 1;
+}
+
+/* Return 1 if the headers say Transfer-Encoding: chunked */
+static int is_chunked(char *hdr, int size) {
+	char *p, *eol, *end = hdr + size;
+
+	for(p = hdr; p < end && (eol = memchr(p, '\n', end - p)); p = eol + 1) {
+		if(strncasecmp(p, "Transfer-Encoding:", 18))
+			continue;
+		for(p += 18; p + 7 <= eol; p++) {
+			if(!strncasecmp(p, "chunked", 7))
+				return 1;
+		}
+	}
+	return 0;
 }
 
 static void age_cache(cache_head *cache) {
@@ -170,7 +632,7 @@ static void age_cache(cache_head *cache) {
 	while(c != NULL) {
 		c->age += 1;
 		c = c->next;
-	}	
+	}
 }
 
 
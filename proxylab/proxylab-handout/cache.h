@@ -5,24 +5,92 @@
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 
+/* Bodies are held as lists of segments, so an object as large as the */
+/* whole cache needs no contiguous buffer and can lose its tail alone */
+/* on eviction. MAX_OBJECT_SIZE now only bounds contiguous copies.     */
+#define CACHE_SEG_SIZE 16384
+#define CACHE_HDR_SIZE 8192  /* largest status line and headers cached */
+
+typedef struct cache_seg{
+	struct cache_seg *next;
+	int len;       /* bytes used, CACHE_SEG_SIZE but in the last one */
+	char data[CACHE_SEG_SIZE];
+} cache_seg;
+
+/* Response body shared by every object with the same content */
+typedef struct cache_body{
+	unsigned long long hash; /* FNV-1a hash of the data */
+	cache_seg *segs;
+	int size;
+	int complete;  /* 0 once eviction dropped the tail */
+	int refcnt;    /* cache nodes using this body */
+	int pins;      /* readers still sending it, see lookup_cache */
+	struct cache_body *next; /* linked list pointer */
+} cache_body;
+
 typedef struct cache_node{
 	char *tag;     /* treat uri as cache tag */
-	char *content; /* content of the current cached object */
+	char *content; /* status line and headers of the cached object */
+	int hdr_size;  /* size of content */
+	cache_body *body; /* body of the cached object, NULL if empty */
 	int age;       /* age for eviction */
 	int size;      /* size of the current cached object */
+	int prefetched;/* stored by the prefetcher and not requested yet */
 	struct cache_node *next; /* linked list pointer */
 } cache_node;
 
 typedef struct {
 	int total_object; /* total objects in cache */
-	int total_size;   /* total cached objects' size */
+	int total_size;   /* total cached objects' size, shared bodies once */
 	cache_node *head; /* head of the linked list */
+	cache_body *bodies; /* distinct bodies in the cache */
+	int total_body;     /* number of distinct bodies */
+	int dedup_saved;    /* bytes not stored thanks to shared bodies */
+	long long dedup_hits; /* stores that found their body cached */
+	long long trims;      /* evictions that kept the head of a body */
+	long long resumes;    /* tails fetched again with a Range request */
+	long long prefetch_hits;   /* prefetched objects later requested */
+	long long prefetch_wasted; /* prefetched objects evicted unrequested */
 } cache_head;
 
+/* A response on its way from the origin into the cache, see fill_append */
+typedef struct {
+	char hdr[CACHE_HDR_SIZE]; /* status line and headers */
+	int hdr_size;
+	int hdr_done;  /* the blank line after the headers was seen */
+	cache_seg *head, *tail; /* body, de-chunked */
+	int size;
+	unsigned long long hash;
+	int chunked;   /* Transfer-Encoding: chunked */
+	int state;     /* where in the chunked encoding we are */
+	int chunk_left;
+	char line[64]; /* chunk size or trailer line read so far */
+	int linelen;
+	int ok;        /* 0 once the response cannot be cached */
+} cache_fill;
+
+/* A cached object found by lookup_cache */
+typedef struct {
+	char hdr[CACHE_HDR_SIZE]; /* copy of the status line and headers */
+	int hdr_size;
+	cache_body *body; /* pinned until release_cache, NULL if empty */
+	int size;         /* body bytes cached */
+	int complete;     /* 0 if eviction dropped the tail of the body */
+} cache_ref;
+
 void cache_init(cache_head *cache);
 void cache_deinit(cache_head *cache);
-int  find_cache(cache_head *cache, char *uri, char *buf, int *size);
-void store_cache(cache_head *cache, char *uri, char *buf, int size);
+int  lookup_cache(cache_head *cache, char *uri, cache_ref *ref);
+int  read_cache(cache_ref *ref, char *buf);
+void release_cache(cache_ref *ref);
+int  probe_cache(cache_head *cache, char *uri);
+void fill_init(cache_fill *f);
+void fill_append(cache_fill *f, char *buf, int n);
+int  fill_copy(cache_fill *f, char *buf, int size);
+void fill_free(cache_fill *f);
+int  store_fill(cache_head *cache, char *uri, cache_fill *f, int eof,
+                int prefetched);
+int  cache_format(cache_head *cache, char *buf, int size);
 //static void age_cache(cache_head *cache);
 
 #endif
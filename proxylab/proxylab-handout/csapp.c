@@ -1,5 +1,7 @@
 /* $begin csapp.c */
 #include "csapp.h"
+#include <poll.h>
+#include <netinet/tcp.h>
 
 /* Updated with a reentrant open_clientfd_r function */
 
@@ -574,6 +576,73 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+/*
+ * rio_writev - robustly write the iovcnt buffers of iov, in one writev
+ *    call when the kernel takes them all. A partial write moves on to
+ *    the rest, so iov is updated as bytes go out. Returns the number of
+ *    bytes written, or -1 on error.
+ */
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t nwritten, total = 0;
+
+    while (iovcnt > 0 && iov->iov_len == 0) {
+	iov++;
+	iovcnt--;
+    }
+    while (iovcnt > 0) {
+	if ((nwritten = writev(fd, iov, iovcnt)) <= 0) {
+	    if (errno == EINTR)  /* interrupted by sig handler return */
+		continue;        /* and call writev() again */
+	    return -1;           /* errno set by writev() */
+	}
+	total += nwritten;
+	while (iovcnt > 0 && nwritten >= iov->iov_len) { /* whole buffers */
+	    nwritten -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt > 0) {        /* part of one */
+	    iov->iov_base = (char *)iov->iov_base + nwritten;
+	    iov->iov_len -= nwritten;
+	}
+    }
+    return total;
+}
+
+/*
+ * rio_batchinit, rio_batchadd, rio_batchflush - gather the pieces of a
+ *    message, such as a header block and its body, and write them all
+ *    with one writev. rio_batchadd only records buf, which must stay put
+ *    until the flush, and returns -1 when the batch is full. The flush
+ *    empties the batch and returns what rio_writev does.
+ */
+void rio_batchinit(rio_batch_t *bp)
+{
+    bp->cnt = 0;
+    bp->len = 0;
+}
+
+int rio_batchadd(rio_batch_t *bp, void *buf, size_t n)
+{
+    if (bp->cnt == RIO_MAXIOV)
+	return -1;
+    if (n > 0) {
+	bp->iov[bp->cnt].iov_base = buf;
+	bp->iov[bp->cnt++].iov_len = n;
+	bp->len += n;
+    }
+    return 0;
+}
+
+ssize_t rio_batchflush(int fd, rio_batch_t *bp)
+{
+    ssize_t rc = rio_writev(fd, bp->iov, bp->cnt);
+
+    rio_batchinit(bp);
+    return rc;
+}
+
 
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
@@ -589,8 +658,7 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
     int cnt;
 
     while (rp->rio_cnt <= 0) {  /* refill if buf is empty */
-	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
-			   sizeof(rp->rio_buf));
+	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, rp->rio_bufsize);
 	if (rp->rio_cnt < 0) {
 	    if (errno != EINTR) /* interrupted by sig handler return */
 		return -1;
@@ -612,17 +680,71 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 }
 /* $end rio_read */
 
+/*
+ * rio_fill - move the rio_cnt unread bytes to the start of the internal
+ *    buffer and read more after them. Returns the number of bytes read,
+ *    0 on EOF or when the buffer is already full, -1 on error.
+ */
+static ssize_t rio_fill(rio_t *rp)
+{
+    ssize_t n;
+
+    if (rp->rio_cnt < 0)  /* left by a failed read() */
+	rp->rio_cnt = 0;
+    if (rp->rio_cnt > 0 && rp->rio_bufptr != rp->rio_buf)
+	memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+    rp->rio_bufptr = rp->rio_buf;
+    if (rp->rio_cnt == rp->rio_bufsize)
+	return 0;
+    while ((n = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+		     rp->rio_bufsize - rp->rio_cnt)) < 0)
+	if (errno != EINTR) /* interrupted by sig handler return */
+	    return -1;
+    rp->rio_cnt += n;
+    return n;
+}
+
 /*
  * rio_readinitb - Associate a descriptor with a read buffer and reset buffer
  */
 /* $begin rio_readinitb */
 void rio_readinitb(rio_t *rp, int fd) 
+{
+    rio_readinitb_n(rp, fd, RIO_BUFSIZE);
+}
+/* $end rio_readinitb */
+
+/*
+ * rio_readinitb_n - rio_readinitb with a bufsize-byte read buffer, which
+ *    is allocated here and released with rio_freeb
+ */
+void rio_readinitb_n(rio_t *rp, int fd, size_t bufsize)
+{
+    rp->rio_buf = Malloc(bufsize);
+    rp->rio_bufsize = bufsize;
+    rio_resetb(rp, fd);
+}
+
+/*
+ * rio_resetb - associate another descriptor with rp, keeping its buffer
+ *    and dropping whatever was left unread in it
+ */
+void rio_resetb(rio_t *rp, int fd)
 {
     rp->rio_fd = fd;  
     rp->rio_cnt = 0;  
     rp->rio_bufptr = rp->rio_buf;
 }
-/* $end rio_readinitb */
+
+/*
+ * rio_freeb - release the read buffer of rp
+ */
+void rio_freeb(rio_t *rp)
+{
+    free(rp->rio_buf);
+    rp->rio_buf = rp->rio_bufptr = NULL;
+    rp->rio_cnt = 0;
+}
 
 /*
  * rio_readnb - Robustly read n bytes (buffered)
@@ -651,32 +773,78 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 /* $end rio_readnb */
 
 /* 
- * rio_readlineb - robustly read a text line (buffered)
+ * rio_readlineb - robustly read a text line (buffered). Each buffered
+ *    chunk is searched with memchr and copied out at once, rather than
+ *    read a byte at a time. Returns the number of bytes stored before
+ *    the terminating NUL, 0 on EOF before any data, -1 on error.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-	if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n')
-		break;
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* error */
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *nl = NULL;
+
+    if (maxlen == 0)
+	return 0;
+    while (n + 1 < maxlen && !nl) {
+	if (rp->rio_cnt <= 0) {
+	    if ((rc = rio_fill(rp)) < 0)
+		return -1;	  /* error */
+	    else if (rc == 0)
+		break;    /* EOF, n bytes were read */
+	}
+	cnt = maxlen - 1 - n;
+	if (rp->rio_cnt < cnt)
+	    cnt = rp->rio_cnt;
+	if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+	    cnt = nl - rp->rio_bufptr + 1;
+	memcpy(bufp + n, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	n += cnt;
     }
-    *bufp = 0;
+    bufp[n] = 0;
     return n;
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_readlinep - read a text line without copying it (buffered). Sets
+ *    *linep to the line, '\n' included, inside the internal buffer, where
+ *    it stays valid until the next read from rp, and returns its length,
+ *    0 on EOF, -1 on error. The line is not NUL-terminated; one longer
+ *    than the buffer comes back in pieces of rp->rio_bufsize bytes
+ *    (RIO_BUFSIZE unless set by rio_readinitb_n).
+ */
+ssize_t rio_readlinep(rio_t *rp, char **linep)
+{
+    int scanned = 0, cnt;
+    ssize_t rc;
+    char *nl;
+
+    for (;;) {
+	if (rp->rio_cnt > scanned &&
+	    (nl = memchr(rp->rio_bufptr + scanned, '\n',
+			 rp->rio_cnt - scanned)) != NULL) {
+	    cnt = nl - rp->rio_bufptr + 1;
+	    break;
+	}
+	if (rp->rio_cnt > 0)
+	    scanned = rp->rio_cnt;  /* no need to search it again */
+	if ((rc = rio_fill(rp)) < 0)
+	    return -1;
+	else if (rc == 0) {  /* EOF, or a full buffer with no '\n' */
+	    cnt = rp->rio_cnt;
+	    break;
+	}
+    }
+    *linep = rp->rio_bufptr;
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    return cnt;
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -695,6 +863,12 @@ void Rio_writen(int fd, void *usrbuf, size_t n)
 	unix_error("Rio_writen error");
 }
 
+void Rio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    if (rio_writev(fd, iov, iovcnt) < 0)
+	unix_error("Rio_writev error");
+}
+
 void Rio_readinitb(rio_t *rp, int fd)
 {
     rio_readinitb(rp, fd);
@@ -718,6 +892,23 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     return rc;
 } 
 
+ssize_t Rio_readlinep(rio_t *rp, char **linep)
+{
+    ssize_t rc;
+
+    if ((rc = rio_readlinep(rp, linep)) < 0)
+	unix_error("Rio_readlinep error");
+    return rc;
+}
+
+void Rio_batchflush(int fd, rio_batch_t *bp)
+{
+    size_t len = bp->len;
+
+    if (rio_batchflush(fd, bp) != len)
+	unix_error("Rio_batchflush error");
+}
+
 /******************************** 
  * Client/server helper functions
  ********************************/
@@ -796,6 +987,163 @@ int open_clientfd_r(char *hostname, int port) {
     }
 }
 
+/*
+ * he_now_ms - monotonic time in milliseconds, for connect_he's deadlines
+ */
+static long long he_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * he_start - start a non-blocking connect to addr. Returns the socket,
+ *     which has connected already if *done is set, or -1 if the attempt
+ *     failed at once.
+ */
+static int he_start(struct addrinfo *addr, int *done)
+{
+    int fd;
+
+    *done = 0;
+    if ((fd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK,
+		     addr->ai_protocol)) < 0)
+	return -1;
+    if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0)
+	*done = 1;
+    else if (errno != EINPROGRESS) {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+/*
+ * connect_he - connect to one of the addresses in the list addrs, in
+ *     the Happy Eyeballs style of RFC 8305: the addresses are tried in
+ *     turn with families interleaved (the list's first family first),
+ *     a new attempt starting every delay_ms or as soon as one fails,
+ *     while the earlier ones stay in the race. The first socket to
+ *     connect wins and the others are closed. Gives up after timeout_ms
+ *     (0 for no limit). Returns a blocking socket with TCP_NODELAY set,
+ *     or -1 and sets errno (ETIMEDOUT, or why the last attempt failed).
+ */
+int connect_he(struct addrinfo *addrs, int delay_ms, int timeout_ms)
+{
+    struct addrinfo *cand[HE_MAXADDR], *first[HE_MAXADDR], *other[HE_MAXADDR];
+    struct addrinfo *p;
+    struct pollfd pfd[HE_MAXADDR];
+    int ncand = 0, na = 0, nb = 0, next = 0, npend = 0, i, fd, done, err;
+    int one = 1;
+    int wait_ms, won = -1, last_errno = ECONNREFUSED;
+    int family = addrs ? addrs->ai_family : AF_UNSPEC;
+    socklen_t errlen = sizeof(err);
+    long long now, next_at, deadline;
+
+    /* Interleave: first family, other family, first family, ... */
+    for (p = addrs; p && na < HE_MAXADDR; p = p->ai_next)
+	if (p->ai_family == family)
+	    first[na++] = p;
+	else if (nb < HE_MAXADDR)
+	    other[nb++] = p;
+    for (i = 0; (i < na || i < nb) && ncand < HE_MAXADDR; i++) {
+	if (i < na)
+	    cand[ncand++] = first[i];
+	if (i < nb && ncand < HE_MAXADDR)
+	    cand[ncand++] = other[i];
+    }
+
+    now = he_now_ms();
+    deadline = timeout_ms ? now + timeout_ms : 0;
+    next_at = now;
+    while (won < 0 && (next < ncand || npend > 0)) {
+	if (deadline && now >= deadline) {
+	    last_errno = ETIMEDOUT;
+	    break;
+	}
+
+	/* Start the next attempt when its turn comes or nothing is pending */
+	if (next < ncand && (now >= next_at || npend == 0)) {
+	    if ((fd = he_start(cand[next++], &done)) < 0) {
+		last_errno = errno;
+		continue;  /* failed at once: on to the next address now */
+	    }
+	    pfd[npend].fd = fd;
+	    pfd[npend].revents = 0;
+	    pfd[npend++].events = POLLOUT;
+	    if (done) {
+		won = npend - 1;
+		break;
+	    }
+	    next_at = now + delay_ms;
+	}
+
+	/* Wait for an attempt to finish, the next turn or the deadline */
+	wait_ms = -1;
+	if (next < ncand)
+	    wait_ms = (next_at > now) ? next_at - now : 0;
+	if (deadline && (wait_ms < 0 || deadline - now < wait_ms))
+	    wait_ms = deadline - now;
+	if (poll(pfd, npend, wait_ms) < 0 && errno != EINTR) {
+	    last_errno = errno;
+	    break;
+	}
+	for (i = 0; i < npend && won < 0; i++) {
+	    if (!pfd[i].revents)
+		continue;
+	    err = 0;
+	    if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0 &&
+		err == 0 && !(pfd[i].revents & (POLLERR | POLLHUP))) {
+		won = i;
+		break;
+	    }
+	    last_errno = err ? err : ECONNREFUSED;
+	    close(pfd[i].fd);          /* lost: let the next one start now */
+	    pfd[i--] = pfd[--npend];
+	    next_at = now;
+	}
+	now = he_now_ms();
+    }
+
+    for (i = 0; i < npend; i++)
+	if (i != won)
+	    close(pfd[i].fd);
+    if (won < 0) {
+	errno = last_errno;
+	return -1;
+    }
+    fd = pfd[won].fd;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/*
+ * open_clientfd_he - thread-safe open_clientfd for IPv6 and IPv4 that
+ *     races the addresses of hostname with connect_he.
+ *     Returns -1 and sets errno on Unix error or timeout.
+ *     Returns -2 if hostname does not resolve.
+ */
+int open_clientfd_he(char *hostname, int port, int delay_ms, int timeout_ms)
+{
+    struct addrinfo hints, *addrs;
+    char port_str[16];
+    int fd;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG | AI_NUMERICSERV;
+    sprintf(port_str, "%d", port);
+    if (getaddrinfo(hostname, port_str, &hints, &addrs) != 0)
+	return -2;
+    fd = connect_he(addrs, delay_ms, timeout_ms);
+    freeaddrinfo(addrs);
+    return fd;
+}
+
 /*  
  * open_listenfd - open and return a listening socket on port
  *     Returns -1 and sets errno on Unix error.
@@ -857,6 +1205,19 @@ int Open_clientfd_r(char *hostname, int port)
     return rc;
 }
 
+int Open_clientfd_he(char *hostname, int port, int delay_ms, int timeout_ms)
+{
+    int rc;
+
+    if ((rc = open_clientfd_he(hostname, port, delay_ms, timeout_ms)) < 0) {
+	if (rc == -1)
+	    unix_error("Open_clientfd_he Unix error");
+	else
+	    app_error("Open_clientfd_he DNS error");
+    }
+    return rc;
+}
+
 int Open_listenfd(int port) 
 {
     int rc;
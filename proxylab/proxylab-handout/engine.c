@@ -0,0 +1,188 @@
+#include "csapp.h"
+#include "engine.h"
+#include "metrics.h"
+#include "trace.h"
+#include "prefetch.h"
+
+/*
+ * engine.c - request handling for the event-driven engines
+ *
+ * The thread pool reads a request line by line with blocking rio calls.
+ * The epoll and io_uring engines cannot block, so they hand whatever
+ * bytes arrived to request_head() until the blank line that ends the
+ * headers is in the buffer, then parse the whole head at once with the
+ * same helpers serve_client() uses.
+ */
+
+engine_stats_t engine_stats;
+char *engine_name[] = { "threads", "epoll", "uring" };
+
+/* Map the -e argument to ENGINE_*. Return -1 if unknown */
+int engine_parse(char *name) {
+    int i;
+
+    for(i = 0; i < (int)(sizeof(engine_name) / sizeof(engine_name[0])); i++) {
+        if(!strcmp(name, engine_name[i]))
+            return i;
+    }
+    return -1;
+}
+
+/* Append the engine counters to buf */
+int engine_format(char *buf, int size) {
+    if(engine_stats.mode == ENGINE_THREADS)
+        return 0;
+    return stats_printf(buf, size,
+                        "engine.%s.conns %lld\nengine.%s.hits %lld\n"
+                        "engine.%s.fetches %lld\nengine.%s.waits %lld\n",
+                        engine_name[engine_stats.mode], engine_stats.conns,
+                        engine_name[engine_stats.mode], engine_stats.hits,
+                        engine_name[engine_stats.mode], engine_stats.fetches,
+                        engine_name[engine_stats.mode], engine_stats.waits);
+}
+
+void request_init(request_t *r) {
+    r->headlen = 0;
+    r->reply = NULL;
+    r->replylen = 0;
+    r->fill = NULL;
+    r->objlen = 0;
+}
+
+/* Answer the request with an error page */
+static int reply_error(request_t *r, char *cause, char *errnum,
+                       char *shortmsg, char *longmsg) {
+    if(!r->reply)
+        r->reply = Malloc(MAXRESP);
+    r->replylen = format_error(r->reply, cause, errnum, shortmsg, longmsg);
+    return HEAD_REPLY;
+}
+
+/* Resolve hostname:port into r->addr, an IPv6 or IPv4 address. Only */
+/* the address getaddrinfo() prefers is kept: the engines connect to  */
+/* it alone, the race between addresses is the thread pool's.         */
+/* Return 0, or -1 on failure.                                        */
+static int resolve(request_t *r, char *hostname, int port) {
+    struct addrinfo hints, *addlist;
+    char port_str[MAXLINE];
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    sprintf(port_str, "%d", port);
+    if(getaddrinfo(hostname, port_str, &hints, &addlist) != 0)
+        return -1;
+    memcpy(&r->addr, addlist->ai_addr, addlist->ai_addrlen);
+    r->addrlen = addlist->ai_addrlen;
+    freeaddrinfo(addlist);
+    return 0;
+}
+
+/* Parse a complete request head. Mirrors serve_client() */
+static int request_parse(request_t *r) {
+    char method[MAXLINE], version[MAXLINE], line[MAXLINE];
+    char hostname[MAXLINE], path[MAXLINE];
+    char headers[NHEADERS][MAXLINE];
+    int  n_header = 0, port, len;
+    char *p, *eol;
+    cache_ref ref;
+
+    /* Request line */
+    eol = strchr(r->head, '\n');
+    if(eol - r->head + 1 >= MAXLINE)
+        return reply_error(r, "", "400", "Bad Request", "Request line too long");
+    *method = *r->uri = *version = '\0';
+    memcpy(line, r->head, eol - r->head + 1);
+    line[eol - r->head + 1] = '\0';
+    sscanf(line, "%s %s %s", method, r->uri, version);
+
+    r->reply = Malloc(MAXRESP);
+    if((len = check_request(method, r->uri, version, r->reply)) > 0) {
+        r->replylen = len;
+        return HEAD_REPLY;
+    }
+    if(!strcmp(r->uri, "/trace")) {
+        Free(r->reply);
+        r->replylen = trace_response(&r->reply);
+        return HEAD_REPLY;
+    }
+    if(r->uri[0] == '/') {
+        r->replylen = format_local(r->uri, r->reply);
+        return HEAD_REPLY;
+    }
+    if(parse_uri(r->uri, hostname, path, &port) < 0)
+        return reply_error(r, r->uri, "400", "Bad Request", "Bad URL");
+
+    /* Headers, up to the blank line request_head() found */
+    for(p = eol + 1; (eol = strchr(p, '\n')) != NULL; p = eol + 1) {
+        if(eol - p + 1 >= MAXLINE)
+            return reply_error(r, r->uri, "400", "Bad Request", "Bad header");
+        memcpy(line, p, eol - p + 1);
+        line[eol - p + 1] = '\0';
+        if(!strcmp(line, "\r\n") || !strcmp(line, "\n"))
+            break;
+        if(filter_header(line, headers, &n_header) < 0)
+            return reply_error(r, r->uri, "400", "Bad Request", "Bad header");
+    }
+
+    /* Find the object in cache. Return the object directly, unless  */
+    /* eviction dropped its tail: then it is fetched again in full.   */
+    if(lookup_cache(&cache, r->uri, &ref) == 1) {
+        if(ref.complete) {
+            Free(r->reply);
+            r->reply = Malloc(ref.hdr_size + ref.size);
+            r->replylen = read_cache(&ref, r->reply);
+            release_cache(&ref);
+            engine_stats.hits++;
+            return HEAD_REPLY;
+        }
+        release_cache(&ref);
+    }
+
+    if((r->reqlen = make_request(path, headers, n_header, r->req)) < 0)
+        return reply_error(r, r->uri, "400", "Bad Request",
+                           "Request headers too large");
+    if(resolve(r, hostname, port) < 0)
+        return reply_error(r, "", "1000", "DNS failed", "DNS failed");
+    if(cacheable_request(headers, n_header)) {
+        r->fill = Malloc(sizeof(cache_fill));
+        fill_init(r->fill);
+    }
+    engine_stats.fetches++;
+    return HEAD_FETCH;
+}
+
+/* Append n bytes read from the client. Return HEAD_MORE until the head */
+/* is complete, then HEAD_REPLY with r->reply set or HEAD_FETCH with    */
+/* r->addr and r->req set.                                              */
+int request_head(request_t *r, char *buf, int n) {
+    if(r->headlen + n >= ENGINE_HEADSIZE)
+        return reply_error(r, "", "400", "Bad Request", "Request too large");
+    memcpy(r->head + r->headlen, buf, n);
+    r->headlen += n;
+    r->head[r->headlen] = '\0';
+    if(!strstr(r->head, "\r\n\r\n") && !strstr(r->head, "\n\n"))
+        return HEAD_MORE;
+    return request_parse(r);
+}
+
+/* Keep a copy of relayed response bytes for the cache */
+void request_relayed(request_t *r, char *buf, int n) {
+    if(r->fill)
+        fill_append(r->fill, buf, n);
+    r->objlen += n;
+}
+
+/* Release the request. A complete response is cached */
+void request_done(request_t *r, int complete) {
+    if(r->fill) {
+        if(complete)
+            prefetch_fill(r->uri, r->fill);
+        store_fill(&cache, r->uri, r->fill, complete, 0);
+        Free(r->fill);
+    }
+    if(r->reply)
+        Free(r->reply);
+    request_init(r);
+}
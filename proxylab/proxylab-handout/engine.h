@@ -0,0 +1,61 @@
+#ifndef __ENGINE_H__
+#define __ENGINE_H__
+
+#include "csapp.h"
+#include "proxy.h"
+
+/* I/O engines selectable with -e */
+#define ENGINE_THREADS  0  /* blocking rio on a pool of worker threads */
+#define ENGINE_EPOLL    1  /* one thread, non-blocking sockets and epoll */
+#define ENGINE_URING    2  /* one thread, io_uring with provided buffers */
+
+#define ENGINE_HEADSIZE MAXBUF  /* largest request head an engine accepts */
+#define ENGINE_BUFSIZE  16384   /* relay buffer size */
+
+/* request_head() results */
+#define HEAD_MORE     0  /* need more bytes from the client */
+#define HEAD_REPLY    1  /* the proxy answers itself: send reply, close */
+#define HEAD_FETCH    2  /* connect to addr, send req, relay the response */
+
+/* One client request as seen by an event-driven engine. The engine     */
+/* feeds it raw bytes; parsing, the cache and the request for the       */
+/* origin are handled here exactly as serve_client() does it.           */
+typedef struct {
+    char head[ENGINE_HEADSIZE]; /* request line and headers as received */
+    int  headlen;
+    char uri[MAXLINE];          /* cache tag */
+    char *reply;                /* response generated by the proxy */
+    int  replylen;
+    char req[MAXREQ];           /* request for the origin */
+    int  reqlen;
+    struct sockaddr_storage addr; /* origin address, its family the socket's */
+    socklen_t addrlen;
+    cache_fill *fill;           /* the response on its way to the cache */
+    int  objlen;                /* bytes relayed so far */
+} request_t;
+
+/* Counters of the running engine. Event engines run on one thread, */
+/* so they are updated without locking.                             */
+typedef struct {
+    int mode;            /* ENGINE_* in use */
+    long long conns;     /* connections accepted */
+    long long hits;      /* requests answered from the cache */
+    long long fetches;   /* requests relayed from an origin */
+    long long waits;     /* epoll_wait() / io_uring_enter() calls */
+} engine_stats_t;
+
+extern engine_stats_t engine_stats;
+extern char *engine_name[];
+
+int  engine_parse(char *name);
+int  engine_format(char *buf, int size);
+
+void request_init(request_t *r);
+int  request_head(request_t *r, char *buf, int n);
+void request_relayed(request_t *r, char *buf, int n);
+void request_done(request_t *r, int complete);
+
+int  engine_epoll_run(int listenfd);
+int  engine_uring_run(int listenfd);
+
+#endif /* __ENGINE_H__ */
@@ -0,0 +1,319 @@
+#define _GNU_SOURCE  /* accept4 */
+#include <sys/epoll.h>
+#include "csapp.h"
+#include "engine.h"
+
+/*
+ * engine_epoll.c - single-threaded proxy on non-blocking sockets
+ *
+ * Each connection is a small state machine driven by level-triggered
+ * epoll events. I/O is always tried first and a socket is only armed
+ * in epoll once it returns EAGAIN, so a request that arrives in one
+ * segment and a response that fits the socket buffers cost no extra
+ * wakeups. While one side of the relay is blocked the other is not
+ * watched, which gives backpressure without unbounded buffering.
+ * Name resolution still uses the blocking getaddrinfo().
+ */
+
+#define MAXEVENTS 256
+
+/* Connection states */
+#define ST_HEAD     0  /* reading the request head */
+#define ST_REPLY    1  /* writing a response generated by the proxy */
+#define ST_CONNECT  2  /* waiting for connect() to the origin */
+#define ST_SEND     3  /* writing the request to the origin */
+#define ST_RELAY    4  /* relaying the origin's response to the client */
+#define ST_DEAD     5  /* closed, freed at the end of the event batch */
+
+typedef struct econn econn_t;
+
+/* epoll returns a pointer to one of these to tell which socket fired */
+typedef struct {
+    econn_t *conn;  /* NULL for the listening socket */
+    int origin;     /* 1 for the origin side of conn */
+} handle_t;
+
+struct econn {
+    int cfd, sfd;            /* client and origin sockets */
+    int cwatch, swatch;      /* events armed in epoll, -1 if not added */
+    handle_t ch, sh;
+    int state;
+    int off;                 /* bytes of the reply or request sent */
+    char buf[ENGINE_BUFSIZE];/* response bytes for the client */
+    int buflen, bufoff;
+    request_t r;
+    econn_t *next_dead;
+};
+
+static int epfd;
+static handle_t listen_handle;
+static econn_t *dead;        /* connections closed in this batch */
+
+/* Arm fd for events (0 keeps only EPOLLERR/EPOLLHUP) */
+static void watch(int fd, handle_t *h, int *cur, int events) {
+    struct epoll_event ev;
+
+    if(*cur == events)
+        return;
+    ev.events = events;
+    ev.data.ptr = h;
+    epoll_ctl(epfd, (*cur < 0) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
+    *cur = events;
+}
+
+static void conn_close(econn_t *c, int complete) {
+    request_done(&c->r, complete);
+    Close(c->cfd);               /* close() also removes it from epoll */
+    if(c->sfd >= 0)
+        Close(c->sfd);
+    c->state = ST_DEAD;
+    c->next_dead = dead;
+    dead = c;
+}
+
+static void do_reply(econn_t *c) {
+    int n;
+
+    c->state = ST_REPLY;
+    while(c->off < c->r.replylen) {
+        n = send(c->cfd, c->r.reply + c->off, c->r.replylen - c->off,
+                 MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno == EAGAIN)
+                watch(c->cfd, &c->ch, &c->cwatch, EPOLLOUT);
+            else
+                conn_close(c, 0);
+            return;
+        }
+        c->off += n;
+    }
+    conn_close(c, 0);
+}
+
+/* The origin failed before answering: tell the client */
+static void fetch_failed(econn_t *c) {
+    Close(c->sfd);
+    c->sfd = -1;
+    c->r.replylen = format_error(c->r.reply, "", "504", "Gateway Timeout",
+                                 "Origin server did not respond");
+    c->off = 0;
+    do_reply(c);
+}
+
+/* Send as much of the buffered response to the client as it takes.  */
+/* Return 1 when the buffer is empty, 0 if the client is full, or -1 */
+/* if the connection was closed.                                     */
+static int relay_write(econn_t *c) {
+    int n;
+
+    while(c->bufoff < c->buflen) {
+        n = send(c->cfd, c->buf + c->bufoff, c->buflen - c->bufoff,
+                 MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno != EAGAIN) {
+                conn_close(c, 0);
+                return -1;
+            }
+            watch(c->cfd, &c->ch, &c->cwatch, EPOLLOUT);
+            watch(c->sfd, &c->sh, &c->swatch, 0);
+            return 0;
+        }
+        c->bufoff += n;
+    }
+    return 1;
+}
+
+static void relay_read(econn_t *c) {
+    int n;
+
+    while(1) {
+        n = recv(c->sfd, c->buf, ENGINE_BUFSIZE, 0);
+        if(n == 0) {
+            conn_close(c, 1);
+            return;
+        }
+        if(n < 0) {
+            if(errno == EAGAIN) {
+                watch(c->sfd, &c->sh, &c->swatch, EPOLLIN);
+                watch(c->cfd, &c->ch, &c->cwatch, 0);
+            }
+            else if(c->r.objlen == 0)
+                fetch_failed(c);
+            else
+                conn_close(c, 0);
+            return;
+        }
+        request_relayed(&c->r, c->buf, n);
+        c->buflen = n;
+        c->bufoff = 0;
+        if(relay_write(c) <= 0)
+            return;
+    }
+}
+
+static void do_send(econn_t *c) {
+    int n;
+
+    c->state = ST_SEND;
+    while(c->off < c->r.reqlen) {
+        n = send(c->sfd, c->r.req + c->off, c->r.reqlen - c->off,
+                 MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno == EAGAIN)
+                watch(c->sfd, &c->sh, &c->swatch, EPOLLOUT);
+            else
+                fetch_failed(c);
+            return;
+        }
+        c->off += n;
+    }
+    c->state = ST_RELAY;
+    c->buflen = c->bufoff = 0;
+    relay_read(c);
+}
+
+static void do_connect(econn_t *c) {
+    c->sfd = socket(c->r.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(c->sfd < 0) {
+        conn_close(c, 0);
+        return;
+    }
+    c->swatch = -1;
+    c->off = 0;
+    /* The client has nothing more to say until the response is relayed */
+    watch(c->cfd, &c->ch, &c->cwatch, 0);
+    if(connect(c->sfd, (SA *)&c->r.addr, c->r.addrlen) == 0) {
+        do_send(c);
+    }
+    else if(errno == EINPROGRESS) {
+        c->state = ST_CONNECT;
+        watch(c->sfd, &c->sh, &c->swatch, EPOLLOUT);
+    }
+    else {
+        fetch_failed(c);
+    }
+}
+
+static void read_head(econn_t *c) {
+    char buf[ENGINE_BUFSIZE];
+    int  n, rc;
+
+    while(1) {
+        n = recv(c->cfd, buf, sizeof(buf), 0);
+        if(n <= 0) {
+            if(n < 0 && errno == EAGAIN)
+                watch(c->cfd, &c->ch, &c->cwatch, EPOLLIN);
+            else
+                conn_close(c, 0);
+            return;
+        }
+        rc = request_head(&c->r, buf, n);
+        if(rc == HEAD_REPLY) {
+            c->off = 0;
+            do_reply(c);
+            return;
+        }
+        if(rc == HEAD_FETCH) {
+            do_connect(c);
+            return;
+        }
+    }
+}
+
+static void on_accept(int listenfd) {
+    econn_t *c;
+    int fd;
+
+    while((fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+        engine_stats.conns++;
+        c = Malloc(sizeof(econn_t));
+        c->cfd = fd;
+        c->sfd = -1;
+        c->cwatch = c->swatch = -1;
+        c->ch.conn = c->sh.conn = c;
+        c->ch.origin = 0;
+        c->sh.origin = 1;
+        c->state = ST_HEAD;
+        request_init(&c->r);
+        /* With TCP_DEFER_ACCEPT the request is usually here already */
+        read_head(c);
+    }
+}
+
+static void on_client(econn_t *c) {
+    switch(c->state) {
+    case ST_HEAD:
+        read_head(c);
+        break;
+    case ST_REPLY:
+        do_reply(c);
+        break;
+    case ST_RELAY:
+        if(c->cwatch == EPOLLOUT) {
+            if(relay_write(c) == 1)
+                relay_read(c);
+            break;
+        }
+        /* fall through: EPOLLERR/EPOLLHUP while the client is not armed */
+    default:
+        conn_close(c, 0);
+    }
+}
+
+static void on_origin(econn_t *c) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    switch(c->state) {
+    case ST_CONNECT:
+        if(getsockopt(c->sfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err)
+            fetch_failed(c);
+        else
+            do_send(c);
+        break;
+    case ST_SEND:
+        do_send(c);
+        break;
+    case ST_RELAY:
+        relay_read(c);
+        break;
+    }
+}
+
+/* Serve listenfd forever. Return -1 if epoll cannot be set up */
+int engine_epoll_run(int listenfd) {
+    struct epoll_event events[MAXEVENTS], ev;
+    handle_t *h;
+    econn_t *c;
+    int n, i;
+
+    if((epfd = epoll_create1(0)) < 0)
+        return -1;
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL, 0) | O_NONBLOCK);
+    listen_handle.conn = NULL;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listen_handle;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+        return -1;
+    engine_stats.mode = ENGINE_EPOLL;
+
+    while(1) {
+        n = epoll_wait(epfd, events, MAXEVENTS, -1);
+        engine_stats.waits++;
+        for(i = 0; i < n; i++) {
+            h = events[i].data.ptr;
+            if(!h->conn)
+                on_accept(listenfd);
+            else if(h->conn->state == ST_DEAD)
+                continue;
+            else if(h->origin)
+                on_origin(h->conn);
+            else
+                on_client(h->conn);
+        }
+        while((c = dead) != NULL) {
+            dead = c->next_dead;
+            Free(c);
+        }
+    }
+}
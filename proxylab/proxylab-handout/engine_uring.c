@@ -0,0 +1,450 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "csapp.h"
+#include "engine.h"
+
+/*
+ * engine_uring.c - single-threaded proxy on io_uring
+ *
+ * The rings are set up with the raw system calls, so no liburing is
+ * needed. One multishot accept produces every new connection. Reads
+ * use a ring of provided buffers registered with the kernel, so a recv
+ * takes a buffer only when data arrives instead of pinning one per
+ * idle connection. Each relayed chunk is sent with a send that is
+ * linked to the next recv on the origin, so the kernel runs the pair
+ * in order without a round trip through this loop. A recv that finds
+ * every buffer taken fails with ENOBUFS; its connection then waits on
+ * a list and the recv is submitted again when a buffer is recycled,
+ * rather than straight away. SQEs produced while
+ * handling a batch of completions are submitted together with the
+ * wait for the next batch: one io_uring_enter() per loop iteration.
+ *
+ * The provided buffer ring and multishot accept both need Linux 5.19;
+ * if setup or buffer registration fails the caller falls back to epoll.
+ */
+
+#define URING_ENTRIES 1024
+/* Provided buffers, a power of two. A relayed chunk holds its buffer */
+/* until the send to the client completes, so NBUFS slow clients take */
+/* them all and every other recv waits until one of them catches up.  */
+#define NBUFS         256
+#define BGID          0     /* buffer group of the provided buffers */
+
+/* Operation tag kept in the low bits of user_data */
+#define OP_ACCEPT   0
+#define OP_HEAD     1  /* recv of the request head */
+#define OP_REPLY    2  /* send of a response generated by the proxy */
+#define OP_CONNECT  3
+#define OP_REQUEST  4  /* send of the request to the origin */
+#define OP_RECV     5  /* recv from the origin */
+#define OP_SEND     6  /* send of a relayed chunk to the client */
+#define OP_CLOSE    7
+#define OP_MASK     7
+
+typedef struct uconn {
+    request_t r;
+    int cfd, sfd;     /* client and origin sockets */
+    int pending;      /* SQEs whose completion has not been seen */
+    int done;         /* request finished, free once pending is 0 */
+    int origin_failed;/* origin failed before the first response byte */
+    int off;          /* bytes of the reply sent */
+    int bid;          /* provided buffer of the chunk being sent */
+    int sendlen;      /* size of that chunk */
+    int wait_fd, wait_op;   /* recv to submit once a buffer is free */
+    struct uconn *wait_next;
+} uconn_t;
+
+static struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned tail;        /* local SQ tail */
+    unsigned submitted;   /* SQEs handed to the kernel */
+    struct io_uring_buf_ring *br;
+    unsigned short br_tail;
+    char *bufs;
+} ring;
+
+static int listen_fd;
+static uconn_t *wait_head, *wait_tail;  /* recvs waiting for a buffer */
+
+static void submit_recv(uconn_t *c, int fd, int op);
+
+static int uring_enter(unsigned to_submit, unsigned min_complete,
+                       unsigned flags) {
+    return syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete,
+                   flags, NULL, 0);
+}
+
+/* Hand queued SQEs to the kernel and optionally wait for completions */
+static int flush(unsigned wait) {
+    int n;
+
+    __atomic_store_n(ring.sq_tail, ring.tail, __ATOMIC_RELEASE);
+    n = uring_enter(ring.tail - ring.submitted, wait,
+                    wait ? IORING_ENTER_GETEVENTS : 0);
+    engine_stats.waits++;
+    if(n > 0)
+        ring.submitted += n;
+    return n;
+}
+
+static struct io_uring_sqe *get_sqe(void) {
+    struct io_uring_sqe *sqe;
+
+    while(ring.tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >=
+          ring.sq_entries)
+        flush(0);
+    sqe = &ring.sqes[ring.tail & *ring.sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.tail++;
+    return sqe;
+}
+
+static struct io_uring_sqe *prep(int opcode, int fd, uconn_t *c, int op) {
+    struct io_uring_sqe *sqe = get_sqe();
+
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (unsigned long)c | op;
+    if(c)
+        c->pending++;
+    return sqe;
+}
+
+/* Give buffer bid back to the kernel, and the first recv waiting for */
+/* a buffer another try                                                */
+static void buf_recycle(int bid) {
+    struct io_uring_buf *b = &ring.br->bufs[ring.br_tail & (NBUFS - 1)];
+    uconn_t *c;
+
+    b->addr = (unsigned long)(ring.bufs + bid * ENGINE_BUFSIZE);
+    b->len = ENGINE_BUFSIZE;
+    b->bid = bid;
+    ring.br_tail++;
+    __atomic_store_n(&ring.br->tail, ring.br_tail, __ATOMIC_RELEASE);
+    if((c = wait_head) != NULL) {
+        if((wait_head = c->wait_next) == NULL)
+            wait_tail = NULL;
+        submit_recv(c, c->wait_fd, c->wait_op);
+    }
+}
+
+/* Park c until buf_recycle has a buffer for its recv on fd as op */
+static void buf_wait(uconn_t *c, int fd, int op) {
+    c->wait_fd = fd;
+    c->wait_op = op;
+    c->wait_next = NULL;
+    if(wait_tail)
+        wait_tail->wait_next = c;
+    else
+        wait_head = c;
+    wait_tail = c;
+}
+
+/* Map the rings and register the provided buffers. Return 0 or -1 */
+static int ring_setup(void) {
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    size_t sqsz, cqsz;
+    char *sq, *cq;
+    unsigned i;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER;
+    ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if(ring.fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    }
+    if(ring.fd < 0)
+        return -1;
+
+    sqsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if((p.features & IORING_FEAT_SINGLE_MMAP) && cqsz > sqsz)
+        sqsz = cqsz;
+    sq = mmap(NULL, sqsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              ring.fd, IORING_OFF_SQ_RING);
+    if(sq == MAP_FAILED)
+        return -1;
+    cq = sq;
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cqsz, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+        if(cq == MAP_FAILED)
+            return -1;
+    }
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring.fd, IORING_OFF_SQES);
+    if(ring.sqes == MAP_FAILED)
+        return -1;
+
+    ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.sq_entries = p.sq_entries;
+    ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    for(i = 0; i < p.sq_entries; i++)
+        ring.sq_array[i] = i;     /* SQE i always sits in slot i */
+    ring.tail = ring.submitted = *ring.sq_tail;
+
+    /* Provided buffers for every recv */
+    ring.br = mmap(NULL, NBUFS * sizeof(struct io_uring_buf),
+                   PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if(ring.br == MAP_FAILED)
+        return -1;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)ring.br;
+    reg.ring_entries = NBUFS;
+    reg.bgid = BGID;
+    if(syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING,
+               &reg, 1) < 0)
+        return -1;
+    ring.bufs = Malloc(NBUFS * ENGINE_BUFSIZE);
+    ring.br_tail = 0;
+    for(i = 0; i < NBUFS; i++)
+        buf_recycle(i);
+    return 0;
+}
+
+static void arm_accept(void) {
+    struct io_uring_sqe *sqe = prep(IORING_OP_ACCEPT, listen_fd, NULL,
+                                    OP_ACCEPT);
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+static void submit_recv(uconn_t *c, int fd, int op) {
+    struct io_uring_sqe *sqe = prep(IORING_OP_RECV, fd, c, op);
+
+    sqe->len = ENGINE_BUFSIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BGID;
+}
+
+static struct io_uring_sqe *submit_send(uconn_t *c, int fd, char *buf,
+                                        int len, int op) {
+    struct io_uring_sqe *sqe = prep(IORING_OP_SEND, fd, c, op);
+
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    return sqe;
+}
+
+static void submit_close(int fd) {
+    prep(IORING_OP_CLOSE, fd, NULL, OP_CLOSE);
+}
+
+static void submit_reply(uconn_t *c) {
+    submit_send(c, c->cfd, c->r.reply + c->off, c->r.replylen - c->off,
+                OP_REPLY);
+}
+
+static void finish(uconn_t *c, int complete) {
+    request_done(&c->r, complete);
+    c->done = 1;
+}
+
+/* Connect, send the request and wait for the response as one chain */
+static void submit_fetch(uconn_t *c) {
+    struct io_uring_sqe *sqe;
+
+    if((c->sfd = socket(c->r.addr.ss_family, SOCK_STREAM, 0)) < 0) {
+        finish(c, 0);
+        return;
+    }
+    sqe = prep(IORING_OP_CONNECT, c->sfd, c, OP_CONNECT);
+    sqe->addr = (unsigned long)&c->r.addr;
+    sqe->off = c->r.addrlen;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe = submit_send(c, c->sfd, c->r.req, c->r.reqlen, OP_REQUEST);
+    sqe->flags = IOSQE_IO_LINK;
+    submit_recv(c, c->sfd, OP_RECV);
+}
+
+/* Called after every completion of c. Once nothing of c is in flight */
+/* it either reports a failed origin to the client or goes away.      */
+static void settle(uconn_t *c) {
+    if(c->pending > 0)
+        return;
+    if(c->origin_failed && !c->done) {
+        c->origin_failed = 0;
+        submit_close(c->sfd);
+        c->sfd = -1;
+        c->r.replylen = format_error(c->r.reply, "", "504", "Gateway Timeout",
+                                     "Origin server did not respond");
+        c->off = 0;
+        submit_reply(c);
+        return;
+    }
+    if(c->done) {
+        submit_close(c->cfd);
+        if(c->sfd >= 0)
+            submit_close(c->sfd);
+        Free(c);
+    }
+}
+
+static void on_accept(int res, unsigned flags) {
+    uconn_t *c;
+
+    if(!(flags & IORING_CQE_F_MORE))
+        arm_accept();
+    if(res < 0)
+        return;
+    engine_stats.conns++;
+    c = Malloc(sizeof(uconn_t));
+    request_init(&c->r);
+    c->cfd = res;
+    c->sfd = -1;
+    c->pending = c->done = c->origin_failed = 0;
+    submit_recv(c, c->cfd, OP_HEAD);
+}
+
+static void on_head(uconn_t *c, int res, unsigned flags) {
+    int bid, rc;
+
+    if(res == -ENOBUFS) {     /* every buffer is in use: wait for one */
+        buf_wait(c, c->cfd, OP_HEAD);
+        return;
+    }
+    if(res <= 0) {
+        finish(c, 0);
+        return;
+    }
+    bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    rc = request_head(&c->r, ring.bufs + bid * ENGINE_BUFSIZE, res);
+    buf_recycle(bid);
+    if(rc == HEAD_MORE) {
+        submit_recv(c, c->cfd, OP_HEAD);
+    }
+    else if(rc == HEAD_REPLY) {
+        c->off = 0;
+        submit_reply(c);
+    }
+    else {
+        submit_fetch(c);
+    }
+}
+
+static void on_recv(uconn_t *c, int res, unsigned flags) {
+    struct io_uring_sqe *sqe;
+    char *buf;
+
+    if(res == -ECANCELED)     /* an earlier link of the chain failed */
+        return;
+    if(res == -ENOBUFS) {
+        buf_wait(c, c->sfd, OP_RECV);
+        return;
+    }
+    if(res == 0) {
+        finish(c, 1);
+        return;
+    }
+    if(res < 0) {
+        if(c->r.objlen == 0)
+            c->origin_failed = 1;
+        else
+            finish(c, 0);
+        return;
+    }
+    c->bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    c->sendlen = res;
+    buf = ring.bufs + c->bid * ENGINE_BUFSIZE;
+    request_relayed(&c->r, buf, res);
+    sqe = submit_send(c, c->cfd, buf, res, OP_SEND);
+    sqe->flags = IOSQE_IO_LINK;
+    submit_recv(c, c->sfd, OP_RECV);
+}
+
+static void on_complete(struct io_uring_cqe *cqe) {
+    uconn_t *c = (uconn_t *)(unsigned long)(cqe->user_data & ~(__u64)OP_MASK);
+    int op = cqe->user_data & OP_MASK;
+    int res = cqe->res;
+
+    if(op == OP_ACCEPT) {
+        on_accept(res, cqe->flags);
+        return;
+    }
+    if(op == OP_CLOSE)
+        return;
+
+    c->pending--;
+    if(op == OP_SEND)
+        buf_recycle(c->bid);
+    if(c->done) {
+        /* Only cancelled links of a finished request arrive here */
+        if(res > 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+            buf_recycle(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        settle(c);
+        return;
+    }
+
+    switch(op) {
+    case OP_HEAD:
+        on_head(c, res, cqe->flags);
+        break;
+    case OP_REPLY:
+        if(res > 0 && c->off + res < c->r.replylen) {
+            c->off += res;
+            submit_reply(c);
+        }
+        else {
+            finish(c, 0);
+        }
+        break;
+    case OP_CONNECT:
+        if(res < 0)           /* the linked send and recv are cancelled */
+            c->origin_failed = 1;
+        break;
+    case OP_REQUEST:
+        if(res != c->r.reqlen)
+            c->origin_failed = 1;
+        break;
+    case OP_RECV:
+        on_recv(c, res, cqe->flags);
+        break;
+    case OP_SEND:
+        if(res != c->sendlen) /* client went away; the linked recv is */
+            finish(c, 0);     /* cancelled                             */
+        break;
+    }
+    settle(c);
+}
+
+/* Serve listenfd forever. Return -1 if io_uring is unavailable */
+int engine_uring_run(int listenfd) {
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+
+    if(ring_setup() < 0)
+        return -1;
+    listen_fd = listenfd;
+    engine_stats.mode = ENGINE_URING;
+    arm_accept();
+
+    while(1) {
+        if(flush(1) < 0 && errno != EINTR && errno != EBUSY) {
+            fprintf(stderr, "io_uring_enter: %s\n", strerror(errno));
+            exit(1);
+        }
+        head = *ring.cq_head;
+        tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        while(head != tail) {
+            cqe = &ring.cqes[head & *ring.cq_mask];
+            on_complete(cqe);
+            head++;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+}
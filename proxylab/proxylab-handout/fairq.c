@@ -0,0 +1,254 @@
+#include "csapp.h"
+#include "metrics.h"
+#include "fairq.h"
+
+/*
+ * fairq.c - per-client fair queuing and bandwidth caps
+ *
+ * Connections are accounted to the client address they come from. Each
+ * lane keeps a queue per client and hands connections to its workers by
+ * deficit round-robin: the client at the head of the round may go on
+ * while it has credit, then goes to the back with FAIRQ_QUANTUM more.
+ * A request costs FAIRQ_COST when it is dequeued and the bytes sent to
+ * the client once it is done, so a client pulling large objects gets
+ * proportionally fewer turns, and one flooding the proxy with requests
+ * only lengthens its own queue. Beyond FAIRQ_DEPTH queued connections a
+ * client is turned away with a 503 rather than blocking the acceptor.
+ *
+ * With -b, every client also gets a token bucket: fairq_sent() charges
+ * the bytes a worker is about to write and sleeps until the bucket
+ * allows them.
+ */
+
+#define MAX_DEBT (8 * FAIRQ_QUANTUM)  /* bounds the turns a client owes */
+
+fairq_conf_t fairq_conf = { 0, 0 };
+
+typedef struct {
+    int  used;
+    unsigned gen;       /* bumped each time the slot gets a new address */
+    in_addr_t addr;
+    int  refs;          /* connections accepted and not yet done */
+    long long seen;     /* last accept (us), to recycle idle slots */
+    long long accepted, rejected, served, bytes;
+    int  queued;        /* connections waiting in a lane */
+    double tokens;      /* token bucket for fairq_conf.rate */
+    long long refill;   /* last refill of the bucket (us) */
+} client_t;
+
+static client_t clients[FAIRQ_CLIENTS];
+static sem_t client_mutex;   /* protects clients */
+static pthread_once_t client_once = PTHREAD_ONCE_INIT;
+
+static void client_init(void) {
+    Sem_init(&client_mutex, 0, 1);
+}
+
+void fairq_init(fairq_t *q) {
+    memset(q->front, 0, sizeof(q->front));
+    memset(q->count, 0, sizeof(q->count));
+    memset(q->deficit, 0, sizeof(q->deficit));
+    memset(q->gen, 0, sizeof(q->gen));
+    q->afront = q->nactive = q->depth = 0;
+    Sem_init(&q->mutex, 0, 1);
+    Sem_init(&q->items, 0, 0);
+    pthread_once(&client_once, client_init);
+    if(fairq_conf.rate > 0 && fairq_conf.burst <= 0)
+        fairq_conf.burst = fairq_conf.rate;
+}
+
+/* Return the client slot for a new connection from addr. A new address */
+/* takes a free slot or the one idle longest; if every slot is busy, it  */
+/* shares one picked by address. A slot given a new address starts a new */
+/* generation, so the lanes drop the deficit of the client before it.    */
+int fairq_client(struct sockaddr_in *addr) {
+    in_addr_t a = addr->sin_addr.s_addr;
+    int  i, slot = -1;
+    unsigned gen;
+    client_t *c;
+
+    P(&client_mutex);
+    for(i = 0; i < FAIRQ_CLIENTS; i++) {
+        c = &clients[i];
+        if(c->used && c->addr == a) {
+            slot = i;
+            break;
+        }
+        if(!c->refs && (slot < 0 || !c->used ||
+                        (clients[slot].used && c->seen < clients[slot].seen)))
+            slot = i;
+    }
+    if(slot < 0)
+        slot = ntohl(a) % FAIRQ_CLIENTS;
+    c = &clients[slot];
+    if(!c->used || (c->addr != a && !c->refs)) {
+        gen = c->gen + 1;
+        memset(c, 0, sizeof(*c));
+        __atomic_store_n(&c->gen, gen, __ATOMIC_RELAXED);
+        c->used = 1;
+        c->addr = a;
+        c->tokens = fairq_conf.burst;
+        c->refill = now_us();
+    }
+    c->refs++;
+    c->accepted++;
+    c->seen = now_us();
+    V(&client_mutex);
+    return slot;
+}
+
+/* The connection from client is closed */
+void fairq_release(int client) {
+    P(&client_mutex);
+    clients[client].refs--;
+    V(&client_mutex);
+}
+
+/* Queue fd from client. Return -1, and queue nothing, if the client */
+/* already has FAIRQ_DEPTH connections waiting in q.                 */
+int fairq_insert(fairq_t *q, int client, int fd) {
+    unsigned gen = __atomic_load_n(&clients[client].gen, __ATOMIC_RELAXED);
+    int slot;
+
+    P(&q->mutex);
+    if(q->gen[client] != gen) {
+        /* The slot went to a new address: it owes nothing here */
+        q->gen[client] = gen;
+        q->deficit[client] = 0;
+    }
+    if(q->count[client] == FAIRQ_DEPTH) {
+        V(&q->mutex);
+        P(&client_mutex);
+        clients[client].rejected++;
+        V(&client_mutex);
+        return -1;
+    }
+    slot = (q->front[client] + q->count[client]) % FAIRQ_DEPTH;
+    q->fd[client][slot] = fd;
+    q->stamp[client][slot] = now_us();
+    if(q->count[client]++ == 0) {
+        /* Join the round with no credit, but with no more than MAX_DEBT */
+        q->active[(q->afront + q->nactive++) % FAIRQ_CLIENTS] = client;
+        if(q->deficit[client] > 0)
+            q->deficit[client] = 0;
+    }
+    q->depth++;
+    V(&q->mutex);
+    __sync_fetch_and_add(&clients[client].queued, 1);
+    V(&q->items);
+    return 0;
+}
+
+/* Remove the next fd by deficit round-robin. Set *client to its client */
+/* and *wait_us to the time it spent queued.                            */
+int fairq_remove(fairq_t *q, int *client, long long *wait_us) {
+    int c, fd;
+    long long stamp;
+
+    P(&q->items);
+    P(&q->mutex);
+    while(q->deficit[c = q->active[q->afront]] <= 0) {
+        /* Out of credit: to the back of the round with a new quantum */
+        q->deficit[c] += FAIRQ_QUANTUM;
+        q->afront = (q->afront + 1) % FAIRQ_CLIENTS;
+        q->active[(q->afront + q->nactive - 1) % FAIRQ_CLIENTS] = c;
+    }
+    fd = q->fd[c][q->front[c]];
+    stamp = q->stamp[c][q->front[c]];
+    q->front[c] = (q->front[c] + 1) % FAIRQ_DEPTH;
+    q->deficit[c] -= FAIRQ_COST;
+    if(--q->count[c] == 0) {
+        q->afront = (q->afront + 1) % FAIRQ_CLIENTS;
+        q->nactive--;
+    }
+    q->depth--;
+    V(&q->mutex);
+    __sync_fetch_and_sub(&clients[c].queued, 1);
+    *client = c;
+    if(wait_us)
+        *wait_us = now_us() - stamp;
+    return fd;
+}
+
+/* A connection removed from q is done after sending sent bytes */
+void fairq_done(fairq_t *q, int client, long long sent) {
+    P(&q->mutex);
+    q->deficit[client] -= sent;
+    if(q->deficit[client] < -MAX_DEBT)
+        q->deficit[client] = -MAX_DEBT;
+    V(&q->mutex);
+    P(&client_mutex);
+    clients[client].served++;
+    clients[client].refs--;
+    V(&client_mutex);
+}
+
+/* Account n bytes about to be sent to client, and wait for the token */
+/* bucket to allow them when a rate is set. Without one, only the     */
+/* count is kept, with no lock on the relay path.                     */
+void fairq_sent(int client, int n) {
+    client_t *c = &clients[client];
+    long long now, wait = 0;
+
+    if(fairq_conf.rate <= 0) {
+        __sync_fetch_and_add(&c->bytes, n);
+        return;
+    }
+    P(&client_mutex);
+    c->bytes += n;
+    now = now_us();
+    c->tokens += (now - c->refill) * (double)fairq_conf.rate / 1000000;
+    if(c->tokens > fairq_conf.burst)
+        c->tokens = fairq_conf.burst;
+    c->refill = now;
+    c->tokens -= n;
+    if(c->tokens < 0)
+        wait = -c->tokens * 1000000 / fairq_conf.rate;
+    V(&client_mutex);
+    if(wait > 0)
+        usleep(wait);
+}
+
+/* Number of fds currently queued in q */
+int fairq_depth(fairq_t *q) {
+    int depth;
+
+    P(&q->mutex);
+    depth = q->depth;
+    V(&q->mutex);
+    return depth;
+}
+
+/* Append the counters of the FAIRQ_REPORT clients that were sent the */
+/* most bytes to buf                                                  */
+int fairq_format(char *buf, int size) {
+    char addr[INET_ADDRSTRLEN];
+    int  len = 0, picked[FAIRQ_CLIENTS] = { 0 }, i, n, best, nused = 0;
+    client_t *c;
+
+    P(&client_mutex);
+    for(i = 0; i < FAIRQ_CLIENTS; i++)
+        nused += clients[i].used;
+    len += stats_printf(buf + len, size - len, "fairq.clients %d\n", nused);
+    for(n = 0; n < FAIRQ_REPORT; n++) {
+        for(best = -1, i = 0; i < FAIRQ_CLIENTS; i++) {
+            if(clients[i].used && !picked[i] &&
+               (best < 0 || clients[i].bytes > clients[best].bytes))
+                best = i;
+        }
+        if(best < 0)
+            break;
+        picked[best] = 1;
+        c = &clients[best];
+        inet_ntop(AF_INET, &c->addr, addr, sizeof(addr));
+        len += stats_printf(buf + len, size - len,
+                            "client.%s.queued %d\nclient.%s.active %d\n"
+                            "client.%s.accepted %lld\nclient.%s.rejected %lld\n"
+                            "client.%s.served %lld\nclient.%s.bytes %lld\n",
+                            addr, c->queued, addr, c->refs - c->queued,
+                            addr, c->accepted, addr, c->rejected,
+                            addr, c->served, addr, c->bytes);
+    }
+    V(&client_mutex);
+    return len;
+}
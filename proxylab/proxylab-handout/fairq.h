@@ -0,0 +1,45 @@
+#ifndef __FAIRQ_H__
+#define __FAIRQ_H__
+
+#include "csapp.h"
+
+#define FAIRQ_CLIENTS  64     /* client addresses tracked at once */
+#define FAIRQ_DEPTH    16     /* connections queued per client and queue */
+#define FAIRQ_QUANTUM  16384  /* bytes a client may send per round */
+#define FAIRQ_COST     2048   /* bytes charged up front per request */
+#define FAIRQ_REPORT   8      /* busiest clients listed in /stats */
+
+/* Bandwidth caps are off unless -b sets rate */
+typedef struct {
+    long long rate;   /* bytes per second per client, 0 = unlimited */
+    long long burst;  /* bytes a client may send at once (default rate) */
+} fairq_conf_t;
+
+extern fairq_conf_t fairq_conf;
+
+/* Connections queued per client, served by deficit round-robin */
+typedef struct {
+    int fd[FAIRQ_CLIENTS][FAIRQ_DEPTH];           /* per-client rings */
+    long long stamp[FAIRQ_CLIENTS][FAIRQ_DEPTH];  /* enqueue time (us) */
+    int front[FAIRQ_CLIENTS];
+    int count[FAIRQ_CLIENTS];
+    long long deficit[FAIRQ_CLIENTS]; /* bytes the client may still send */
+    unsigned gen[FAIRQ_CLIENTS];  /* client generation deficit is for */
+    int active[FAIRQ_CLIENTS];  /* ring of clients with queued fds */
+    int afront, nactive;
+    int depth;                  /* fds queued in total */
+    sem_t mutex;                /* protects the fields above */
+    sem_t items;                /* counts queued fds */
+} fairq_t;
+
+void fairq_init(fairq_t *q);
+int  fairq_client(struct sockaddr_in *addr);
+void fairq_release(int client);
+int  fairq_insert(fairq_t *q, int client, int fd);
+int  fairq_remove(fairq_t *q, int *client, long long *wait_us);
+void fairq_done(fairq_t *q, int client, long long sent);
+void fairq_sent(int client, int n);
+int  fairq_depth(fairq_t *q);
+int  fairq_format(char *buf, int size);
+
+#endif /* __FAIRQ_H__ */
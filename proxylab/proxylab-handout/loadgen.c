@@ -0,0 +1,501 @@
+/*
+ * loadgen.c - load generator for the proxy
+ *
+ * usage: loadgen [options]
+ *   -p host:port   proxy to send requests through (default: none, the
+ *                  requests go straight to the origin)
+ *   -o port        run the built-in static origin on port (default)
+ *   -O host:port   use an external origin such as tiny instead
+ *   -U file        paths to request from -O, one per line, in order of
+ *                  popularity (default: /home.html)
+ *   -u n           number of distinct objects of the built-in origin
+ *   -s exponent    Zipf exponent of object popularity (default 1.0)
+ *   -z size        object size in bytes, or min:max for sizes spread
+ *                  log-uniformly over the objects (default 1024:204800)
+ *   -c n           closed loop: n clients, each sends its next request
+ *                  when the previous one completes (default 8)
+ *   -r rate        open loop: requests arrive at rate/s regardless of
+ *                  completions, served by up to -c connections at once
+ *   -n n           stop after n requests (default 1000)
+ *   -d seconds     stop after this long instead of after -n requests
+ *   -w n           warm-up requests sent before measuring (default 0)
+ *   -k             keep connections open: HTTP/1.1 requests, each
+ *                  client reusing its connection while the server does
+ *
+ * Prints one JSON object with the request rate, the hit ratio and the
+ * latency percentiles. The hit ratio is derived from the requests that
+ * reached the built-in origin, so it is null with -O. In open loop the
+ * latency is measured from the scheduled arrival time, so a backlog of
+ * late requests shows up as latency instead of as a lower rate.
+ */
+#define _GNU_SOURCE  /* strcasestr */
+#include <math.h>
+#include "csapp.h"
+#include "metrics.h"
+
+#define DEF_CLIENTS   8
+#define DEF_REQUESTS  1000
+#define DEF_OBJECTS   100
+#define DEF_ZIPF      1.0
+#define DEF_MINSIZE   1024
+#define DEF_MAXSIZE   204800
+#define MAXPATHS      4096
+#define IO_TIMEOUT_S  10
+
+typedef struct {
+    long long *lat;     /* latencies of this client (us) */
+    int nlat, cap;
+    long long errors;
+    long long bytes;
+    unsigned short rand[3];
+    int fd;             /* kept-alive connection with -k, -1 if none */
+    rio_t rio;
+} client_t;
+
+/* Configuration */
+static char *proxy_arg, *origin_arg, *paths_file;
+static int  origin_port, nclients = DEF_CLIENTS, nobjects = DEF_OBJECTS;
+static double zipf_s = DEF_ZIPF, rate;
+static int  minsize = DEF_MINSIZE, maxsize = DEF_MAXSIZE;
+static long long nrequests = DEF_REQUESTS, warmup;
+static double duration;
+static int  keepalive;
+
+/* Target */
+static struct sockaddr_storage target;   /* proxy, or origin if no proxy */
+static socklen_t targetlen;
+static char url_prefix[MAXLINE];         /* "http://origin" via a proxy */
+static char origin_host[MAXLINE];
+static char *paths[MAXPATHS];
+static int  npaths;
+static double *cdf;                      /* Zipf popularity of paths */
+
+/* Run state */
+static long long start_us, end_us;       /* measurement window */
+static long long issued;                 /* requests handed out */
+static long long origin_requests;        /* served by the built-in origin */
+static char *origin_body;
+
+static void usage(char *prog) {
+    fprintf(stderr, "usage: %s [-p proxy_host:port] [-o origin_port | "
+            "-O host:port [-U paths]]\n"
+            "       [-u objects] [-s zipf] [-z size|min:max] [-c clients] "
+            "[-r rate]\n       [-n requests | -d seconds] [-w warmup] [-k]\n",
+            prog);
+    exit(1);
+}
+
+/* Split "host:port" and resolve it into addr */
+static void resolve(char *arg, char *host, struct sockaddr_storage *addr,
+                    socklen_t *len) {
+    struct addrinfo hints, *res;
+    char *colon = strrchr(arg, ':');
+
+    if(!colon)
+        app_error("address must be host:port");
+    snprintf(host, MAXLINE, "%.*s", (int)(colon - arg), arg);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(host, colon + 1, &hints, &res) != 0)
+        app_error("cannot resolve address");
+    memcpy(addr, res->ai_addr, res->ai_addrlen);
+    *len = res->ai_addrlen;
+    freeaddrinfo(res);
+}
+
+/*
+ * Built-in origin
+ */
+
+/* Size of object id: fixed, or log-uniform in [minsize, maxsize] */
+static int object_size(int id) {
+    unsigned h = (unsigned)id * 2654435761u;
+
+    if(minsize >= maxsize)
+        return minsize;
+    return (int)(minsize * pow((double)maxsize / minsize,
+                               (h >> 8) / (double)(1 << 24)));
+}
+
+static void *origin_conn(void *vargp) {
+    int fd = (int)(long)vargp, id, size;
+    char buf[MAXLINE], hdr[MAXLINE];
+    rio_t rio;
+    rio_batch_t out;
+
+    Pthread_detach(pthread_self());
+    rio_readinitb(&rio, fd);
+    if(rio_readlineb(&rio, buf, MAXLINE) <= 0) {
+        rio_freeb(&rio);
+        close(fd);
+        return NULL;
+    }
+    __sync_fetch_and_add(&origin_requests, 1);
+    if(sscanf(buf, "GET /obj/%d", &id) != 1)
+        id = -1;
+    while(rio_readlineb(&rio, hdr, MAXLINE) > 0 && strcmp(hdr, "\r\n"))
+        ;
+    if(id < 0) {
+        sprintf(hdr, "HTTP/1.0 404 Not Found\r\nContent-length: 0\r\n\r\n");
+        rio_writen(fd, hdr, strlen(hdr));
+    }
+    else {
+        size = object_size(id);
+        sprintf(hdr, "HTTP/1.0 200 OK\r\nContent-type: application/octet-stream"
+                "\r\nContent-length: %d\r\n\r\n", size);
+        /* Header and body in one writev */
+        rio_batchinit(&out);
+        rio_batchadd(&out, hdr, strlen(hdr));
+        rio_batchadd(&out, origin_body, size);
+        rio_batchflush(fd, &out);
+    }
+    rio_freeb(&rio);
+    close(fd);
+    return NULL;
+}
+
+static void *origin(void *vargp) {
+    int listenfd = (int)(long)vargp, fd;
+    pthread_t tid;
+
+    while(1) {
+        if((fd = accept(listenfd, NULL, NULL)) < 0)
+            continue;
+        Pthread_create(&tid, NULL, origin_conn, (void *)(long)fd);
+    }
+    return NULL;
+}
+
+/* Start the built-in origin and name its objects /obj/<id> */
+static void start_origin(void) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    pthread_t tid;
+    int listenfd, i;
+
+    listenfd = Open_listenfd(origin_port);
+    getsockname(listenfd, (SA *)&addr, &len);
+    origin_port = ntohs(addr.sin_port);
+    origin_body = Malloc(maxsize > minsize ? maxsize : minsize);
+    memset(origin_body, 'x', maxsize > minsize ? maxsize : minsize);
+    for(i = 0; i < nobjects && i < MAXPATHS; i++) {
+        paths[i] = Malloc(32);
+        sprintf(paths[i], "/obj/%d", i);
+    }
+    npaths = i;
+    sprintf(origin_host, "localhost:%d", origin_port);
+    Pthread_create(&tid, NULL, origin, (void *)(long)listenfd);
+}
+
+static void read_paths(void) {
+    char line[MAXLINE];
+    FILE *fp;
+
+    if(!paths_file) {
+        paths[npaths++] = "/home.html";
+        return;
+    }
+    if(!(fp = fopen(paths_file, "r")))
+        unix_error(paths_file);
+    while(npaths < MAXPATHS && fgets(line, MAXLINE, fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if(line[0])
+            paths[npaths++] = strdup(line);
+    }
+    fclose(fp);
+    if(npaths == 0)
+        app_error("no paths");
+}
+
+/*
+ * Clients
+ */
+
+/* Cumulative Zipf distribution over the npaths paths */
+static void zipf_init(void) {
+    double sum = 0;
+    int i;
+
+    cdf = Malloc(npaths * sizeof(double));
+    for(i = 0; i < npaths; i++)
+        cdf[i] = (sum += 1.0 / pow(i + 1, zipf_s));
+    for(i = 0; i < npaths; i++)
+        cdf[i] /= sum;
+}
+
+static char *pick_path(client_t *c) {
+    double u = erand48(c->rand);
+    int lo = 0, hi = npaths - 1, mid;
+
+    while(lo < hi) {
+        mid = (lo + hi) / 2;
+        if(cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return paths[lo];
+}
+
+/* Fetch path and read the response to EOF. Return 0 if it was a 2xx */
+static int fetch(client_t *c, char *path) {
+    char buf[MAXBUF];
+    struct timeval tv = { IO_TIMEOUT_S, 0 };
+    int  fd, n, len, first = 1, ok = 0;
+
+    if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if(connect(fd, (SA *)&target, targetlen) < 0) {
+        close(fd);
+        return -1;
+    }
+    len = snprintf(buf, MAXBUF, "GET %s%s HTTP/1.0\r\nHost: %s\r\n\r\n",
+                   url_prefix, path, origin_host);
+    if(rio_writen(fd, buf, len) != len) {
+        close(fd);
+        return -1;
+    }
+    while((n = read(fd, buf, MAXBUF)) > 0) {
+        if(first && n > 9)
+            ok = (buf[9] == '2');
+        first = 0;
+        c->bytes += n;
+    }
+    close(fd);
+    return (ok && n == 0) ? 0 : -1;
+}
+
+/* Fetch path over c's kept-alive connection, opening one if needed, and */
+/* read the response by its Content-length. Return 0 if it was a 2xx.    */
+static int fetch_keepalive(client_t *c, char *path) {
+    char buf[MAXBUF];
+    struct timeval tv = { IO_TIMEOUT_S, 0 };
+    int  n, len, ok, reused, left = -1, close_after;
+
+    if((reused = (c->fd >= 0)) == 0) {
+        if((c->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+            return -1;
+        setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if(connect(c->fd, (SA *)&target, targetlen) < 0)
+            goto fail;
+        if(c->rio.rio_buf)
+            rio_resetb(&c->rio, c->fd);
+        else
+            rio_readinitb(&c->rio, c->fd);
+    }
+    len = snprintf(buf, MAXBUF, "GET %s%s HTTP/1.1\r\nHost: %s\r\n\r\n",
+                   url_prefix, path, origin_host);
+    if(rio_writen(c->fd, buf, len) != len)
+        goto retry;
+    if((n = rio_readlineb(&c->rio, buf, MAXBUF)) <= 0)
+        goto retry;
+    c->bytes += n;
+    ok = (n > 9 && buf[9] == '2');
+    close_after = !strncmp(buf, "HTTP/1.0", 8);
+    while((n = rio_readlineb(&c->rio, buf, MAXBUF)) > 2) {
+        c->bytes += n;
+        if(!strncasecmp(buf, "Content-length:", 15))
+            left = atoi(buf + 15);
+        else if(!strncasecmp(buf, "Connection:", 11))
+            close_after = !strcasestr(buf, "keep-alive");
+    }
+    if(n <= 0)
+        goto fail;
+    c->bytes += n;
+    if(left < 0)
+        close_after = 1;  /* the body ends with the connection */
+    while(left != 0 && (n = rio_readnb(&c->rio, buf,
+                                       (left < 0 || left > MAXBUF) ? MAXBUF : left)) > 0) {
+        c->bytes += n;
+        if(left > 0)
+            left -= n;
+    }
+    if(left > 0)
+        goto fail;
+    if(close_after) {
+        close(c->fd);
+        c->fd = -1;
+    }
+    return ok ? 0 : -1;
+
+ retry:
+    /* The server may have closed a connection it kept idle too long */
+    close(c->fd);
+    c->fd = -1;
+    return reused ? fetch_keepalive(c, path) : -1;
+ fail:
+    close(c->fd);
+    c->fd = -1;
+    return -1;
+}
+
+static void record(client_t *c, long long us) {
+    if(c->nlat == c->cap) {
+        c->cap = c->cap ? 2 * c->cap : 1024;
+        c->lat = Realloc(c->lat, c->cap * sizeof(long long));
+    }
+    c->lat[c->nlat++] = us;
+}
+
+/* Claim the next request. In open loop *due is its arrival time */
+static int next_request(long long *due) {
+    long long i = __sync_fetch_and_add(&issued, 1);
+
+    if(rate > 0) {
+        *due = start_us + (long long)(i * 1e6 / rate);
+        if(duration > 0)
+            return *due < end_us;
+    }
+    else {
+        *due = 0;
+        if(duration > 0)
+            return now_us() < end_us;
+    }
+    return i < nrequests;
+}
+
+static void *client(void *vargp) {
+    client_t *c = vargp;
+    long long due, begin, wait;
+
+    while(next_request(&due)) {
+        if(due) {
+            wait = due - now_us();
+            if(wait > 0)
+                usleep(wait);
+            begin = due;
+        }
+        else {
+            begin = now_us();
+        }
+        if((keepalive ? fetch_keepalive(c, pick_path(c))
+                      : fetch(c, pick_path(c))) < 0)
+            c->errors++;
+        else
+            record(c, now_us() - begin);
+    }
+    return NULL;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(long long *)a, y = *(long long *)b;
+    return (x > y) - (x < y);
+}
+
+static long long percentile(long long *v, long long n, double p) {
+    long long i = (long long)(p * n);
+
+    if(n == 0)
+        return 0;
+    return v[(i < n) ? i : n - 1];
+}
+
+int main(int argc, char **argv) {
+    client_t *clients, warm;
+    pthread_t *tids;
+    long long *all, n = 0, errors = 0, bytes = 0, sum = 0, origin_base, i;
+    double secs;
+    char proxy_host[MAXLINE], hit_ratio[32];
+    int  c, k;
+
+    while((c = getopt(argc, argv, "p:o:O:U:u:s:z:c:r:n:d:w:k")) != -1) {
+        switch(c) {
+        case 'p': proxy_arg = optarg; break;
+        case 'o': origin_port = atoi(optarg); break;
+        case 'O': origin_arg = optarg; break;
+        case 'U': paths_file = optarg; break;
+        case 'u': nobjects = atoi(optarg); break;
+        case 's': zipf_s = atof(optarg); break;
+        case 'z':
+            if(sscanf(optarg, "%d:%d", &minsize, &maxsize) != 2)
+                maxsize = minsize = atoi(optarg);
+            break;
+        case 'c': nclients = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'n': nrequests = atoll(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'w': warmup = atoll(optarg); break;
+        case 'k': keepalive = 1; break;
+        default:  usage(argv[0]);
+        }
+    }
+    if(optind != argc || nclients < 1 || nobjects < 1 || minsize < 0)
+        usage(argv[0]);
+    Signal(SIGPIPE, SIG_IGN);
+
+    if(origin_arg) {
+        resolve(origin_arg, origin_host, &target, &targetlen);
+        snprintf(origin_host, MAXLINE, "%s", origin_arg);
+        read_paths();
+    }
+    else {
+        start_origin();
+        resolve(origin_host, proxy_host, &target, &targetlen);
+    }
+    if(proxy_arg) {
+        resolve(proxy_arg, proxy_host, &target, &targetlen);
+        snprintf(url_prefix, MAXLINE, "http://%.*s", MAXLINE - 8, origin_host);
+    }
+    zipf_init();
+
+    /* Warm-up requests are neither timed nor counted */
+    memset(&warm, 0, sizeof(warm));
+    warm.fd = -1;
+    for(i = 0; i < warmup; i++)
+        keepalive ? fetch_keepalive(&warm, pick_path(&warm))
+                  : fetch(&warm, pick_path(&warm));
+    if(warm.fd >= 0)
+        close(warm.fd);
+    rio_freeb(&warm.rio);
+
+    clients = Calloc(nclients, sizeof(client_t));
+    tids = Malloc(nclients * sizeof(pthread_t));
+    origin_base = origin_requests;
+    start_us = now_us();
+    end_us = start_us + (long long)(duration * 1e6);
+    for(k = 0; k < nclients; k++) {
+        clients[k].rand[0] = k + 1;
+        clients[k].rand[1] = k * 7 + 3;
+        clients[k].rand[2] = 0x330e;
+        clients[k].fd = -1;
+        Pthread_create(&tids[k], NULL, client, &clients[k]);
+    }
+    for(k = 0; k < nclients; k++)
+        Pthread_join(tids[k], NULL);
+    secs = (now_us() - start_us) / 1e6;
+
+    for(k = 0; k < nclients; k++)
+        n += clients[k].nlat;
+    all = Malloc((n ? n : 1) * sizeof(long long));
+    for(n = 0, k = 0; k < nclients; k++) {
+        memcpy(all + n, clients[k].lat, clients[k].nlat * sizeof(long long));
+        n += clients[k].nlat;
+        errors += clients[k].errors;
+        bytes += clients[k].bytes;
+    }
+    qsort(all, n, sizeof(long long), cmp_ll);
+    for(i = 0; i < n; i++)
+        sum += all[i];
+
+    if(origin_arg || !proxy_arg || n + errors == 0)
+        sprintf(hit_ratio, "null");
+    else
+        sprintf(hit_ratio, "%.4f",
+                1.0 - (double)(origin_requests - origin_base) / (n + errors));
+
+    printf("{\"mode\":\"%s\",\"clients\":%d,\"rate\":%.0f,\"objects\":%d,"
+           "\"zipf\":%.2f,\"seconds\":%.3f,\"requests\":%lld,\"errors\":%lld,"
+           "\"bytes\":%lld,\"req_per_s\":%.1f,\"mbit_per_s\":%.1f,"
+           "\"hit_ratio\":%s,\"latency_us\":{\"mean\":%lld,\"p50\":%lld,"
+           "\"p90\":%lld,\"p99\":%lld,\"p999\":%lld,\"max\":%lld}}\n",
+           (rate > 0) ? "open" : "closed", nclients, rate, npaths, zipf_s,
+           secs, n, errors, bytes, n / secs, bytes * 8 / secs / 1e6, hit_ratio,
+           n ? sum / n : 0, percentile(all, n, 0.50), percentile(all, n, 0.90),
+           percentile(all, n, 0.99), percentile(all, n, 0.999),
+           n ? all[n - 1] : 0);
+    return 0;
+}
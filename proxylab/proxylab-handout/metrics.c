@@ -0,0 +1,128 @@
+#include <stdarg.h>
+#include "csapp.h"
+#include "metrics.h"
+
+#define HIST_SUB_BITS 2  /* log2(HIST_SUB) */
+
+/* Return the monotonic time in microseconds */
+long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Map a sample to its bucket: values below HIST_SUB get their own bucket, */
+/* larger ones land in one of HIST_SUB slices of their power of two.       */
+static int hist_index(long long us) {
+    int msb, idx;
+
+    if(us < HIST_SUB)
+        return (us < 0) ? 0 : (int)us;
+    msb = 63 - __builtin_clzll((unsigned long long)us);
+    idx = (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+          (int)((us >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    return (idx < HIST_BUCKETS) ? idx : HIST_BUCKETS - 1;
+}
+
+/* Largest value that falls into bucket idx */
+static long long hist_upper(int idx) {
+    int msb, sub;
+
+    if(idx < HIST_SUB)
+        return idx;
+    msb = idx / HIST_SUB + HIST_SUB_BITS - 1;
+    sub = idx % HIST_SUB;
+    return ((long long)(HIST_SUB + sub + 1) << (msb - HIST_SUB_BITS)) - 1;
+}
+
+void hist_init(hist_t *h) {
+    memset(h, 0, sizeof(hist_t));
+    Sem_init(&h->mutex, 0, 1);
+}
+
+void hist_add(hist_t *h, long long us) {
+    P(&h->mutex);
+    h->count++;
+    h->sum += us;
+    if(us > h->max)
+        h->max = us;
+    h->bucket[hist_index(us)]++;
+    V(&h->mutex);
+}
+
+/* Halve every bucket once the histogram holds limit samples, so that */
+/* its percentiles follow recent samples rather than all of them.     */
+void hist_decay(hist_t *h, long long limit) {
+    int i;
+
+    P(&h->mutex);
+    if(h->count >= limit) {
+        h->count = 0;
+        for(i = 0; i < HIST_BUCKETS; i++) {
+            h->bucket[i] /= 2;
+            h->count += h->bucket[i];
+        }
+        h->sum /= 2;
+    }
+    V(&h->mutex);
+}
+
+/* Return the p-th percentile (0 < p <= 1) as a bucket upper bound, */
+/* clamped to the largest sample seen. 0 if the histogram is empty. */
+long long hist_percentile(hist_t *h, double p) {
+    long long rank, seen = 0, rtn = 0;
+    int i;
+
+    P(&h->mutex);
+    if(h->count > 0) {
+        rank = (long long)(p * h->count + 0.5);
+        if(rank < 1)
+            rank = 1;
+        for(i = 0; i < HIST_BUCKETS; i++) {
+            seen += h->bucket[i];
+            if(seen >= rank)
+                break;
+        }
+        rtn = hist_upper(i);
+        if(rtn > h->max)
+            rtn = h->max;
+    }
+    V(&h->mutex);
+    return rtn;
+}
+
+long long hist_mean(hist_t *h) {
+    long long rtn;
+
+    P(&h->mutex);
+    rtn = h->count ? h->sum / h->count : 0;
+    V(&h->mutex);
+    return rtn;
+}
+
+/* Append "<name>.{count,mean,p50,p99,max}" lines to buf. */
+/* Return the number of bytes written.                   */
+int hist_format(hist_t *h, char *name, char *buf, int size) {
+    return stats_printf(buf, size,
+                        "%s.count %lld\n%s.mean_us %lld\n%s.p50_us %lld\n"
+                        "%s.p99_us %lld\n%s.max_us %lld\n",
+                        name, h->count, name, hist_mean(h),
+                        name, hist_percentile(h, 0.50),
+                        name, hist_percentile(h, 0.99), name, h->max);
+}
+
+/* snprintf that returns the number of bytes actually stored, so that */
+/* callers can keep appending "buf + len, size - len" without overrun */
+int stats_printf(char *buf, int size, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    if(size <= 0)
+        return 0;
+    va_start(ap, fmt);
+    n = vsnprintf(buf, size, fmt, ap);
+    va_end(ap);
+    if(n < 0)
+        return 0;
+    return (n < size) ? n : size - 1;
+}
@@ -0,0 +1,31 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include "csapp.h"
+
+/* Latency histogram in microseconds. Each power of two is split into */
+/* HIST_SUB linear sub-buckets, so percentiles are accurate to ~25%.   */
+#define HIST_SUB      4
+#define HIST_BUCKETS  (40 * HIST_SUB)
+
+typedef struct {
+    long long count;                /* number of samples */
+    long long sum;                  /* sum of all samples (us) */
+    long long max;                  /* largest sample (us) */
+    long long bucket[HIST_BUCKETS]; /* sample counts per bucket */
+    sem_t mutex;                    /* protects the fields above */
+} hist_t;
+
+/* Monotonic clock in microseconds */
+long long now_us(void);
+
+void hist_init(hist_t *h);
+void hist_add(hist_t *h, long long us);
+void hist_decay(hist_t *h, long long limit);
+long long hist_percentile(hist_t *h, double p);
+long long hist_mean(hist_t *h);
+int  hist_format(hist_t *h, char *name, char *buf, int size);
+int  stats_printf(char *buf, int size, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#endif /* __METRICS_H__ */
@@ -0,0 +1,310 @@
+#include <ctype.h>
+#include "csapp.h"
+#include "proxy.h"
+#include "upstream.h"
+#include "metrics.h"
+#include "prefetch.h"
+
+/*
+ * prefetch.c - warm the cache with the resources of cached HTML pages
+ *
+ * When an HTML page is stored in the cache, its same-origin <img>,
+ * <script>, ... src and <link> href targets are queued, at most budget
+ * per page. A few prefetch threads fetch them from the origin and store
+ * them in the cache, marked as prefetched, before the browser asks. The
+ * cache counts a prefetched object as a hit the first time it is served
+ * and as wasted if it is evicted without ever being served. The queue
+ * is bounded; links that do not fit are dropped rather than delaying
+ * the worker that stored the page.
+ */
+
+prefetch_conf_t prefetch_conf = { 0, PREFETCH_BUDGET };
+
+static struct {
+    char *uri[PREFETCH_QUEUE];
+    int front, count;
+    sem_t mutex;   /* protects the queue */
+    sem_t items;   /* counts queued links */
+} queue;
+
+static sem_t stat_mutex;   /* protects the counters below */
+static long long n_pages, n_queued, n_dropped, n_fetched, n_failed, n_skipped;
+
+static void *prefetcher(void *vargp);
+
+static void count(long long *counter) {
+    P(&stat_mutex);
+    (*counter)++;
+    V(&stat_mutex);
+}
+
+void prefetch_init(void) {
+    pthread_t tid;
+    int i;
+
+    Sem_init(&queue.mutex, 0, 1);
+    Sem_init(&queue.items, 0, 0);
+    Sem_init(&stat_mutex, 0, 1);
+    for(i = 0; i < prefetch_conf.nthreads; i++)
+        Pthread_create(&tid, NULL, prefetcher, NULL);
+}
+
+/* Queue uri unless the queue is full. Never blocks */
+static void enqueue(char *uri) {
+    int queued = 0;
+
+    P(&queue.mutex);
+    if(queue.count < PREFETCH_QUEUE) {
+        queue.uri[(queue.front + queue.count) % PREFETCH_QUEUE] = strdup(uri);
+        queue.count++;
+        queued = 1;
+    }
+    V(&queue.mutex);
+    if(queued) {
+        V(&queue.items);
+        count(&n_queued);
+    }
+    else {
+        count(&n_dropped);
+    }
+}
+
+static char *dequeue(void) {
+    char *uri;
+
+    P(&queue.items);
+    P(&queue.mutex);
+    uri = queue.uri[queue.front];
+    queue.front = (queue.front + 1) % PREFETCH_QUEUE;
+    queue.count--;
+    V(&queue.mutex);
+    return uri;
+}
+
+/* Case-insensitive search for the n bytes of s in [p, end) */
+static char *find_nocase(char *p, char *end, char *s, int n) {
+    for(; p + n <= end; p++) {
+        if(!strncasecmp(p, s, n))
+            return p;
+    }
+    return NULL;
+}
+
+/* Remove "." and ".." segments from the path of an absolute uri */
+static void normalize(char *uri) {
+    char *path = strchr(uri + 7, '/'), *seg = path, *next, *out = path;
+    int  dir = 0;
+
+    if(!path)
+        return;
+    while(*seg == '/') {
+        next = seg + 1 + strcspn(seg + 1, "/?");
+        dir = next - seg == 2 && seg[1] == '.';            /* "/."  */
+        if(next - seg == 3 && seg[1] == '.' && seg[2] == '.') {
+            while(out > path && *--out != '/')             /* "/.." */
+                ;
+            dir = 1;
+        }
+        else if(!dir) {
+            memmove(out, seg, next - seg);
+            out += next - seg;
+        }
+        seg = next;
+    }
+    if(dir)
+        *out++ = '/';                /* "/a/b/.." is "/a/" */
+    memmove(out, seg, strlen(seg) + 1);
+}
+
+/* Resolve link (len bytes) against page, an absolute http:// uri.     */
+/* Return 1 and the absolute uri in out if link is on the same origin. */
+static int resolve_link(char *page, char *link, int len, char *out) {
+    char *host = page + 7, *path = strchr(host, '/'), *p;
+    int  hostlen = path ? path - host : (int)strlen(host), n;
+
+    if((p = memchr(link, '#', len)) != NULL)
+        len = p - link;                     /* drop the fragment */
+    if(len == 0 || len >= MAXLINE / 2)
+        return 0;
+
+    if(len > 7 && !strncasecmp(link, "http://", 7)) {
+        link += 5;                          /* same as "//host/..." */
+        len -= 5;
+    }
+    if(len > 2 && !strncmp(link, "//", 2)) {
+        if(len - 2 < hostlen || strncasecmp(link + 2, host, hostlen) ||
+           (len - 2 > hostlen && link[2 + hostlen] != '/'))
+            return 0;                       /* another origin */
+        n = snprintf(out, MAXLINE, "http://%.*s", len - 2, link + 2);
+    }
+    else if(link[0] == '/') {
+        n = snprintf(out, MAXLINE, "http://%.*s%.*s", hostlen, host, len, link);
+    }
+    else {
+        /* A scheme (https:, data:, mailto:, ...) before any '/' */
+        for(p = link; p < link + len && *p != '/'; p++) {
+            if(*p == ':')
+                return 0;
+        }
+        /* Relative to the page's directory, ignoring its query */
+        n = path ? (int)strcspn(path, "?") : 0;
+        while(n > 0 && path[n - 1] != '/')
+            n--;
+        n = snprintf(out, MAXLINE, "http://%.*s%.*s%s%.*s", hostlen, host,
+                     n, path ? path : "", n ? "" : "/", len, link);
+    }
+    if(n >= MAXLINE)
+        return 0;
+    normalize(out);
+    return 1;
+}
+
+/* Queue the same-origin resources linked from an HTML page fetched */
+/* from uri. obj is the complete response from the origin           */
+static void prefetch_page(char *uri, char *obj, int size) {
+    char *end = obj + size, *body, *p, *tagend, *attr, *val;
+    char link[MAXLINE];
+    unsigned seen[PREFETCH_QUEUE], hash;  /* links queued from this page */
+    int  nattr, vlen, budget = prefetch_conf.budget, nseen = 0, i;
+
+    if(prefetch_conf.nthreads == 0 || strncasecmp(uri, "http://", 7))
+        return;
+    if(!(body = find_nocase(obj, end, "\r\n\r\n", 4)) ||
+       !find_nocase(obj, body, "\ncontent-type: text/html", 24))
+        return;
+    count(&n_pages);
+
+    for(p = body; budget > 0 && (p = memchr(p, '<', end - p)); p++) {
+        if(!(tagend = memchr(p, '>', end - p)))
+            break;
+        /* <link href=...>, any other tag: src=... */
+        if(tagend - p > 5 && !strncasecmp(p + 1, "link", 4) &&
+           isspace((unsigned char)p[5])) {
+            attr = "href=";
+            nattr = 5;
+        }
+        else {
+            attr = "src=";
+            nattr = 4;
+        }
+        val = find_nocase(p, tagend, attr, nattr);
+        if(!val || !isspace((unsigned char)val[-1]))
+            continue;
+        val += nattr;
+        if(*val == '"' || *val == '\'') {
+            char *close = memchr(val + 1, *val, tagend - val - 1);
+            if(!close)
+                continue;
+            vlen = close - val - 1;
+            val++;
+        }
+        else {
+            for(vlen = 0; val + vlen < tagend &&
+                !isspace((unsigned char)val[vlen]); vlen++)
+                ;
+        }
+        if(!resolve_link(uri, val, vlen, link))
+            continue;
+
+        /* Skip repeats within the page and what is cached already */
+        for(hash = 5381, i = 0; link[i]; i++)
+            hash = hash * 33 + (unsigned char)link[i];
+        for(i = 0; i < nseen && seen[i] != hash; i++)
+            ;
+        if(i < nseen || probe_cache(&cache, link))
+            continue;
+        if(nseen < PREFETCH_QUEUE)
+            seen[nseen++] = hash;
+        enqueue(link);
+        budget--;
+    }
+}
+
+/* Queue the links of a response about to be cached under uri, if it */
+/* is an HTML page small enough to scan.                             */
+void prefetch_fill(char *uri, cache_fill *f) {
+    char *obj;
+    int  size;
+
+    if(prefetch_conf.nthreads == 0 ||
+       !find_nocase(f->hdr, f->hdr + f->hdr_size, "\ncontent-type: text/html", 24))
+        return;
+    obj = Malloc(MAX_OBJECT_SIZE);
+    if((size = fill_copy(f, obj, MAX_OBJECT_SIZE)) > 0)
+        prefetch_page(uri, obj, size);
+    Free(obj);
+}
+
+/* Fetch uri from the origin and cache a complete 200 response */
+static void fetch(char *uri) {
+    char tag[MAXLINE], hostname[MAXLINE], path[MAXLINE];
+    char headers[NHEADERS][MAXLINE], req[MAXREQ], buf[MAXLINE];
+    cache_fill *fill;
+    int  port, len, n, fd, size = 0;
+
+    snprintf(tag, MAXLINE, "%s", uri);
+    if(parse_uri(tag, hostname, path, &port) < 0)
+        return;
+    if(probe_cache(&cache, tag)) {     /* a client fetched it meanwhile */
+        count(&n_skipped);
+        return;
+    }
+    sprintf(headers[0], "Host: %.*s:%d\r\n", MAXLINE / 2, hostname, port);
+    if((len = make_request(path, headers, 1, req)) < 0 ||
+       (fd = upstream_open(hostname, port, req, len, 1, NULL)) < 0) {
+        count(&n_failed);
+        return;
+    }
+
+    fill = Malloc(sizeof(cache_fill));
+    fill_init(fill);
+    while((n = read(fd, buf, MAXLINE)) > 0) {
+        fill_append(fill, buf, n);
+        if((size += n) > MAX_OBJECT_SIZE)
+            break;
+    }
+    close(fd);
+    if(n == 0 && fill->hdr_size > 12 && !strncmp(fill->hdr + 8, " 200", 4) &&
+       store_fill(&cache, tag, fill, 1, 1))
+        count(&n_fetched);
+    else
+        count(&n_failed);
+    fill_free(fill);
+    Free(fill);
+}
+
+static void *prefetcher(void *vargp) {
+    char *uri;
+
+    Pthread_detach(pthread_self());
+    while(1) {
+        uri = dequeue();
+        fetch(uri);
+        free(uri);
+    }
+    return NULL;
+}
+
+/* Append prefetch counters to buf. The hit and waste rates are per */
+/* 1000 prefetched objects.                                         */
+int prefetch_format(char *buf, int size) {
+    long long hits = cache.prefetch_hits, wasted = cache.prefetch_wasted;
+    int len;
+
+    if(prefetch_conf.nthreads == 0)
+        return 0;
+    P(&stat_mutex);
+    len = stats_printf(buf, size,
+                       "prefetch.pages %lld\nprefetch.queued %lld\n"
+                       "prefetch.dropped %lld\nprefetch.skipped %lld\n"
+                       "prefetch.failed %lld\nprefetch.fetched %lld\n"
+                       "prefetch.hits %lld\nprefetch.wasted %lld\n"
+                       "prefetch.hit_permille %lld\n"
+                       "prefetch.waste_permille %lld\n",
+                       n_pages, n_queued, n_dropped, n_skipped, n_failed,
+                       n_fetched, hits, wasted,
+                       n_fetched ? hits * 1000 / n_fetched : 0,
+                       n_fetched ? wasted * 1000 / n_fetched : 0);
+    V(&stat_mutex);
+    return len;
+}
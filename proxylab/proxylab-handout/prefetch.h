@@ -0,0 +1,23 @@
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+#define PREFETCH_THREADS  2    /* concurrent prefetches with -P */
+#define PREFETCH_BUDGET   8    /* links prefetched per page */
+#define PREFETCH_QUEUE    64   /* links waiting for a prefetch thread */
+
+/* Prefetching is off unless -P sets nthreads */
+typedef struct {
+    int nthreads;  /* prefetch threads, i.e. concurrent fetches */
+    int budget;    /* links queued per HTML page */
+} prefetch_conf_t;
+
+extern prefetch_conf_t prefetch_conf;
+
+void prefetch_init(void);
+void prefetch_fill(char *uri, cache_fill *f);
+int  prefetch_format(char *buf, int size);
+
+#endif /* __PREFETCH_H__ */
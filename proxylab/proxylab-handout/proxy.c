@@ -1,15 +1,35 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <netinet/tcp.h>
 #include "csapp.h"
-#include "sbuf.h"
+#include "fairq.h"
 #include "cache.h"
-
-#define NTHREADS 4
-#define SBUFSIZE 100
-#define NHEADERS 40
-
-sbuf_t sbuf; /* Shared buffer for connected descriptors */
+#include "metrics.h"
+#include "upstream.h"
+#include "engine.h"
+#include "trace.h"
+#include "prefetch.h"
+#include "proxy.h"
+
+#define NMISS_THREADS 4  /* workers that may block on origin servers */
+#define NHIT_THREADS  2  /* workers that only serve cache hits */
+#define NTHREADS (NMISS_THREADS + NHIT_THREADS)
+#define DEFER_ACCEPT_SECS 1
+
+/* Requests are scheduled on two lanes. The acceptor peeks at each request */
+/* line and sends the ones it can answer from the cache to the hit lane,   */
+/* so they never queue behind slow origin fetches on the miss lane. Within */
+/* a lane, clients take turns (see fairq.c), so one cannot starve others.  */
+typedef struct {
+	char *name;
+	fairq_t q;     /* Connected descriptors queued per client */
+	hist_t wait;   /* Time each descriptor spent queued (us) */
+	long long routed; /* Descriptors the acceptor put on this lane */
+} lane_t;
+
+lane_t hit_lane;  /* Cache hits and local requests */
+lane_t miss_lane; /* Everything that may need the origin server */
 cache_head cache; /* Shared cache for all worker threads */
 
 /* Because the proxy may encounter errors at any time when there's a broken  */
@@ -20,6 +40,8 @@ typedef struct {
 	jmp_buf read_env;   /* ECONNRESET */
 	jmp_buf write_env;  /* EPIPE */
 	jmp_buf pipe_env;   /* SIGPIPE */
+	int client;         /* fairq client of the connection being served */
+	long long sent;     /* bytes sent to it so far */
 } t_context;
 
 /* Array to keep track of each thread's context */
@@ -34,19 +56,25 @@ static const char *connection_hdr = "Connection: close\r\n";
 static const char *proxy_connection_hdr = "Proxy-Connection: close\r\n";
 
 void *thread(void *vargp);
-void serve_client(int connfd);
+void lane_init(lane_t *lane, char *name);
+lane_t *classify(int connfd);
+void serve_client(int connfd, trace_t *trace, rio_t *rio_c, rio_t *rio_s);
+void serve_cleanup(int hit, cache_ref *ref, cache_fill *fill, int clientfd);
+int  resume_response(rio_t *rio, int skip);
+void serve_local(int connfd, char *uri);
+int  format_stats(char *buf, int size);
 void sigpipe_handler(int sig);
 int  get_thread_index(pthread_t tid);
 int  parse_request(rio_t *rio, int fd, char *method, char *uri, char *version);
-int  parse_uri(char *uri, char *hostname, char *pathname, int *port);
 int  parse_headers(rio_t *rio, char headers[NHEADERS][MAXLINE], int *n);
-void make_request(char *path, char headers[NHEADERS][MAXLINE], 
-				  int n_header, int connfd, int clientfd);
 void rio_writen_s(int fd, void *usrbuf, size_t n);
+void rio_batchflush_s(int fd, rio_batch_t *bp);
 ssize_t rio_readlineb_s(rio_t *rio, void *usrbuf, size_t maxlen);
 ssize_t rio_readnb_s(rio_t *rio, void *usrbuf, size_t n);
 void client_error(int fd, char *cause, char *errnum, 
 		 char *shortmsg, char *longmsg);
+void reject(int fd);
+void usage(char *prog);
 
 int main(int argc, char **argv)
 {
@@ -55,26 +83,70 @@ int main(int argc, char **argv)
     struct sockaddr_in clientaddr;
     socklen_t clientlen = sizeof(struct sockaddr_in);
     pthread_t tid;
+    int defer = DEFER_ACCEPT_SECS;
+    int c, mode = ENGINE_THREADS, client;
+    lane_t *lane;
 
     /* Check command line args */
-    if (argc != 2) {
-    	fprintf(stderr, "usage: %s <port>\n", argv[0]);
-    	exit(1);
+    while ((c = getopt(argc, argv, "c:f:i:r:Hd:a:e:t:P:B:b:")) != -1) {
+        switch (c) {
+        case 'c': upstream_conf.connect_ms = atoi(optarg); break;
+        case 'f': upstream_conf.first_byte_ms = atoi(optarg); break;
+        case 'i': upstream_conf.idle_ms = atoi(optarg); break;
+        case 'r': upstream_conf.retries = atoi(optarg); break;
+        case 'H': upstream_conf.hedge = 1; break;
+        case 'd': upstream_conf.hedge_min_ms = atoi(optarg); break;
+        case 'a': upstream_conf.attempt_delay_ms = atoi(optarg); break;
+        case 'e':
+            if ((mode = engine_parse(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 't': trace_sample = atoi(optarg); break;
+        case 'P': prefetch_conf.nthreads = atoi(optarg); break;
+        case 'B': prefetch_conf.budget = atoi(optarg); break;
+        case 'b':
+            if (sscanf(optarg, "%lld:%lld", &fairq_conf.rate,
+                       &fairq_conf.burst) < 1)
+                usage(argv[0]);
+            break;
+        default:  usage(argv[0]);
+        }
     }
-    port = atoi(argv[1]);
+    if (optind != argc - 1)
+        usage(argv[0]);
+    port = atoi(argv[optind]);
 
-    /* initialize shared buffer for connected descriptor */
-    sbuf_init(&sbuf, SBUFSIZE);
+    /* initialize the shared buffers for connected descriptors */
+    lane_init(&hit_lane, "hit");
+    lane_init(&miss_lane, "miss");
 
     /* initialize shared cache for all worker threads */
     cache_init(&cache);
+    upstream_init();
+    trace_init();
+    prefetch_init();
 
     /* Install the handler for SIGPIPE */
     Signal(SIGPIPE, sigpipe_handler);
 
     listenfd = Open_listenfd(port);
+    /* Only wake up accept() once the request bytes have arrived, so the */
+    /* acceptor can peek at the request line without waiting for it.     */
+    setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer));
     printf("Proxy starts running on port %d\n", port);
 
+    /* The event engines serve everything from this thread */
+    if (mode == ENGINE_URING) {
+        engine_uring_run(listenfd);
+        printf("io_uring is not available, falling back to epoll\n");
+        mode = ENGINE_EPOLL;
+    }
+    if (mode == ENGINE_EPOLL) {
+        engine_epoll_run(listenfd);
+        printf("epoll is not available, falling back to threads\n");
+        mode = ENGINE_THREADS;
+    }
+
    	/* Create worker threads */
    	printf("create worker threads...\n");
 	for(i=0; i<NTHREADS; i++) {
@@ -83,7 +155,14 @@ int main(int argc, char **argv)
 
 	while(1) {
 		connfd = Accept(listenfd, (SA *) &clientaddr, ((socklen_t *) &clientlen));
-		sbuf_insert(&sbuf, connfd);
+		client = fairq_client(&clientaddr);
+		lane = classify(connfd);
+		if(fairq_insert(&lane->q, client, connfd) < 0) {
+			reject(connfd);
+			fairq_release(client);
+			continue;
+		}
+		lane->routed++;
 	}
 
 	/* never should be here */
@@ -97,12 +176,29 @@ int main(int argc, char **argv)
 void *thread(void *vargp) {
 	Pthread_detach(pthread_self());
 	long i = (long)vargp; /* vargp is 8 bytes long */
+	long long waited, now;
+	int client;
+	trace_t trace;
+	rio_t rio_c, rio_s; /* read buffers reused for every connection */
+	lane_t *lane = (i < NMISS_THREADS) ? &miss_lane : &hit_lane;
 	thread_context[i].tid = pthread_self();
-	printf("Worker thread [%ld] is running\n\n", i);
+	thread_context[i].client = -1;
+	rio_readinitb(&rio_c, -1);
+	rio_readinitb(&rio_s, -1);
+	printf("Worker thread [%ld] is running on the %s lane\n\n", i, lane->name);
 	while(1) {
-		int connfd = sbuf_remove(&sbuf);
+		int connfd = fairq_remove(&lane->q, &client, &waited);
+		hist_add(&lane->wait, waited);
+		now = now_us();
+		trace_begin(&trace, i, now - waited);
+		trace_span(&trace, PH_QUEUE, now - waited);
 		printf("Worker thread [%ld] serves connfd[%d]\n", i, connfd);
-        serve_client(connfd);
+        thread_context[i].client = client;
+        thread_context[i].sent = 0;
+        serve_client(connfd, &trace, &rio_c, &rio_s);
+        trace_end(&trace);
+        fairq_done(&lane->q, client, thread_context[i].sent);
+        thread_context[i].client = -1;
         printf("Worker thread [%ld] closes connfd[%d]\n\n", i, connfd);
 		Close(connfd);
 	}
@@ -111,22 +207,57 @@ void *thread(void *vargp) {
 	return NULL;
 }
 
+void lane_init(lane_t *lane, char *name) {
+	lane->name = name;
+	lane->routed = 0;
+	fairq_init(&lane->q);
+	hist_init(&lane->wait);
+}
+
+/* Pick the lane for a freshly accepted connection by peeking at its     */
+/* request line. Only a complete GET line whose URI is already cached    */
+/* (or a local request such as /stats) goes to the hit lane; anything we */
+/* cannot judge without blocking is treated as a miss. A hit may still   */
+/* be evicted before a worker gets to it, in which case the hit worker   */
+/* simply fetches it from the origin like a miss worker would.           */
+lane_t *classify(int connfd) {
+	char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+	char hostname[MAXLINE], path[MAXLINE];
+	int  n, port;
+
+	n = recv(connfd, buf, MAXLINE - 1, MSG_PEEK | MSG_DONTWAIT);
+	if(n <= 0)
+		return &miss_lane;
+	buf[n] = '\0';
+	if(!strchr(buf, '\n'))
+		return &miss_lane;
+	if(sscanf(buf, "%s %s %s", method, uri, version) != 3 ||
+	   strcasecmp(method, "GET"))
+		return &miss_lane;
+	if(uri[0] == '/')
+		return &hit_lane;
+	/* parse_uri normalizes uri in place, exactly as serve_client will */
+	if(parse_uri(uri, hostname, path, &port) < 0)
+		return &miss_lane;
+	return probe_cache(&cache, uri) ? &hit_lane : &miss_lane;
+}
+
 /* Serve the connected client fd with following steps:                        */
 /* 1. Parse the request(method, url, HTTP version, HEADERs)                   */
 /* 2. If the web object has been cached by URL, return it directly.           */
 /* 3. Otherwise, Forward request to the remote server on behalf of the client */
 /* 4. Pass the received response from the remote server to the client         */
 /* 5. and store the reponse in cache with Tag(uri)                            */
-void serve_client(int connfd) {
+void serve_client(int connfd, trace_t *trace, rio_t *rio_c, rio_t *rio_s) {
 	char method[MAXLINE], uri[MAXLINE], version[MAXLINE], buf[MAXLINE];
 	char hostname[MAXLINE], path[MAXLINE];
 	char headers[NHEADERS][MAXLINE];
 	int  n_header, port = 80;
+	char req[MAXREQ];
+	int  reqlen;
+	long long mark = trace_mark(trace); /* start of the current phase */
 
-	rio_t rio_c; /* rio_client */ 
-	rio_t rio_s; /* rio_remote_server */
-
-	rio_readinitb(&rio_c, connfd);
+	rio_resetb(rio_c, connfd);
 
 	/* for read/write function before clientfd is created. */
 	int t_index = get_thread_index(pthread_self());
@@ -149,90 +280,240 @@ void serve_client(int connfd) {
     }
 
     /* Parse incoming requests and headers. Extract method, uri, version */
-	if(parse_request(&rio_c, connfd, method, uri, version) < 0) {
+	if(parse_request(rio_c, connfd, method, uri, version) < 0) {
 		printf("Error in parse_request()\n");
 		return;
 	}
+	trace_uri(trace, uri);
+
+    /* Requests addressed to the proxy itself rather than an origin */
+    if(uri[0] == '/') {
+        if(parse_headers(rio_c, headers, &n_header) < 0) {
+            client_error(connfd, uri, "400", "Bad Request", "Bad header");
+            return;
+        }
+        mark = trace_span(trace, PH_PARSE, mark);
+        serve_local(connfd, uri);
+        trace_span(trace, PH_REPLY, mark);
+        return;
+    }
 
     if(parse_uri(uri, hostname, path, &port) < 0) {
     	client_error(connfd, uri, "400", "Bad Request", "Bad URL");
     	return;
     }
 
-    if(parse_headers(&rio_c, headers, &n_header) < 0) {
+    if(parse_headers(rio_c, headers, &n_header) < 0) {
     	client_error(connfd, uri, "400", "Bad Request", "Bad header");
     	return ;
     }
+    mark = trace_span(trace, PH_PARSE, mark);
+
+    /* volatile: the handlers below read them after a longjmp */
+    volatile int hit, clientfd = -1;
+    int  byteread = 0, skip = 0, n;
+    cache_ref ref;
+    cache_fill fill;
+    cache_seg *seg;
+    rio_batch_t out;
+
+    fill_init(&fill);
+    if(!cacheable_request(headers, n_header))
+        fill.ok = 0; /* the answer may be a 206 or 304, not the object */
+
+    /* Find the object in cache. Its body stays valid until released. */
+    /* A whole object answers any request; a partial one is completed */
+    /* only for a request whose answer can be cached and that has room */
+    /* for the Range header that fetches the rest.                     */
+    hit = lookup_cache(&cache, uri, &ref);
+    if(hit == 1 && !ref.complete && (!fill.ok || n_header == NHEADERS)) {
+        release_cache(&ref);
+        hit = 0;
+    }
+    mark = trace_span(trace, PH_CACHE, mark);
 
-    int  byteread = 0;
-   	char cache_buf[MAX_OBJECT_SIZE];
-
-    /* Find the object in cache. Return the object directly */
-    if(find_cache(&cache, uri, cache_buf, &byteread) == 1) {
-
-    	rio_writen_s(connfd, cache_buf, byteread);
-
+    /* From here on a broken socket jumps back here to release the cached */
+    /* object, the response being cached and the origin connection.       */
+    if (setjmp(thread_context[t_index].read_env) != 0) {
+        serve_cleanup(hit, &ref, &fill, clientfd);
+        return;
+    }
+    if (setjmp(thread_context[t_index].write_env) != 0) {
+        serve_cleanup(hit, &ref, &fill, clientfd);
+        return;
+    }
+    if (sigsetjmp(thread_context[t_index].pipe_env, 1) != 0) {
+        serve_cleanup(hit, &ref, &fill, clientfd);
+        return;
     }
-    /* Object not found. Make requests to remote server and cache the response */
-    else {
 
-    	char *c_buf = cache_buf;
-    	int  object_size = 0;
+    if(hit == 1) {
+
+    	/* Header and body segments go out in as few writev calls as fit */
+    	rio_batchinit(&out);
+    	rio_batchadd(&out, ref.hdr, ref.hdr_size);
+    	for(seg = ref.body ? ref.body->segs : NULL; seg; seg = seg->next)
+    		if(rio_batchadd(&out, seg->data, seg->len) < 0) {
+    			rio_batchflush_s(connfd, &out);
+    			rio_batchadd(&out, seg->data, seg->len);
+    		}
+    	rio_batchflush_s(connfd, &out);
+    	trace_span(trace, PH_REPLY, mark);
+    	if(ref.complete) {
+    		serve_cleanup(hit, &ref, &fill, clientfd);
+    		return;
+    	}
 
-        int clientfd = open_clientfd_r(hostname, port);
-        if (clientfd < 0) {
+    	/* Eviction dropped the tail of the body: the client has skip bytes */
+    	/* of it, fetch the rest and cache the whole object again.          */
+    	skip = ref.size;
+    	fill_append(&fill, ref.hdr, ref.hdr_size);
+    	for(seg = ref.body->segs; seg; seg = seg->next)
+    		fill_append(&fill, seg->data, seg->len);
+    	sprintf(headers[n_header++], "Range: bytes=%d-\r\n", skip);
+    }
+    /* Send request to the remote server on behalf of the client. Once */
+    /* part of a cached object went out, errors just end the reply.    */
+    if ((reqlen = make_request(path, headers, n_header, req)) < 0) {
+        if(hit != 1)
+            client_error(connfd, uri, "400", "Bad Request",
+                         "Request headers too large");
+        serve_cleanup(hit, &ref, &fill, clientfd);
+        return;
+    }
+    clientfd = upstream_open(hostname, port, req, reqlen,
+                             !strcasecmp(method, "GET"), trace);
+    if (clientfd < 0 && hit != 1) {
+        if (clientfd == UPSTREAM_EDNS)
             client_error(connfd, "", "1000", "DNS failed", "DNS failed");
+        else
+            client_error(connfd, hostname, "504", "Gateway Timeout",
+                         "Origin server did not respond");
+    }
+    if (clientfd < 0) {
+        serve_cleanup(hit, &ref, &fill, -1);
+        return;
+    }
+
+    rio_resetb(rio_s, clientfd);
+    mark = trace_mark(trace);
+    if(hit == 1) {
+        if((skip = resume_response(rio_s, skip)) < 0) {
+            serve_cleanup(hit, &ref, &fill, clientfd);
             return;
         }
+        __sync_fetch_and_add(&cache.resumes, 1);
+    }
 
-        /* After clientfd is created, we should close it to prevent from   */
-        /* memory leak when the socket is broken and causes read()/write() */
-        /* fail. Therefore, we set jump point here to close fd to deal with*/
-        /* any future ERROR */
-
-	    /* Store the current context for ECONNRESET */
-        if (setjmp(thread_context[t_index].read_env) != 0) {
-        	if(clientfd > 0)
-        		Close(clientfd);  
-            return; 
-        }
-        /* Store the current context for EPIPE */
-        if (setjmp(thread_context[t_index].write_env) != 0) {  
-        	if(clientfd > 0)
-        		Close(clientfd);
-            return; 
-        }
-        /* Store the current context for SIGPIPE */
-        if (sigsetjmp(thread_context[t_index].pipe_env, 1) != 0) { 
-        	if(clientfd > 0)
-        		Close(clientfd);
-            return; 
-        }
+    /* Pass the response from the remote server to the client, less the */
+    /* bytes it got from the cache. A read fails once the origin has    */
+    /* been idle for the idle timeout.                                  */
+    while ((byteread = rio_readnb_s(rio_s, buf, MAXLINE)) > 0) {
+        n = byteread < skip ? byteread : skip;
+        skip -= n;
+        fill_append(&fill, buf + n, byteread - n);
+        rio_writen_s(connfd, buf + n, byteread - n);
+    }
+    if (byteread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        upstream_idle_timeout();
+    trace_span(trace, PH_RELAY, mark);
+
+    /* Cache the complete response with URL as Tag for future requests */
+    if(byteread == 0)
+        prefetch_fill(uri, &fill);
+    store_fill(&cache, uri, &fill, byteread == 0, 0);
+    serve_cleanup(hit, &ref, &fill, clientfd);
+}
 
-	    rio_readinitb(&rio_s, clientfd);
+/* Release what serve_client holds for a request, however it ended */
+void serve_cleanup(int hit, cache_ref *ref, cache_fill *fill, int clientfd) {
+    fill_free(fill);
+    if(hit == 1)
+        release_cache(ref);
+    if(clientfd > 0)
+        Close(clientfd);
+}
 
-        /* Send request to the remote server on behalf of the client */
-	    make_request(path, headers, n_header, connfd, clientfd);
+/* Read the status line and headers of the origin's answer to a Range */
+/* request for a body from byte skip on. Return the number of bytes   */
+/* still to drop from the body: 0 for a 206 starting at skip, skip if */
+/* the origin ignored the Range and sent it all, or -1 if unusable.   */
+int resume_response(rio_t *rio, int skip) {
+    char line[MAXLINE];
+    int  status, start = -1, rtn;
 
-        /* Pass the response from the remote server to the client */
-	    while ((byteread = rio_readnb_s(&rio_s, buf, MAXLINE))) {
-	    	object_size += byteread;
-	    	if(object_size <= MAX_OBJECT_SIZE) {
-	    		memcpy(c_buf, buf, byteread);
-	    		c_buf += byteread;
-	    	}
-	        rio_writen_s(connfd, buf, byteread);
-	    }
+    if(rio_readlineb_s(rio, line, MAXLINE) <= 0 ||
+       sscanf(line, "HTTP/%*s %d", &status) != 1)
+        return -1;
+    rtn = (status == 200) ? skip : (status == 206) ? 0 : -1;
+    while(rio_readlineb_s(rio, line, MAXLINE) > 0 &&
+          strcmp(line, "\r\n") && strcmp(line, "\n")) {
+        /* The client was promised a plain body */
+        if(!strncasecmp(line, "Transfer-Encoding:", 18))
+            rtn = -1;
+        if(!strncasecmp(line, "Content-Range:", 14))
+            sscanf(line + 14, " bytes %d-", &start);
+    }
+    if(status == 206 && start != skip)
+        return -1;
+    return rtn;
+}
 
-        /* Cache the response with URL as Tag for future requests */
-	    if(object_size <= MAX_OBJECT_SIZE) {
-	    	store_cache(&cache, uri, cache_buf, object_size);
+/* Answer a request for the proxy's own resources */
+void serve_local(int connfd, char *uri) {
+    char resp[MAXRESP], *trace;
+    int  len, n, rc;
+
+    if(!strcmp(uri, "/trace")) {
+        /* Large and Malloc'ed: no rio_writen_s, which may longjmp away */
+        len = trace_response(&trace);
+        for(n = 0; n < len; n += rc) {
+            if((rc = send(connfd, trace + n, len - n, MSG_NOSIGNAL)) <= 0)
+                break;
         }
-
-        Close(clientfd);
+        Free(trace);
+        return;
     }
+    rio_writen_s(connfd, resp, format_local(uri, resp));
+}
 
-    return;
+/* Build the complete response to a local request in resp (MAXRESP */
+/* bytes): /stats reports the metrics, anything else is a 404.      */
+/* Return the length of the response.                               */
+int format_local(char *uri, char *resp) {
+    char body[MAXBUF];
+    int  len;
+
+    if(strcmp(uri, "/stats"))
+        return format_error(resp, uri, "404", "Not found",
+                            "Proxy has no such resource");
+    len = format_stats(body, MAXBUF);
+    return stats_printf(resp, MAXRESP, "HTTP/1.0 200 OK\r\n"
+                        "Content-type: text/plain\r\n"
+                        "Content-length: %d\r\n\r\n%s", len, body);
+}
+
+/* Write scheduler and engine metrics as "name value" lines to buf */
+int format_stats(char *buf, int size) {
+    char name[MAXLINE];
+    int  len = 0;
+    lane_t *lanes[2] = { &hit_lane, &miss_lane };
+    int  i;
+
+    for(i = 0; i < 2; i++) {
+        len += stats_printf(buf + len, size - len,
+                            "lane.%s.routed %lld\nlane.%s.depth %d\n",
+                            lanes[i]->name, lanes[i]->routed,
+                            lanes[i]->name, fairq_depth(&lanes[i]->q));
+        sprintf(name, "lane.%s.wait", lanes[i]->name);
+        len += hist_format(&lanes[i]->wait, name, buf + len, size - len);
+    }
+    len += cache_format(&cache, buf + len, size - len);
+    len += upstream_format(buf + len, size - len);
+    len += engine_format(buf + len, size - len);
+    len += prefetch_format(buf + len, size - len);
+    len += fairq_format(buf + len, size - len);
+    return len;
 }
 
 /*
@@ -256,26 +537,35 @@ int get_thread_index(pthread_t tid) {
 
 /* Return 1 if successful, -1 if failed */
 int parse_request(rio_t *rio, int fd, char *method, char *uri, char *version) {
-    char buf[MAXLINE];
-	rio_readlineb_s(rio, buf, MAXLINE);
+    char buf[MAXLINE], resp[MAXRESP];
+    int  len;
+
+    if(rio_readlineb_s(rio, buf, MAXLINE) <= 0)
+        return -1;
+    *method = *uri = *version = '\0';
 	sscanf(buf, "%s %s %s", method, uri, version);
 
-	/* check METHOD, URI, VERSION from the request */
-    if(strcasecmp(method, "GET")) { 
-        client_error(fd, method, "501", "Not Implemented",
-                    "Proxy does not implement this method");
+    if((len = check_request(method, uri, version, resp)) > 0) {
+        rio_writen_s(fd, resp, len);
         return -1;
     }
-    if(strlen(uri) == 0)  {
-    	client_error(fd, uri, "400", "Bad Request", "Missing uri");
-    	return -1;
-    }
-    if(strcasecmp(version, "HTTP/1.0") && strcasecmp(version, "HTTP/1.1")) {
-    	client_error(fd, version, "400", "Bad Request", "Version Illegal");
-    	return -1;
-    }
     return 1;
- }
+}
+
+/* Check METHOD, URI, VERSION from the request line. Return 0 if they */
+/* are acceptable, otherwise build the error response in resp and     */
+/* return its length.                                                 */
+int check_request(char *method, char *uri, char *version, char *resp) {
+    if(strcasecmp(method, "GET"))
+        return format_error(resp, method, "501", "Not Implemented",
+                            "Proxy does not implement this method");
+    if(strlen(uri) == 0)
+        return format_error(resp, uri, "400", "Bad Request", "Missing uri");
+    if(strcasecmp(version, "HTTP/1.0") && strcasecmp(version, "HTTP/1.1"))
+        return format_error(resp, version, "400", "Bad Request",
+                            "Version Illegal");
+    return 0;
+}
 
 /* Return 1 if successful, -1 if failed */
 /* Parse argument uri and store the hostname, pathname and port */
@@ -324,104 +614,125 @@ int parse_uri(char *uri, char *hostname, char *pathname, int *port) {
 
 /* Return 1 if successful, -1 if failed */
 int parse_headers(rio_t *rio, char headers[NHEADERS][MAXLINE], int *n) {
-	char buf[MAXLINE], key[MAXLINE];
+	char buf[MAXLINE];
+
+	*n = 0;
+	while(rio_readlineb_s(rio, buf, MAXLINE) > 0) {
+		if(!strcmp(buf, "\r\n") || !strcmp(buf, "\n"))
+			return 1;
+		if(filter_header(buf, headers, n) < 0)
+			return -1;
+	}
+	return -1; /* client closed before the end of the headers */
+}
+
+/* Keep one request header line for forwarding unless the proxy sends */
+/* its own version of it. Return 1 if successful, -1 if failed.       */
+int filter_header(char *line, char headers[NHEADERS][MAXLINE], int *n) {
 	char *tok;
-	int i=0;
-
-	rio_readlineb_s(rio, buf, MAXLINE);
-
-	while(strcmp(buf, "\r\n") && strcmp(buf, "\n")) {
-		tok = strchr(buf, ':');
-		
-		if (!tok) {
-            return -1; // not key-value pair
-        } else {
-            *tok = '\0';
-            strcpy(key, buf);
-
-            if(!strcmp(key, "Host")) {
-            	*tok = ':';
-            	if(i == NHEADERS) {
-            		printf("Too many headers\n");
-            		return -1;
-            	}
-            	strcpy(headers[i++], buf);
-            	*n = i;
-            }
-            else if(!strcmp(key, "User-Agent")){} 
-            else if(!strcmp(key, "Accept")){}
-            else if(!strcmp(key, "Accept-Encoding")){}
-            else if(!strcmp(key, "Connection")){}
-            else if(!strcmp(key, "Proxy-Connection")){}
-            else {
-            	/* Store this header and forward it directly  */
-            	*tok = ':';
-            	if(i == NHEADERS) {
-            		printf("Too many headers\n");
-            		return -1;
-            	}
-            	strcpy(headers[i++], buf);
-            	*n = i;
-            }
-        }
-        rio_readlineb_s(rio, buf, MAXLINE);
+
+	if(!(tok = strchr(line, ':')))
+		return -1; // not key-value pair
+
+	*tok = '\0';
+	if(!strcmp(line, "User-Agent") || !strcmp(line, "Accept") ||
+	   !strcmp(line, "Accept-Encoding") || !strcmp(line, "Connection") ||
+	   !strcmp(line, "Proxy-Connection"))
+		return 1;
+	*tok = ':';
+
+	/* Store this header (Host included) and forward it directly */
+	if(*n == NHEADERS) {
+		printf("Too many headers\n");
+		return -1;
 	}
+	strcpy(headers[(*n)++], line);
 	return 1;
 }
 
-/* Return 1 if cached, -i if not cached */
-void make_request(char *path, char headers[NHEADERS][MAXLINE], 
-				  int n_header, int connfd, int clientfd) 
-{
-	int i;
-	char buf[MAXLINE];
-
-    sprintf(buf, "GET %s HTTP/1.0\r\n", path);
-    rio_writen_s(clientfd, buf, strlen(buf));
+/* Return 1 if the origin's answer to a request with these headers is */
+/* the object itself. A Range or a conditional header may turn it into */
+/* a 206 or 304 that must not be cached under the uri.                 */
+int cacheable_request(char headers[NHEADERS][MAXLINE], int n) {
+	static char *names[] = { "Range:", "If-Range:", "If-Modified-Since:",
+	                         "If-None-Match:", "If-Match:",
+	                         "If-Unmodified-Since:" };
+	int i, j;
+
+	for(i = 0; i < n; i++)
+		for(j = 0; j < (int)(sizeof(names) / sizeof(names[0])); j++)
+			if(!strncasecmp(headers[i], names[j], strlen(names[j])))
+				return 0;
+	return 1;
+}
 
-    sprintf(buf, "%s", headers[0]);
-    rio_writen_s(clientfd, buf, strlen(buf));
+/* Build the request for the remote server in req. The whole request is */
+/* kept so that it can be replayed on a retry or a hedged connection.    */
+/* Return its length, or -1 if it does not fit in MAXREQ bytes.          */
+int make_request(char *path, char headers[NHEADERS][MAXLINE], 
+				  int n_header, char *req) 
+{
+	int i, len;
 
-    sprintf(buf, "%s", user_agent_hdr);
-    rio_writen_s(clientfd, buf, strlen(buf));
+    len = snprintf(req, MAXREQ, "GET %s HTTP/1.0\r\n%s%s%s%s%s%s",
+                   path, (n_header > 0) ? headers[0] : "",
+                   user_agent_hdr, accept_hdr, accept_encoding_hdr,
+                   connection_hdr, proxy_connection_hdr);
 
-    sprintf(buf, "%s", accept_hdr);
-    rio_writen_s(clientfd, buf, strlen(buf));
+    for(i=1; i<n_header && len < MAXREQ; i++) {
+    	len += snprintf(req + len, MAXREQ - len, "%s", headers[i]);
+    }
 
-    sprintf(buf, "%s", accept_encoding_hdr);
-    rio_writen_s(clientfd, buf, strlen(buf));
+    if(len < MAXREQ)
+        len += snprintf(req + len, MAXREQ - len, "\r\n");
 
-    sprintf(buf, "%s", connection_hdr);
-    rio_writen_s(clientfd, buf, strlen(buf));
+    return (len < MAXREQ) ? len : -1;
+}
 
-    sprintf(buf, "%s", proxy_connection_hdr);
-    rio_writen_s(clientfd, buf, strlen(buf));
+/* Account n bytes about to be written to the client of this thread and */
+/* hold them to its bandwidth cap. Return the thread's index.            */
+static int client_sent(size_t n)
+{
+    int i = get_thread_index(pthread_self());
 
-    for(i=1; i<n_header; i++) {
-    	sprintf(buf, "%s", headers[i]);
-    	rio_writen_s(clientfd, buf, strlen(buf));   	
+    if (i >= 0 && thread_context[i].client >= 0) {
+        fairq_sent(thread_context[i].client, n);
+        thread_context[i].sent += n;
     }
+    return i;
+}
 
-    sprintf(buf, "\r\n");
-    rio_writen_s(clientfd, buf, strlen(buf));
-
-    return;
+/* A write to the client failed: jump back out if it went away */
+static void client_write_error(int i, char *func)
+{
+	switch(errno) {
+		case EPIPE:
+			printf("[Error] socket closed when write(), recovered.\n");
+			longjmp(thread_context[i].write_env, -1);
+		default:
+			printf("[Error] Unknown Error in %s\n", func);
+			break;
+	}
 }
 
 /*  Warpper for rio_writen with consideration of errno EPIPE */
+/* Writes to the client are accounted to it and held to its bandwidth cap */
 void rio_writen_s(int fd, void *usrbuf, size_t n) 
 {
-    if (rio_writen(fd, usrbuf, n) != n) {
-    	switch(errno) {
-    		case EPIPE:
-    			printf("[Error] socket closed when write(), recovered.\n");
-    			int i = get_thread_index(pthread_self());
-    			longjmp(thread_context[i].write_env, -1);
-    		default:
-    			printf("[Error] Unknown Error in rio_writen_s\n");
-    			break;
-    	}
-    }
+    int i = client_sent(n);
+
+    if (rio_writen(fd, usrbuf, n) != n)
+        client_write_error(i, "rio_writen_s");
+}
+
+/*  Warpper for rio_batchflush, accounted like rio_writen_s */
+void rio_batchflush_s(int fd, rio_batch_t *bp)
+{
+    size_t len = bp->len;
+    int i = client_sent(len);
+
+    if (rio_batchflush(fd, bp) != len)
+        client_write_error(i, "rio_batchflush_s");
 }
 
 /*  Warpper for rio_readlineb with consideration of errno ECONNRESET */
@@ -454,6 +765,9 @@ ssize_t rio_readnb_s(rio_t *rio, void *usrbuf, size_t n)
     			printf("[Error] socket closed when read(), recovered.");
     			int i = get_thread_index(pthread_self());
     			longjmp(thread_context[i].read_env, -1);
+    		case EAGAIN:
+    			printf("[Error] remote server idle too long, gave up.\n");
+    			break;
     		default:
     			printf("[Error]Unknown Error in rio_readnb_s\n");
     			break;
@@ -465,23 +779,75 @@ ssize_t rio_readnb_s(rio_t *rio, void *usrbuf, size_t n)
 void client_error(int fd, char *cause, char *errnum, 
 		 char *shortmsg, char *longmsg) 
 {
-    char buf[MAXLINE], body[MAXBUF];
+    char resp[MAXRESP];
+
+    rio_writen_s(fd, resp, format_error(resp, cause, errnum,
+                                        shortmsg, longmsg));
+}
+
+/* Build a complete HTML error response in resp (MAXRESP bytes). */
+/* Return its length.                                            */
+int format_error(char *resp, char *cause, char *errnum,
+                 char *shortmsg, char *longmsg)
+{
+    char body[MAXBUF];
 
     /* Build the HTTP response body */
-    sprintf(body, "<html><title>Proxy Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
-
-    /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    rio_writen_s(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    rio_writen_s(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    rio_writen_s(fd, buf, strlen(buf));
-    rio_writen_s(fd, body, strlen(body));
+    snprintf(body, MAXBUF, "<html><title>Proxy Error</title>"
+             "<body bgcolor=""ffffff"">\r\n%s: %s\r\n<p>%s: %.*s\r\n"
+             "<hr><em>The Tiny Web server</em>\r\n",
+             errnum, shortmsg, longmsg, MAXBUF / 2, cause);
+
+    /* Build the HTTP response */
+    return stats_printf(resp, MAXRESP, "HTTP/1.0 %s %s\r\n"
+                        "Content-type: text/html\r\n"
+                        "Content-length: %d\r\n\r\n%s",
+                        errnum, shortmsg, (int)strlen(body), body);
+}
+
+/* Turn away a connection whose client has too many queued already. */
+/* The acceptor must not block, so a full socket buffer drops it.    */
+void reject(int fd)
+{
+    char resp[MAXRESP];
+    int  len = format_error(resp, "", "503", "Service Unavailable",
+                            "Too many requests from your address");
+
+    send(fd, resp, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    Close(fd);
+}
+
+void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-e threads|epoll|uring] [-c connect_ms] "
+            "[-f first_byte_ms] [-i idle_ms] [-r retries] [-H] "
+            "[-d hedge_min_ms] [-a attempt_ms] [-t trace_n] [-P prefetchers] [-B budget] "
+            "[-b rate[:burst]] <port>\n", prog);
+    fprintf(stderr, "  -e  I/O engine (default threads); epoll and uring "
+            "serve on one thread,\n      connect to the origin's first "
+            "address only and do not apply\n      -c/-f/-i/-r/-H/-a\n");
+    fprintf(stderr, "  -t  trace 1 in N requests, see GET /trace "
+            "(default %d, 0 = off)\n", TRACE_SAMPLE);
+    fprintf(stderr, "  -b  cap each client address to rate bytes/s, in bursts of "
+            "up to burst\n      (default rate) bytes; threads engine only\n");
+    fprintf(stderr, "  -P  prefetch links of cached HTML pages with N threads "
+            "(default 0 = off)\n");
+    fprintf(stderr, "  -B  links prefetched per page (default %d)\n",
+            PREFETCH_BUDGET);
+    fprintf(stderr, "  -c  connect timeout (default %d, 0 = none)\n",
+            CONNECT_TIMEOUT_MS);
+    fprintf(stderr, "  -a  delay before racing the next origin address "
+            "(default %d)\n", HE_DELAY_MS);
+    fprintf(stderr, "  -f  first response byte timeout (default %d, 0 = none)\n",
+            FIRST_BYTE_TIMEOUT_MS);
+    fprintf(stderr, "  -i  idle timeout between response bytes (default %d, 0 = none)\n",
+            IDLE_TIMEOUT_MS);
+    fprintf(stderr, "  -r  retries for idempotent requests (default %d)\n",
+            UPSTREAM_RETRIES);
+    fprintf(stderr, "  -H  hedge slow idempotent requests after the p95 delay\n");
+    fprintf(stderr, "  -d  lower bound on the hedge delay (default %d)\n",
+            HEDGE_MIN_DELAY_MS);
+    exit(1);
 }
 /*
  *	Helper functions Ends
@@ -0,0 +1,24 @@
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+#define NHEADERS 40
+#define MAXREQ  (4 * MAXBUF)  /* largest request we forward to an origin */
+#define MAXRESP (2 * MAXBUF)  /* largest response the proxy generates */
+
+extern cache_head cache; /* Shared cache for all workers and engines */
+
+/* Request handling shared by the thread pool and the event engines */
+int  check_request(char *method, char *uri, char *version, char *resp);
+int  parse_uri(char *uri, char *hostname, char *pathname, int *port);
+int  filter_header(char *line, char headers[NHEADERS][MAXLINE], int *n);
+int  cacheable_request(char headers[NHEADERS][MAXLINE], int n);
+int  make_request(char *path, char headers[NHEADERS][MAXLINE],
+                  int n_header, char *req);
+int  format_local(char *uri, char *resp);
+int  format_error(char *resp, char *cause, char *errnum,
+                  char *shortmsg, char *longmsg);
+
+#endif /* __PROXY_H__ */
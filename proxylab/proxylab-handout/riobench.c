@@ -0,0 +1,167 @@
+/*
+ * riobench.c - time the ways of reading header lines out of a rio_t
+ *
+ * usage: riobench [-n passes] [-m blocks]
+ *
+ * Fills a file with m realistic HTTP header blocks (browser requests and
+ * origin responses, the text the proxy and tiny parse) and reads it back
+ * line by line, n times over, with
+ *   bytewise  the textbook rio_readlineb: one rio_read call per byte
+ *   memchr    rio_readlineb: memchr over the buffer, one copy per line
+ *   zerocopy  rio_readlinep: memchr, and a pointer into the buffer
+ * Prints the time per line and the rate each one reads text at. Each way
+ * reads the same file through the same size buffer, so they make the
+ * same read() calls and differ only in how lines are found and copied.
+ */
+#include "csapp.h"
+
+static char *request =
+    "GET http://www.cmu.edu/hub/index.html HTTP/1.1\r\n"
+    "Host: www.cmu.edu\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) "
+    "Gecko/20120305 Firefox/10.0.3\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Referer: http://www.cmu.edu/\r\n"
+    "Cookie: _ga=GA1.2.1234567890.1234567890; session=8f14e45fceea167a\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+static char *response =
+    "HTTP/1.1 200 OK\r\n"
+    "Date: Mon, 19 Oct 2026 12:00:00 GMT\r\n"
+    "Server: Apache/2.4.41 (Ubuntu)\r\n"
+    "Last-Modified: Fri, 16 Oct 2026 08:30:00 GMT\r\n"
+    "ETag: \"2aa6-5b1c4f8e2d1c0\"\r\n"
+    "Accept-Ranges: bytes\r\n"
+    "Content-Length: 10918\r\n"
+    "Vary: Accept-Encoding\r\n"
+    "Content-Type: text/html; charset=UTF-8\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+/* The textbook rio_read and rio_readlineb, for comparison */
+static ssize_t bytewise_read(rio_t *rp, char *usrbuf, size_t n)
+{
+    int cnt;
+
+    while (rp->rio_cnt <= 0) {
+	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, rp->rio_bufsize);
+	if (rp->rio_cnt < 0) {
+	    if (errno != EINTR)
+		return -1;
+	}
+	else if (rp->rio_cnt == 0)
+	    return 0;
+	else
+	    rp->rio_bufptr = rp->rio_buf;
+    }
+    cnt = n;
+    if (rp->rio_cnt < n)
+	cnt = rp->rio_cnt;
+    memcpy(usrbuf, rp->rio_bufptr, cnt);
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    return cnt;
+}
+
+static ssize_t bytewise_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+{
+    int n, rc;
+    char c, *bufp = usrbuf;
+
+    for (n = 1; n < maxlen; n++) {
+	if ((rc = bytewise_read(rp, &c, 1)) == 1) {
+	    *bufp++ = c;
+	    if (c == '\n')
+		break;
+	} else if (rc == 0) {
+	    if (n == 1)
+		return 0;
+	    else
+		break;
+	} else
+	    return -1;
+    }
+    *bufp = 0;
+    return n;
+}
+
+/* Read every line of fd with way; return the lines and add up the bytes */
+static long read_lines(int fd, int way, long *bytes)
+{
+    rio_t rio;
+    char buf[MAXLINE], *line;
+    ssize_t n;
+    long lines = 0;
+
+    lseek(fd, 0, SEEK_SET);
+    Rio_readinitb(&rio, fd);
+    for (;;) {
+	if (way == 0)
+	    n = bytewise_readlineb(&rio, buf, MAXLINE);
+	else if (way == 1)
+	    n = rio_readlineb(&rio, buf, MAXLINE);
+	else
+	    n = rio_readlinep(&rio, &line);
+	if (n <= 0)
+	    break;
+	*bytes += n;
+	lines++;
+    }
+    if (n < 0)
+	unix_error("read_lines error");
+    rio_freeb(&rio);
+    return lines;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    char *names[] = { "bytewise", "memchr", "zerocopy" };
+    int opt, passes = 200, blocks = 1000, i, way, fd;
+    long lines, bytes;
+    double start, secs;
+    FILE *fp;
+
+    while ((opt = getopt(argc, argv, "n:m:")) != -1) {
+	if (opt == 'n')
+	    passes = atoi(optarg);
+	else if (opt == 'm')
+	    blocks = atoi(optarg);
+	else {
+	    fprintf(stderr, "usage: %s [-n passes] [-m blocks]\n", argv[0]);
+	    exit(1);
+	}
+    }
+    if ((fp = tmpfile()) == NULL)
+	unix_error("tmpfile error");
+    for (i = 0; i < blocks; i++)
+	fputs(i % 2 ? response : request, fp);
+    fflush(fp);
+    fd = fileno(fp);
+
+    printf("%-9s %9s %9s %9s\n", "way", "lines", "ns/line", "MB/s");
+    for (way = 0; way < 3; way++) {
+	read_lines(fd, way, &bytes);  /* warm up */
+	lines = bytes = 0;
+	start = now();
+	for (i = 0; i < passes; i++)
+	    lines += read_lines(fd, way, &bytes);
+	secs = now() - start;
+	printf("%-9s %9ld %9.1f %9.1f\n", names[way], lines,
+	       secs * 1e9 / lines, bytes / secs / 1e6);
+    }
+    fclose(fp);
+    exit(0);
+}
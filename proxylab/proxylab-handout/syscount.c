@@ -0,0 +1,181 @@
+/*
+ * syscount.c - count the system calls made by a process and its threads
+ *
+ * usage: syscount [-o file] command [args...]
+ *
+ * Runs command under ptrace and counts every system call entry of every
+ * thread it creates. SIGUSR1 resets the counters and SIGUSR2 writes the
+ * counts so far, so a benchmark can measure just its load phase. SIGINT
+ * and SIGTERM are passed on to the command; the final counts are written
+ * when it exits. Counts go to file (rewritten on each report) or stdout.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <linux/ptrace.h>
+
+#define MAXSYSCALL 512
+
+static long long counts[MAXSYSCALL];
+static volatile sig_atomic_t want_reset, want_report, want_stop;
+static char *outfile;
+
+/* Names of the calls a network server is likely to make */
+static struct { int nr; char *name; } names[] = {
+    { SYS_read, "read" }, { SYS_write, "write" }, { SYS_close, "close" },
+    { SYS_readv, "readv" }, { SYS_writev, "writev" },
+    { SYS_recvfrom, "recvfrom" }, { SYS_sendto, "sendto" },
+    { SYS_recvmsg, "recvmsg" }, { SYS_sendmsg, "sendmsg" },
+    { SYS_sendfile, "sendfile" }, { SYS_accept, "accept" },
+    { SYS_accept4, "accept4" }, { SYS_connect, "connect" },
+    { SYS_socket, "socket" }, { SYS_setsockopt, "setsockopt" },
+    { SYS_getsockopt, "getsockopt" }, { SYS_shutdown, "shutdown" },
+    { SYS_poll, "poll" }, { SYS_ppoll, "ppoll" },
+    { SYS_epoll_wait, "epoll_wait" }, { SYS_epoll_pwait, "epoll_pwait" },
+    { SYS_epoll_ctl, "epoll_ctl" }, { SYS_io_uring_enter, "io_uring_enter" },
+    { SYS_futex, "futex" }, { SYS_mmap, "mmap" }, { SYS_munmap, "munmap" },
+    { SYS_brk, "brk" }, { SYS_openat, "openat" }, { SYS_fstat, "fstat" },
+    { SYS_newfstatat, "newfstatat" }, { SYS_lseek, "lseek" },
+    { SYS_rt_sigprocmask, "rt_sigprocmask" }, { SYS_clock_gettime, "clock_gettime" },
+    { SYS_fcntl, "fcntl" }, { SYS_socketpair, "socketpair" },
+};
+
+static void handler(int sig) {
+    if(sig == SIGUSR1)
+        want_reset = 1;
+    else if(sig == SIGUSR2)
+        want_report = 1;
+    else
+        want_stop = 1;
+}
+
+static char *syscall_name(int nr) {
+    static char buf[32];
+    unsigned i;
+
+    for(i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if(names[i].nr == nr)
+            return names[i].name;
+    }
+    sprintf(buf, "syscall_%d", nr);
+    return buf;
+}
+
+/* Write "total N" and then one "name N" line per call, most frequent first */
+static void report(void) {
+    FILE *fp = outfile ? fopen(outfile, "w") : stdout;
+    long long total = 0, best;
+    int done[MAXSYSCALL] = { 0 };
+    int i, nr;
+
+    if(!fp) {
+        perror(outfile);
+        return;
+    }
+    for(i = 0; i < MAXSYSCALL; i++)
+        total += counts[i];
+    fprintf(fp, "total %lld\n", total);
+    while(1) {
+        best = 0;
+        nr = -1;
+        for(i = 0; i < MAXSYSCALL; i++) {
+            if(!done[i] && counts[i] > best) {
+                best = counts[i];
+                nr = i;
+            }
+        }
+        if(nr < 0)
+            break;
+        done[nr] = 1;
+        fprintf(fp, "%s %lld\n", syscall_name(nr), best);
+    }
+    if(outfile)
+        fclose(fp);
+    else
+        fflush(fp);
+}
+
+int main(int argc, char **argv) {
+    struct ptrace_syscall_info info;
+    struct sigaction sa;
+    pid_t child, pid;
+    int status, sig, c;
+
+    while((c = getopt(argc, argv, "+o:")) != -1) {
+        switch(c) {
+        case 'o': outfile = optarg; break;
+        default:  optind = argc;
+        }
+    }
+    if(optind >= argc) {
+        fprintf(stderr, "usage: %s [-o file] command [args...]\n", argv[0]);
+        exit(1);
+    }
+
+    if((child = fork()) == 0) {
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+        execvp(argv[optind], argv + optind);
+        perror(argv[optind]);
+        exit(127);
+    }
+    waitpid(child, &status, 0);
+    ptrace(PTRACE_SETOPTIONS, child, NULL,
+           PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+    ptrace(PTRACE_SYSCALL, child, NULL, NULL);
+
+    /* No SA_RESTART: the signals must interrupt waitpid() */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handler;
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    while(1) {
+        pid = waitpid(-1, &status, __WALL);
+        if(want_reset) {
+            memset(counts, 0, sizeof(counts));
+            want_reset = 0;
+        }
+        if(want_report) {
+            report();
+            want_report = 0;
+        }
+        if(want_stop) {
+            kill(child, SIGTERM);
+            want_stop = 0;
+        }
+        if(pid < 0) {
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+        if(WIFEXITED(status) || WIFSIGNALED(status)) {
+            if(pid == child)
+                break;
+            continue;
+        }
+        sig = WSTOPSIG(status);
+        if(sig == (SIGTRAP | 0x80)) {
+            if(ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) > 0 &&
+               info.op == PTRACE_SYSCALL_INFO_ENTRY &&
+               info.entry.nr < MAXSYSCALL)
+                counts[info.entry.nr]++;
+            sig = 0;
+        }
+        else if(status >> 16 || sig == SIGSTOP || sig == SIGTRAP) {
+            sig = 0;            /* ptrace events and new-thread stops */
+        }
+        ptrace(PTRACE_SYSCALL, pid, NULL, sig);
+    }
+    report();
+    return 0;
+}
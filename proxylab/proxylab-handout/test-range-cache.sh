@@ -0,0 +1,66 @@
+#!/bin/bash
+#
+# test-range-cache.sh - check that partial answers stay out of the cache
+#
+#     A range request and a conditional GET get a 206 and a 304 from
+#     tiny. A plain GET that follows must still see the whole file, from
+#     tiny and then, with tiny stopped, from the cache. This is run with
+#     each engine that parses requests itself.
+#
+#     usage: ./test-range-cache.sh [engines]
+#
+
+ENGINES=${1:-"threads epoll"}
+FILE=godzilla.jpg
+TIMEOUT=5
+OUT=/tmp/test-range-cache.$$
+failed=0
+
+if [ ! -x ./proxy ] || [ ! -x ./tiny/tiny ]; then
+    echo "Build first: make proxy; (cd tiny; make)"
+    exit 1
+fi
+trap "rm -rf ${OUT}" EXIT
+mkdir -p ${OUT}
+
+function free_port {
+    echo $(( (RANDOM % 30000) + 20000 ))
+}
+
+function wait_for_port {
+    for i in `seq 50`; do
+        (echo > /dev/tcp/localhost/$1) 2>/dev/null && return 0
+        sleep 0.1
+    done
+    return 1
+}
+
+for engine in ${ENGINES}; do
+    tiny_port=`free_port`
+    (cd ./tiny && exec ./tiny ${tiny_port}) > /dev/null 2>&1 &
+    tiny_pid=$!
+    wait_for_port ${tiny_port} || { echo "tiny did not start"; exit 1; }
+    proxy_port=`free_port`
+    ./proxy -e ${engine} ${proxy_port} > /dev/null 2>&1 &
+    proxy_pid=$!
+    wait_for_port ${proxy_port} || { echo "proxy did not start"; exit 1; }
+
+    url="http://localhost:${tiny_port}/${FILE}"
+    fetch="curl --max-time ${TIMEOUT} --silent --proxy http://localhost:${proxy_port}"
+    rm -f ${OUT}/*
+    ${fetch} --range 0-9 --output /dev/null ${url}
+    ${fetch} --header "If-Modified-Since: Fri, 01 Jan 2100 00:00:00 GMT" \
+        --output /dev/null ${url}
+    ${fetch} --output ${OUT}/origin ${url}
+    kill ${tiny_pid}; wait ${tiny_pid} 2>/dev/null
+    ${fetch} --output ${OUT}/cache ${url}
+    kill ${proxy_pid}; wait ${proxy_pid} 2>/dev/null
+
+    if cmp -s ./tiny/${FILE} ${OUT}/origin && cmp -s ./tiny/${FILE} ${OUT}/cache; then
+        echo "${engine}: ok, a plain GET after a range request got the whole file"
+    else
+        echo "${engine}: FAIL, the cache kept a partial or empty answer"
+        failed=1
+    fi
+done
+exit ${failed}
@@ -0,0 +1,79 @@
+#!/bin/bash
+#
+# bench-static.sh - compare tiny's two ways of sending static files
+#
+#     Runs tiny with -s mmap (open, mmap, write and munmap per request)
+#     and -s sendfile (cached descriptors and sendfile) and drives each
+#     with the proxy's loadgen, once with a small file and once with a
+#     large one. Prints the request rate, throughput, latency and the
+#     CPU time tiny spent per request. With sendfile, the small file is
+#     served from the response fcache keeps in memory.
+#
+#     usage: ./bench-static.sh [seconds] [concurrency] [mode]
+#
+#     mode is one of tiny's -m modes (default threads). CPU time is read
+#     from tiny's own process, so it misses the workers of -m prefork.
+#
+
+SECONDS_PER_RUN=${1:-3}
+CONCURRENCY=${2:-8}
+MODE=${3:-threads}
+LOADGEN=../loadgen
+SMALL=bench-small.bin
+LARGE=bench-large.bin
+PATHS=/tmp/bench-static.$$
+
+if [ ! -x ./tiny ] || [ ! -x ${LOADGEN} ]; then
+    echo "Build first: make tiny, and make loadgen in .."
+    exit 1
+fi
+head -c 4096 /dev/urandom > ${SMALL}
+head -c $((8 * 1024 * 1024)) /dev/urandom > ${LARGE}
+trap "rm -f ${SMALL} ${LARGE} ${PATHS}" EXIT
+
+function free_port {
+    echo $(( (RANDOM % 30000) + 20000 ))
+}
+
+function wait_for_port {
+    for i in `seq 50`; do
+        (echo > /dev/tcp/localhost/$1) 2>/dev/null && return 0
+        sleep 0.1
+    done
+    return 1
+}
+
+# json_field <json> <name> - print a numeric field of loadgen's output
+function json_field {
+    echo "$1" | sed -n "s/.*\"$2\":\([0-9.]*\).*/\1/p"
+}
+
+# cpu_ticks <pid> - user plus system clock ticks used by a process
+function cpu_ticks {
+    awk '{ print $14 + $15 }' /proc/$1/stat
+}
+
+printf "%-9s %-6s %9s %9s %9s %9s %11s\n" path file req/s Mbit/s p50_us \
+    p99_us cpu_us/req
+for file in ${SMALL} ${LARGE}; do
+    echo /${file} > ${PATHS}
+    for path in mmap sendfile; do
+        port=`free_port`
+        ./tiny -m ${MODE} -s ${path} ${port} > /dev/null 2>&1 &
+        pid=$!
+        wait_for_port ${port} || { echo "tiny did not start"; exit 1; }
+        result=`${LOADGEN} -O localhost:${port} -U ${PATHS} \
+            -c ${CONCURRENCY} -d ${SECONDS_PER_RUN} -w ${CONCURRENCY}`
+        ticks=`cpu_ticks ${pid}`
+        kill ${pid}; wait ${pid} 2>/dev/null
+
+        printf "%-9s %-6s %9s %9s %9s %9s %11s\n" ${path} \
+            `[ ${file} == ${SMALL} ] && echo 4K || echo 8M` \
+            `json_field "${result}" req_per_s` \
+            `json_field "${result}" mbit_per_s` \
+            `json_field "${result}" p50` `json_field "${result}" p99` \
+            `awk -v t=${ticks} -v hz=$(getconf CLK_TCK) \
+                -v n=$(json_field "${result}" requests) \
+                'BEGIN { printf "%.1f", t * 1000000 / hz / (n + '${CONCURRENCY}') }'`
+    done
+done
@@ -1,36 +1,39 @@
 /*
  * adder.c - a minimal CGI program that adds two numbers together
+ *
+ *     It loops on tcgi_accept, so tiny can keep it running and hand it
+ *     one request after another; run as plain CGI, it serves one.
  */
 /* $begin adder */
 #include "csapp.h"
+#include "tcgi.h"
 
 int main(void) {
     char *buf, *p;
-    char arg1[MAXLINE], arg2[MAXLINE], content[MAXLINE];
-    int n1=0, n2=0;
+    char content[MAXLINE];
+    int n1, n2;
 
-    /* Extract the two arguments */
-    if ((buf = getenv("QUERY_STRING")) != NULL) {
-	p = strchr(buf, '&');
-	*p = '\0';
-	strcpy(arg1, buf);
-	strcpy(arg2, p+1);
-	n1 = atoi(arg1);
-	n2 = atoi(arg2);
-    }
+    while (tcgi_accept() >= 0) {
+	/* Extract the two arguments */
+	n1 = n2 = 0;
+	if ((buf = getenv("QUERY_STRING")) != NULL &&
+	    (p = strchr(buf, '&')) != NULL) {
+	    n1 = atoi(buf);
+	    n2 = atoi(p+1);
+	}
 
-    /* Make the response body */
-    sprintf(content, "Welcome to add.com: ");
-    sprintf(content, "%sTHE Internet addition portal.\r\n<p>", content);
-    sprintf(content, "%sThe answer is: %d + %d = %d\r\n<p>", 
-	    content, n1, n2, n1 + n2);
-    sprintf(content, "%sThanks for visiting!\r\n", content);
+	/* Make the response body */
+	sprintf(content, "Welcome to add.com: "
+		"THE Internet addition portal.\r\n<p>"
+		"The answer is: %d + %d = %d\r\n<p>"
+		"Thanks for visiting!\r\n", n1, n2, n1 + n2);
   
-    /* Generate the HTTP response */
-    printf("Content-length: %d\r\n", (int)strlen(content));
-    printf("Content-type: text/html\r\n\r\n");
-    printf("%s", content);
-    fflush(stdout);
+	/* Generate the HTTP response */
+	printf("Content-length: %d\r\n", (int)strlen(content));
+	printf("Content-type: text/html\r\n\r\n");
+	printf("%s", content);
+	fflush(stdout);
+    }
     exit(0);
 }
 /* $end adder */
@@ -0,0 +1,95 @@
+/*
+ * tcgi.c - the CGI program's side of Tiny's persistent CGI protocol
+ *
+ * A CGI program calls tcgi_accept in a loop:
+ *
+ *     while (tcgi_accept() >= 0) {
+ *         ... read QUERY_STRING, write the response to stdout ...
+ *     }
+ *
+ * Run by tiny as a worker, each call finishes the previous request and
+ * waits for the next one, with QUERY_STRING set and stdout connected to
+ * the client. Run as a plain CGI program, the loop runs once.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include "tcgi.h"
+
+static int chan = -2;    /* socket to tiny, -1 for plain CGI, -2 at first */
+static int nullfd = -1;  /* stdout between requests */
+static int served;       /* requests accepted so far */
+
+/* Receive a request: its query string into buf, and the client's socket */
+static int recv_request(char *buf, int size, int *fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(int))];
+    int n;
+
+    iov.iov_base = buf;
+    iov.iov_len = size - 1;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if ((n = recvmsg(chan, &msg, 0)) <= 0)
+	return -1;  /* tiny went away */
+    buf[n] = '\0';
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS)
+	return -1;
+    memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    return 0;
+}
+
+/*
+ * tcgi_accept - finish the current request, if any, and accept the next.
+ *     Return 0 with a request to serve, -1 when there are no more.
+ */
+int tcgi_accept(void)
+{
+    static char args[TCGI_MAXARGS];
+    char c;
+    char *env;
+    int fd;
+
+    if (chan == -2) {
+	if ((env = getenv(TCGI_ENV)) == NULL)
+	    chan = -1;
+	else {
+	    chan = atoi(env);
+	    signal(SIGPIPE, SIG_IGN); /* a client leaving must not kill us */
+	    nullfd = open("/dev/null", O_WRONLY);
+	    c = TCGI_READY;
+	    if (nullfd < 0 || write(chan, &c, 1) != 1)
+		return -1;
+	}
+    }
+    if (chan == -1)  /* plain CGI: the one request we were run for */
+	return served++ ? -1 : 0;
+
+    if (served) {
+	/* Let go of the last client and tell tiny we are done */
+	fflush(stdout);
+	dup2(nullfd, STDOUT_FILENO);
+	clearerr(stdout);
+	c = TCGI_DONE;
+	if (write(chan, &c, 1) != 1)
+	    return -1;
+    }
+    if (recv_request(args, sizeof(args), &fd) < 0)
+	return -1;
+    setenv("QUERY_STRING", args, 1);
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+    served++;
+    return 0;
+}
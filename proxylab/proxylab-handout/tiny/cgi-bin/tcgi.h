@@ -0,0 +1,28 @@
+#ifndef __TCGI_H__
+#define __TCGI_H__
+
+/*
+ * tcgi - Tiny's persistent CGI protocol, after FastCGI
+ *
+ * Instead of running a CGI program for every request, tiny can keep a
+ * few of them running as workers. A worker is started with TCGI_ENV set
+ * and a SOCK_SEQPACKET socket to tiny on TCGI_FILENO, over which it
+ *   sends     TCGI_READY once, when it is ready for requests,
+ *   receives  one message per request: the query string and its '\0',
+ *             with the client's connected socket attached (SCM_RIGHTS),
+ *   sends     TCGI_DONE once it has written the response and closed
+ *             its copy of the client's socket.
+ *
+ * A program gets all of this by looping on tcgi_accept, which also
+ * works when the program is run as a plain CGI program.
+ */
+
+#define TCGI_ENV     "TINY_CGI_FD"  /* set for workers */
+#define TCGI_FILENO  3              /* the worker's socket to tiny */
+#define TCGI_READY   'R'
+#define TCGI_DONE    'D'
+#define TCGI_MAXARGS 8192           /* longest query string */
+
+int tcgi_accept(void);
+
+#endif /* __TCGI_H__ */
@@ -0,0 +1,303 @@
+#define _GNU_SOURCE  /* posix_spawn_file_actions_addclosefrom_np */
+#include "csapp.h"
+#include <spawn.h>
+#include <poll.h>
+#include "cgipool.h"
+#include "cgi-bin/tcgi.h"
+
+/*
+ * cgipool.c - persistent workers for CGI programs
+ *
+ * Only programs declared with cgi_declare (tiny -c) speak the protocol
+ * of cgi-bin/tcgi.h; tiny never runs a program just to find out, since
+ * a plain CGI program would do its work for a request nobody sent. The
+ * first request for a declared program starts cgi_workers copies of it
+ * as workers and later requests are handed to an idle one over its
+ * socket, with no process created per request. cgi_serve turns down
+ * requests for other programs and the caller runs them with cgi_spawn,
+ * once per request, as before. A worker that dies, or that has not
+ * finished a request within CGI_TIMEOUT_MS, is started again.
+ */
+
+#define PROG_NEW     0  /* not run yet */
+#define PROG_WORKERS 1  /* has workers */
+
+int cgi_workers = CGI_WORKERS;
+
+typedef struct {
+    char *name;
+    int state;
+    int *chan;      /* tiny's end of each worker's socket, -1 if none */
+    pid_t *pid;
+    int *idle;      /* stack of idle workers */
+    int nidle;
+    sem_t mutex;    /* protects state and the arrays above */
+    sem_t slots;    /* counts idle workers */
+} prog_t;
+
+static prog_t progs[CGI_PROGS];  /* filled before any request */
+static int nprogs;
+
+/*
+ * make_env - return a copy of environ with var, a "NAME=value" string,
+ *     set; free it with Free
+ */
+static char **make_env(char *var)
+{
+    int n, i, j, len = strchr(var, '=') - var + 1;
+    char **envp;
+
+    for (n = 0; environ[n]; n++)
+	;
+    envp = Malloc((n + 2) * sizeof(char *));
+    for (i = j = 0; i < n; i++)
+	if (strncmp(environ[i], var, len))
+	    envp[j++] = environ[i];
+    envp[j++] = var;
+    envp[j] = NULL;
+    return envp;
+}
+
+/*
+ * spawn - run filename with file actions fa and variable var added to
+ *     the environment; return its pid, or -1
+ */
+static pid_t spawn(char *filename, posix_spawn_file_actions_t *fa, char *var)
+{
+    char *argv[] = { filename, NULL }, **envp = make_env(var);
+    pid_t pid;
+    int rc;
+
+    if ((rc = posix_spawn(&pid, filename, fa, NULL, argv, envp)) != 0) {
+	fprintf(stderr, "posix_spawn error: %s: %s\n", filename, strerror(rc));
+	pid = -1;
+    }
+    Free(envp);
+    return pid;
+}
+
+/*
+ * cgi_spawn - run a plain CGI program for one request with its stdout on
+ *     the client's socket, and wait for it. posix_spawn lets the C library
+ *     use vfork, so a large server is not copied just to exec.
+ */
+void cgi_spawn(int fd, char *filename, char *cgiargs)
+{
+    char var[MAXLINE + 16];
+    posix_spawn_file_actions_t fa;
+    pid_t pid;
+
+    snprintf(var, sizeof(var), "QUERY_STRING=%s", cgiargs);
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, fd, STDOUT_FILENO);
+#if __GLIBC_PREREQ(2, 34)
+    posix_spawn_file_actions_addclosefrom_np(&fa, STDERR_FILENO + 1);
+#endif
+    if ((pid = spawn(filename, &fa, var)) > 0)
+	Waitpid(pid, NULL, 0);
+    posix_spawn_file_actions_destroy(&fa);
+}
+
+/*
+ * start_worker - start worker w of p and wait for it to be ready. Return
+ *     0, or -1 if it did not get ready. Callers hold p->mutex.
+ */
+static int start_worker(prog_t *p, int w)
+{
+    char var[32], c;
+    int sv[2];
+    posix_spawn_file_actions_t fa;
+    struct pollfd pfd;
+
+    p->chan[w] = -1;
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+	return -1;
+    snprintf(var, sizeof(var), "%s=%d", TCGI_ENV, TCGI_FILENO);
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_adddup2(&fa, sv[1], TCGI_FILENO);
+#if __GLIBC_PREREQ(2, 34)
+    /* Do not keep other clients' sockets open for as long as it lives */
+    posix_spawn_file_actions_addclosefrom_np(&fa, TCGI_FILENO + 1);
+#endif
+    p->pid[w] = spawn(p->name, &fa, var);
+    posix_spawn_file_actions_destroy(&fa);
+    Close(sv[1]);
+    if (p->pid[w] < 0) {
+	Close(sv[0]);
+	return -1;
+    }
+
+    pfd.fd = sv[0];
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, CGI_READY_MS) != 1 || recv(sv[0], &c, 1, 0) != 1 ||
+	c != TCGI_READY) {
+	kill(p->pid[w], SIGKILL);
+	Waitpid(p->pid[w], NULL, 0);
+	Close(sv[0]);
+	return -1;
+    }
+    p->chan[w] = sv[0];
+    return 0;
+}
+
+/* Stop worker w of p, if it is running, and start it again */
+static void restart_worker(prog_t *p, int w)
+{
+    P(&p->mutex);
+    if (p->chan[w] >= 0) {
+	Close(p->chan[w]);
+	kill(p->pid[w], SIGKILL);
+	Waitpid(p->pid[w], NULL, 0);
+    }
+    start_worker(p, w);
+    V(&p->mutex);
+}
+
+/*
+ * cgi_declare - mark the program at path, relative to tiny's directory,
+ *     as one that speaks the protocol. Call before serving requests.
+ *     Return 0, or -1 if CGI_PROGS are declared already.
+ */
+int cgi_declare(char *path)
+{
+    prog_t *p;
+
+    if (nprogs == CGI_PROGS)
+	return -1;
+    while (!strncmp(path, "./", 2) || *path == '/')
+	path += (*path == '/') ? 1 : 2;
+    p = &progs[nprogs++];
+    p->name = Malloc(strlen(path) + 3);
+    sprintf(p->name, "./%s", path);  /* as parse_uri names it */
+    p->state = PROG_NEW;
+    p->nidle = 0;
+    Sem_init(&p->mutex, 0, 1);
+    Sem_init(&p->slots, 0, 0);
+    return 0;
+}
+
+/* Return the entry for filename if it was declared, or NULL */
+static prog_t *find_prog(char *filename)
+{
+    int i;
+
+    for (i = 0; i < nprogs; i++)
+	if (!strcmp(progs[i].name, filename))
+	    return &progs[i];
+    return NULL;
+}
+
+/*
+ * start_prog - start p's workers the first time it runs; callers hold
+ *     p->mutex. Return -1, leaving p to be tried again, if none is ready.
+ */
+static int start_prog(prog_t *p)
+{
+    int w;
+
+    p->chan = Malloc(cgi_workers * sizeof(int));
+    p->pid = Malloc(cgi_workers * sizeof(pid_t));
+    p->idle = Malloc(cgi_workers * sizeof(int));
+    if (start_worker(p, 0) < 0) {
+	fprintf(stderr, "cgi: %s did not get ready as a worker\n", p->name);
+	Free(p->chan);
+	Free(p->pid);
+	Free(p->idle);
+	return -1;
+    }
+    for (w = 1; w < cgi_workers; w++)
+	start_worker(p, w);  /* failures are retried at first use */
+    for (w = 0; w < cgi_workers; w++) {
+	p->idle[p->nidle++] = w;
+	V(&p->slots);
+    }
+    p->state = PROG_WORKERS;
+    return 0;
+}
+
+/* Hand the request to the worker on chan: cgiargs, with fd attached */
+static int send_request(int chan, int fd, char *cgiargs)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(int))];
+
+    iov.iov_base = cgiargs;
+    iov.iov_len = strlen(cgiargs) + 1; /* never empty: that reads as EOF */
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(chan, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+/*
+ * wait_done - wait up to CGI_TIMEOUT_MS for the worker on chan to finish
+ *     its request; return 0 if it did, -1 if it died or hung
+ */
+static int wait_done(int chan)
+{
+    struct pollfd pfd;
+    char c;
+
+    pfd.fd = chan;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, CGI_TIMEOUT_MS) != 1)
+	return -1;
+    return (recv(chan, &c, 1, 0) == 1 && c == TCGI_DONE) ? 0 : -1;
+}
+
+/*
+ * cgi_serve - have a worker of filename answer the request with cgiargs
+ *     on fd and wait until it has. Return -1, with nothing sent, if the
+ *     program was not declared or has no worker to take the request.
+ */
+int cgi_serve(int fd, char *filename, char *cgiargs)
+{
+    prog_t *p;
+    int w, rc = 0;
+
+    if (cgi_workers <= 0 || strlen(cgiargs) >= TCGI_MAXARGS)
+	return -1;
+    if ((p = find_prog(filename)) == NULL)
+	return -1;
+    P(&p->mutex);
+    if (p->state == PROG_NEW)
+	rc = start_prog(p);
+    V(&p->mutex);
+    if (rc < 0)
+	return -1;
+
+    P(&p->slots);
+    P(&p->mutex);
+    w = p->idle[--p->nidle];
+    if (p->chan[w] < 0 && start_worker(p, w) < 0)
+	rc = -1;
+    V(&p->mutex);
+
+    if (rc == 0 && send_request(p->chan[w], fd, cgiargs) < 0) {
+	restart_worker(p, w);  /* it died while idle */
+	rc = -1;
+    }
+    else if (rc == 0 && wait_done(p->chan[w]) < 0) {
+	fprintf(stderr, "cgi: %s worker %d died or hung on a request\n",
+		p->name, w);
+	restart_worker(p, w);  /* killed, so the client sees the end */
+    }
+
+    P(&p->mutex);
+    p->idle[p->nidle++] = w;
+    V(&p->mutex);
+    V(&p->slots);
+    return rc;
+}
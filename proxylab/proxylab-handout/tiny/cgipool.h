@@ -0,0 +1,17 @@
+#ifndef __CGIPOOL_H__
+#define __CGIPOOL_H__
+
+#include "csapp.h"
+
+#define CGI_PROGS    16    /* CGI programs that may have workers */
+#define CGI_WORKERS  4     /* default workers per program, see -w */
+#define CGI_READY_MS 1000  /* a worker not ready by then failed to start */
+#define CGI_TIMEOUT_MS 30000  /* a worker still on a request is killed */
+
+extern int cgi_workers;    /* workers per program, 0 for none */
+
+int  cgi_declare(char *path);
+int  cgi_serve(int fd, char *filename, char *cgiargs);
+void cgi_spawn(int fd, char *filename, char *cgiargs);
+
+#endif /* __CGIPOOL_H__ */
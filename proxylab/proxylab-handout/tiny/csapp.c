@@ -572,6 +572,73 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+/*
+ * rio_writev - robustly write the iovcnt buffers of iov, in one writev
+ *    call when the kernel takes them all. A partial write moves on to
+ *    the rest, so iov is updated as bytes go out. Returns the number of
+ *    bytes written, or -1 on error.
+ */
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t nwritten, total = 0;
+
+    while (iovcnt > 0 && iov->iov_len == 0) {
+	iov++;
+	iovcnt--;
+    }
+    while (iovcnt > 0) {
+	if ((nwritten = writev(fd, iov, iovcnt)) <= 0) {
+	    if (errno == EINTR)  /* interrupted by sig handler return */
+		continue;        /* and call writev() again */
+	    return -1;           /* errno set by writev() */
+	}
+	total += nwritten;
+	while (iovcnt > 0 && nwritten >= iov->iov_len) { /* whole buffers */
+	    nwritten -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt > 0) {        /* part of one */
+	    iov->iov_base = (char *)iov->iov_base + nwritten;
+	    iov->iov_len -= nwritten;
+	}
+    }
+    return total;
+}
+
+/*
+ * rio_batchinit, rio_batchadd, rio_batchflush - gather the pieces of a
+ *    message, such as a header block and its body, and write them all
+ *    with one writev. rio_batchadd only records buf, which must stay put
+ *    until the flush, and returns -1 when the batch is full. The flush
+ *    empties the batch and returns what rio_writev does.
+ */
+void rio_batchinit(rio_batch_t *bp)
+{
+    bp->cnt = 0;
+    bp->len = 0;
+}
+
+int rio_batchadd(rio_batch_t *bp, void *buf, size_t n)
+{
+    if (bp->cnt == RIO_MAXIOV)
+	return -1;
+    if (n > 0) {
+	bp->iov[bp->cnt].iov_base = buf;
+	bp->iov[bp->cnt++].iov_len = n;
+	bp->len += n;
+    }
+    return 0;
+}
+
+ssize_t rio_batchflush(int fd, rio_batch_t *bp)
+{
+    ssize_t rc = rio_writev(fd, bp->iov, bp->cnt);
+
+    rio_batchinit(bp);
+    return rc;
+}
+
 
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
@@ -587,8 +654,7 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
     int cnt;
 
     while (rp->rio_cnt <= 0) {  /* refill if buf is empty */
-	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
-			   sizeof(rp->rio_buf));
+	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, rp->rio_bufsize);
 	if (rp->rio_cnt < 0) {
 	    if (errno != EINTR) /* interrupted by sig handler return */
 		return -1;
@@ -610,17 +676,71 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 }
 /* $end rio_read */
 
+/*
+ * rio_fill - move the rio_cnt unread bytes to the start of the internal
+ *    buffer and read more after them. Returns the number of bytes read,
+ *    0 on EOF or when the buffer is already full, -1 on error.
+ */
+static ssize_t rio_fill(rio_t *rp)
+{
+    ssize_t n;
+
+    if (rp->rio_cnt < 0)  /* left by a failed read() */
+	rp->rio_cnt = 0;
+    if (rp->rio_cnt > 0 && rp->rio_bufptr != rp->rio_buf)
+	memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+    rp->rio_bufptr = rp->rio_buf;
+    if (rp->rio_cnt == rp->rio_bufsize)
+	return 0;
+    while ((n = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+		     rp->rio_bufsize - rp->rio_cnt)) < 0)
+	if (errno != EINTR) /* interrupted by sig handler return */
+	    return -1;
+    rp->rio_cnt += n;
+    return n;
+}
+
 /*
  * rio_readinitb - Associate a descriptor with a read buffer and reset buffer
  */
 /* $begin rio_readinitb */
 void rio_readinitb(rio_t *rp, int fd) 
+{
+    rio_readinitb_n(rp, fd, RIO_BUFSIZE);
+}
+/* $end rio_readinitb */
+
+/*
+ * rio_readinitb_n - rio_readinitb with a bufsize-byte read buffer, which
+ *    is allocated here and released with rio_freeb
+ */
+void rio_readinitb_n(rio_t *rp, int fd, size_t bufsize)
+{
+    rp->rio_buf = Malloc(bufsize);
+    rp->rio_bufsize = bufsize;
+    rio_resetb(rp, fd);
+}
+
+/*
+ * rio_resetb - associate another descriptor with rp, keeping its buffer
+ *    and dropping whatever was left unread in it
+ */
+void rio_resetb(rio_t *rp, int fd)
 {
     rp->rio_fd = fd;  
     rp->rio_cnt = 0;  
     rp->rio_bufptr = rp->rio_buf;
 }
-/* $end rio_readinitb */
+
+/*
+ * rio_freeb - release the read buffer of rp
+ */
+void rio_freeb(rio_t *rp)
+{
+    free(rp->rio_buf);
+    rp->rio_buf = rp->rio_bufptr = NULL;
+    rp->rio_cnt = 0;
+}
 
 /*
  * rio_readnb - Robustly read n bytes (buffered)
@@ -649,32 +769,78 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 /* $end rio_readnb */
 
 /* 
- * rio_readlineb - robustly read a text line (buffered)
+ * rio_readlineb - robustly read a text line (buffered). Each buffered
+ *    chunk is searched with memchr and copied out at once, rather than
+ *    read a byte at a time. Returns the number of bytes stored before
+ *    the terminating NUL, 0 on EOF before any data, -1 on error.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-	if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n')
-		break;
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* error */
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *nl = NULL;
+
+    if (maxlen == 0)
+	return 0;
+    while (n + 1 < maxlen && !nl) {
+	if (rp->rio_cnt <= 0) {
+	    if ((rc = rio_fill(rp)) < 0)
+		return -1;	  /* error */
+	    else if (rc == 0)
+		break;    /* EOF, n bytes were read */
+	}
+	cnt = maxlen - 1 - n;
+	if (rp->rio_cnt < cnt)
+	    cnt = rp->rio_cnt;
+	if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+	    cnt = nl - rp->rio_bufptr + 1;
+	memcpy(bufp + n, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	n += cnt;
     }
-    *bufp = 0;
+    bufp[n] = 0;
     return n;
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_readlinep - read a text line without copying it (buffered). Sets
+ *    *linep to the line, '\n' included, inside the internal buffer, where
+ *    it stays valid until the next read from rp, and returns its length,
+ *    0 on EOF, -1 on error. The line is not NUL-terminated; one longer
+ *    than the buffer comes back in pieces of rp->rio_bufsize bytes
+ *    (RIO_BUFSIZE unless set by rio_readinitb_n).
+ */
+ssize_t rio_readlinep(rio_t *rp, char **linep)
+{
+    int scanned = 0, cnt;
+    ssize_t rc;
+    char *nl;
+
+    for (;;) {
+	if (rp->rio_cnt > scanned &&
+	    (nl = memchr(rp->rio_bufptr + scanned, '\n',
+			 rp->rio_cnt - scanned)) != NULL) {
+	    cnt = nl - rp->rio_bufptr + 1;
+	    break;
+	}
+	if (rp->rio_cnt > 0)
+	    scanned = rp->rio_cnt;  /* no need to search it again */
+	if ((rc = rio_fill(rp)) < 0)
+	    return -1;
+	else if (rc == 0) {  /* EOF, or a full buffer with no '\n' */
+	    cnt = rp->rio_cnt;
+	    break;
+	}
+    }
+    *linep = rp->rio_bufptr;
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    return cnt;
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -689,8 +855,20 @@ ssize_t Rio_readn(int fd, void *ptr, size_t nbytes)
 
 void Rio_writen(int fd, void *usrbuf, size_t n) 
 {
-    if (rio_writen(fd, usrbuf, n) != n)
+    if (rio_writen(fd, usrbuf, n) != n) {
+	if (errno == EPIPE || errno == ECONNRESET) /* client went away */
+	    return;
 	unix_error("Rio_writen error");
+    }
+}
+
+void Rio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    if (rio_writev(fd, iov, iovcnt) < 0) {
+	if (errno == EPIPE || errno == ECONNRESET) /* client went away */
+	    return;
+	unix_error("Rio_writev error");
+    }
 }
 
 void Rio_readinitb(rio_t *rp, int fd)
@@ -711,11 +889,35 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 {
     ssize_t rc;
 
-    if ((rc = rio_readlineb(rp, usrbuf, maxlen)) < 0)
+    if ((rc = rio_readlineb(rp, usrbuf, maxlen)) < 0) {
+	/* Client went away, or stayed idle past SO_RCVTIMEO: same as EOF */
+	if (errno == ECONNRESET || errno == EAGAIN || errno == EWOULDBLOCK)
+	    return 0;
 	unix_error("Rio_readlineb error");
+    }
     return rc;
 } 
 
+ssize_t Rio_readlinep(rio_t *rp, char **linep)
+{
+    ssize_t rc;
+
+    if ((rc = rio_readlinep(rp, linep)) < 0)
+	unix_error("Rio_readlinep error");
+    return rc;
+}
+
+void Rio_batchflush(int fd, rio_batch_t *bp)
+{
+    size_t len = bp->len;
+
+    if (rio_batchflush(fd, bp) != len) {
+	if (errno == EPIPE || errno == ECONNRESET) /* client went away */
+	    return;
+	unix_error("Rio_batchflush error");
+    }
+}
+
 /******************************** 
  * Client/server helper functions
  ********************************/
@@ -23,6 +23,7 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
 
 
 /* Default file permissions are DEF_MODE & ~DEF_UMASK */
@@ -38,15 +39,24 @@ typedef struct sockaddr SA;
 
 /* Persistent state for the robust I/O (Rio) package */
 /* $begin rio_t */
-#define RIO_BUFSIZE 8192
+#define RIO_BUFSIZE 8192       /* default size of the internal buf */
 typedef struct {
     int rio_fd;                /* descriptor for this internal buf */
     int rio_cnt;               /* unread bytes in internal buf */
     char *rio_bufptr;          /* next unread byte in internal buf */
-    char rio_buf[RIO_BUFSIZE]; /* internal buffer */
+    char *rio_buf;             /* internal buffer, freed by rio_freeb */
+    size_t rio_bufsize;        /* its size */
 } rio_t;
 /* $end rio_t */
 
+/* Pieces of one message, gathered to go out in a single writev */
+#define RIO_MAXIOV 16
+typedef struct {
+    struct iovec iov[RIO_MAXIOV];
+    int cnt;                   /* pieces gathered */
+    size_t len;                /* their total length */
+} rio_batch_t;
+
 /* External variables */
 extern int h_errno;    /* defined by BIND for DNS errors */ 
 extern char **environ; /* defined by libc */
@@ -145,16 +155,27 @@ void V(sem_t *sem);
 /* Rio (Robust I/O) package */
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt);
 void rio_readinitb(rio_t *rp, int fd); 
+void rio_readinitb_n(rio_t *rp, int fd, size_t bufsize);
+void rio_resetb(rio_t *rp, int fd);
+void rio_freeb(rio_t *rp);
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t	rio_readlinep(rio_t *rp, char **linep);
+void rio_batchinit(rio_batch_t *bp);
+int rio_batchadd(rio_batch_t *bp, void *buf, size_t n);
+ssize_t rio_batchflush(int fd, rio_batch_t *bp);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
 void Rio_writen(int fd, void *usrbuf, size_t n);
+void Rio_writev(int fd, struct iovec *iov, int iovcnt);
 void Rio_readinitb(rio_t *rp, int fd); 
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t Rio_readlinep(rio_t *rp, char **linep);
+void Rio_batchflush(int fd, rio_batch_t *bp);
 
 /* Client/server helper functions */
 int open_clientfd(char *hostname, int portno);
@@ -0,0 +1,219 @@
+/*
+ * fcache.c - open file descriptors and stat results of static files
+ *
+ * fc_open hands out an entry holding an open descriptor and the stat
+ * of a regular file, so that a file served again does not pay for an
+ * open, a stat and an mmap each time. An entry is trusted for FC_VALID
+ * seconds; after that the next fc_open stats the path again and, if
+ * the inode, size or mtime changed, opens the file afresh. An entry
+ * that is replaced while a request still sends from it stays open
+ * until that request calls fc_close, so the request sends the file it
+ * announced the size of.
+ *
+ * A file of up to FC_INLINE bytes is also kept in memory, after the
+ * response headers the server sends with it (fc_fill), so that a hit
+ * on it is one write of a buffer that is ready to go. As the headers
+ * say whether the connection stays open, there is a response for each
+ * case, built the first time it is needed.
+ */
+#include "fcache.h"
+
+static fc_entry *table[FC_ENTRIES];
+static long long ticks;        /* counts fc_open calls */
+static sem_t mutex;            /* protects table and the entries' refs */
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void fc_init(void)
+{
+    Sem_init(&mutex, 0, 1);
+}
+
+static unsigned hash_name(char *s)
+{
+    unsigned h = 5381;
+
+    while (*s)
+	h = h * 33 + (unsigned char)*s++;
+    return h;
+}
+
+static int changed(struct stat *old, struct stat *new)
+{
+    return old->st_ino != new->st_ino || old->st_dev != new->st_dev ||
+	old->st_size != new->st_size ||
+	old->st_mtim.tv_sec != new->st_mtim.tv_sec ||
+	old->st_mtim.tv_nsec != new->st_mtim.tv_nsec;
+}
+
+static void free_entry(fc_entry *e)
+{
+    Close(e->fd);
+    if (e->resp[0])
+	Free(e->resp[0]);
+    if (e->resp[1])
+	Free(e->resp[1]);
+    Free(e->name);
+    Free(e);
+}
+
+/* Remove table[i]; callers must hold mutex */
+static void drop(int i)
+{
+    fc_entry *e = table[i];
+
+    table[i] = NULL;
+    e->dead = 1;
+    if (!e->refs)
+	free_entry(e);
+}
+
+/* Look filename up, revalidating the entry if it is older than FC_VALID */
+static fc_entry *lookup(char *filename, unsigned hash, time_t now)
+{
+    struct stat st;
+    fc_entry *e;
+    int i;
+
+    for (i = 0; i < FC_ENTRIES; i++) {
+	e = table[i];
+	if (!e || e->hash != hash || strcmp(e->name, filename))
+	    continue;
+	if (now - e->checked >= FC_VALID) {
+	    if (stat(filename, &st) < 0 || changed(&e->st, &st)) {
+		drop(i);
+		return NULL;
+	    }
+	    e->checked = now;
+	}
+	return e;
+    }
+    return NULL;
+}
+
+/*
+ * fc_open - return the entry for the regular file filename with one more
+ *     reference, or NULL if it cannot be opened or is not a regular file
+ */
+fc_entry *fc_open(char *filename)
+{
+    unsigned hash = hash_name(filename);
+    time_t now = time(NULL);
+    struct stat st;
+    fc_entry *e;
+    int fd, i, slot;
+
+    pthread_once(&once, fc_init);
+    P(&mutex);
+    if ((e = lookup(filename, hash, now)) != NULL) {
+	e->refs++;
+	e->used = ++ticks;
+	V(&mutex);
+	return e;
+    }
+    V(&mutex);
+
+    /* Miss: open the file without holding up the other threads */
+    if ((fd = open(filename, O_RDONLY)) < 0)
+	return NULL;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+	Close(fd);
+	return NULL;
+    }
+    if (st.st_size >= FC_ADVISE) /* read ahead harder, it is sent in order */
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    e = Malloc(sizeof(fc_entry));
+    e->name = Malloc(strlen(filename) + 1);
+    strcpy(e->name, filename);
+    e->hash = hash;
+    e->fd = fd;
+    e->st = st;
+    e->checked = now;
+    e->refs = 1;
+    e->dead = 0;
+    e->resp[0] = e->resp[1] = NULL;
+    e->resp_len[0] = e->resp_len[1] = 0;
+
+    /* Take an empty slot, or the least recently used one */
+    P(&mutex);
+    e->used = ++ticks;
+    for (slot = 0, i = 0; i < FC_ENTRIES; i++) {
+	if (!table[i]) {
+	    slot = i;
+	    break;
+	}
+	if (table[i]->used < table[slot]->used)
+	    slot = i;
+    }
+    if (table[slot])
+	drop(slot);
+    table[slot] = e;
+    V(&mutex);
+    return e;
+}
+
+/*
+ * fc_close - give back a reference taken by fc_open; NULL is ignored
+ */
+void fc_close(fc_entry *e)
+{
+    if (!e)
+	return;
+    P(&mutex);
+    if (--e->refs == 0 && e->dead)
+	free_entry(e);
+    V(&mutex);
+}
+
+/*
+ * fc_response - return the response fc_fill built for e and keepalive,
+ *     and set *len to its size, or return NULL if there is none yet
+ */
+char *fc_response(fc_entry *e, int keepalive, int *len)
+{
+    char *resp;
+
+    P(&mutex);
+    resp = e->resp[keepalive];
+    *len = e->resp_len[keepalive];
+    V(&mutex);
+    return resp;
+}
+
+/*
+ * fc_fill - keep the response headers hdr followed by the whole file as
+ *     e's response for keepalive and return it as fc_response does.
+ *     Return NULL if the file is larger than FC_INLINE or cannot be read
+ *     in full.
+ */
+char *fc_fill(fc_entry *e, int keepalive, char *hdr, int hdrlen, int *len)
+{
+    int size = e->st.st_size, done = 0, n;
+    char *resp;
+
+    if (size > FC_INLINE)
+	return NULL;
+    resp = Malloc(hdrlen + size);
+    memcpy(resp, hdr, hdrlen);
+    while (done < size) {
+	if ((n = pread(e->fd, resp + hdrlen + done, size - done, done)) <= 0) {
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    Free(resp);
+	    return NULL;
+	}
+	done += n;
+    }
+
+    /* Another thread may have got there first; keep its copy */
+    P(&mutex);
+    if (!e->resp[keepalive]) {
+	e->resp[keepalive] = resp;
+	e->resp_len[keepalive] = hdrlen + size;
+    }
+    else
+	Free(resp);
+    resp = e->resp[keepalive];
+    *len = e->resp_len[keepalive];
+    V(&mutex);
+    return resp;
+}
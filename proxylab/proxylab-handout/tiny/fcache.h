@@ -0,0 +1,30 @@
+#ifndef __FCACHE_H__
+#define __FCACHE_H__
+
+#include "csapp.h"
+
+#define FC_ENTRIES 64        /* files kept open at once */
+#define FC_VALID   1         /* seconds an entry is trusted without a stat */
+#define FC_ADVISE  (1 << 20) /* files this large get page cache hints */
+#define FC_INLINE  16384     /* files this small are kept as a response */
+
+/* An open file and what stat said about it */
+typedef struct {
+    char *name;        /* path as passed to fc_open */
+    unsigned hash;     /* of name */
+    int fd;
+    struct stat st;    /* does not change while the entry is open */
+    time_t checked;    /* last time st was compared with the file */
+    long long used;    /* fc_open clock, for LRU replacement */
+    int refs;          /* fc_open calls not yet matched by fc_close */
+    int dead;          /* dropped from the table, freed at refs == 0 */
+    char *resp[2];     /* headers and body in one buffer, see fc_fill; */
+    int resp_len[2];   /* one response to close with, one to keep alive */
+} fc_entry;
+
+fc_entry *fc_open(char *filename);
+void fc_close(fc_entry *e);
+char *fc_response(fc_entry *e, int keepalive, int *len);
+char *fc_fill(fc_entry *e, int keepalive, char *hdr, int hdrlen, int *len);
+
+#endif /* __FCACHE_H__ */
@@ -49,4 +49,3 @@ int sbuf_remove(sbuf_t *sp)
 }
 /* $end sbuf_remove */
 /* $end sbufc */
-
@@ -1,109 +1,520 @@
 /* $begin tinymain */
 /*
- * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the 
+ * tiny.c - A simple, iterative HTTP/1.1 Web server that uses the 
  *     GET method to serve static and dynamic content.
+ *
+ *     Connections persist, with pipelined requests answered in order,
+ *     unless the client asks to close them, they serve CGI output, or
+ *     they sit idle for IDLE_TIMEOUT seconds.
+ *
+ *     Static files carry an ETag and Last-Modified, so a client can
+ *     revalidate them (304) or ask for byte ranges of them (206).
+ *
+ *     With -m, the same doit() serves clients concurrently from a
+ *     pool of threads, a pool of preforked processes, or an epoll
+ *     loop, so that one slow client does not hold up the others.
+ *
+ *     Static files are sent with sendfile() from a cache of open
+ *     descriptors (fcache.c), and small ones as a single write of a
+ *     response kept in memory; -s mmap selects the original path that
+ *     maps the file for every request.
+ *
+ *     CGI programs declared with -c, which loop on tcgi_accept
+ *     (cgi-bin/tcgi.h), are kept running as workers (cgipool.c);
+ *     others are started with posix_spawn for each request.
  */
+#define _GNU_SOURCE /* strcasestr, strptime, timegm */
 #include "csapp.h"
+#include "sbuf.h"
+#include "fcache.h"
+#include "cgipool.h"
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/sendfile.h>
+#include <netinet/tcp.h>
 
-void doit(int fd);
-void read_requesthdrs(rio_t *rp);
+#define NWORKERS  8   /* default threads or processes with -m */
+#define SBUFSIZE  64  /* connections queued for the thread pool */
+#define MAXEVENTS 64  /* epoll events handled per wakeup */
+#define MIMESLOTS 64  /* hash slots for mime_types, a power of two */
+#define IDLE_TIMEOUT 5 /* seconds a persistent connection may sit idle */
+#define MAXRANGES 16  /* ranges served from one Range header */
+
+/* What read_requesthdrs found in the request headers */
+typedef struct {
+    int keepalive;         /* keep the connection after the response */
+    char range[MAXLINE];   /* value of Range, "" if none */
+    char ifrange[MAXLINE]; /* value of If-Range, "" if none */
+    char inm[MAXLINE];     /* value of If-None-Match, "" if none */
+    time_t ims;            /* If-Modified-Since, -1 if none */
+} reqhdrs_t;
+
+/* Bytes asked for by a Range header */
+typedef struct {
+    off_t start, len;
+} range_t;
+
+/* A connection waiting for its next request under -m epoll */
+typedef struct {
+    rio_t rio;             /* pipelined requests read ahead stay here */
+    time_t last;           /* when it last sent a request */
+} conn_t;
+
+sbuf_t sbuf; /* connected descriptors for the thread pool */
+int use_mmap; /* -s mmap: serve static files with serve_static */
+size_t rio_size = RIO_BUFSIZE; /* -b: read buffer of each connection */
+conn_t **conns; /* -m epoll connections, by descriptor */
+int nconns;     /* size of conns */
+
+void serve_iterative(int listenfd);
+void serve_threads(int listenfd, int nworkers);
+void *worker(void *vargp);
+void serve_prefork(int listenfd, int nworkers);
+void spawn_worker(int listenfd);
+void serve_epoll(int listenfd);
+void open_conn(int epfd, int fd);
+void close_conn(int epfd, int fd);
+int request_ready(conn_t *c);
+void usage(char *prog);
+void serve_conn(int fd);
+int doit(int fd, rio_t *rp);
+void read_requesthdrs(rio_t *rp, char *version, reqhdrs_t *hdrs);
+time_t parse_date(char *date);
 int parse_uri(char *uri, char *filename, char *cgiargs);
-void serve_static(int fd, char *filename, int filesize);
-void get_filetype(char *filename, char *filetype);
+void serve_static(int fd, char *filename, struct stat *st, int keepalive);
+int serve_sendfile(int fd, char *filename, fc_entry *fe, int keepalive);
+int send_range(int fd, fc_entry *fe, char *srcp, off_t start, off_t len);
+int static_header(char *buf, char *filename, struct stat *st, int keepalive);
+void make_etag(char *buf, struct stat *st);
+void http_date(char *buf, time_t t);
+int not_modified(struct stat *st, reqhdrs_t *hdrs);
+void serve_not_modified(int fd, struct stat *st, int keepalive);
+int parse_ranges(reqhdrs_t *hdrs, struct stat *st, range_t *ranges);
+int serve_ranges(int fd, char *filename, struct stat *st, fc_entry *fe,
+		 range_t *ranges, int nranges, int keepalive);
+void mime_init(void);
+char *get_filetype(char *filename);
 void serve_dynamic(int fd, char *filename, char *cgiargs);
 void clienterror(int fd, char *cause, char *errnum, 
-		 char *shortmsg, char *longmsg);
+		 char *shortmsg, char *longmsg, int keepalive);
 
 int main(int argc, char **argv) 
 {
-    int listenfd, connfd, port, clientlen;
-    struct sockaddr_in clientaddr;
+    int listenfd, port, c, nworkers = NWORKERS;
+    char *mode = "iterative";
 
     /* Check command line args */
-    if (argc != 2) {
-	fprintf(stderr, "usage: %s <port>\n", argv[0]);
-	exit(1);
+    while ((c = getopt(argc, argv, "b:c:m:n:s:w:")) != -1) {
+	switch (c) {
+	case 'b': rio_size = atol(optarg); break;
+	case 'c':
+	    if (cgi_declare(optarg) < 0)
+		usage(argv[0]);
+	    break;
+	case 'm': mode = optarg; break;
+	case 'n': nworkers = atoi(optarg); break;
+	case 's':
+	    if (!strcmp(optarg, "mmap"))
+		use_mmap = 1;
+	    else if (strcmp(optarg, "sendfile"))
+		usage(argv[0]);
+	    break;
+	case 'w': cgi_workers = atoi(optarg); break;
+	default:  usage(argv[0]);
+	}
     }
-    port = atoi(argv[1]);
+    if (optind != argc - 1 || nworkers < 1 || (long)rio_size < 1)
+	usage(argv[0]);
+    port = atoi(argv[optind]);
 
+    /* A client that leaves before its response is sent is not an error */
+    Signal(SIGPIPE, SIG_IGN);
+
+    mime_init();
     listenfd = Open_listenfd(port);
+    if (!strcmp(mode, "iterative"))
+	serve_iterative(listenfd);
+    else if (!strcmp(mode, "threads"))
+	serve_threads(listenfd, nworkers);
+    else if (!strcmp(mode, "prefork"))
+	serve_prefork(listenfd, nworkers);
+    else if (!strcmp(mode, "epoll"))
+	serve_epoll(listenfd);
+    usage(argv[0]);
+    return 0;
+}
+/* $end tinymain */
+
+/*
+ * serve_iterative - accept a connection and serve it to completion,
+ *     then accept the next
+ */
+void serve_iterative(int listenfd)
+{
+    int connfd, clientlen;
+    struct sockaddr_in clientaddr;
+
     while (1) {
 	clientlen = sizeof(clientaddr);
 	connfd = Accept(listenfd, (SA *)&clientaddr, (socklen_t *)&clientlen);
-	doit(connfd);
+	serve_conn(connfd);
 	Close(connfd);
     }
 }
-/* $end tinymain */
 
 /*
- * doit - handle one HTTP request/response transaction
+ * serve_threads - the main thread accepts connections and a pool of
+ *     nworkers threads serves them
+ */
+void serve_threads(int listenfd, int nworkers)
+{
+    int i, connfd, clientlen;
+    struct sockaddr_in clientaddr;
+    pthread_t tid;
+
+    sbuf_init(&sbuf, SBUFSIZE);
+    for (i = 0; i < nworkers; i++)
+	Pthread_create(&tid, NULL, worker, NULL);
+    while (1) {
+	clientlen = sizeof(clientaddr);
+	connfd = Accept(listenfd, (SA *)&clientaddr, (socklen_t *)&clientlen);
+	sbuf_insert(&sbuf, connfd);
+    }
+}
+
+void *worker(void *vargp)
+{
+    Pthread_detach(pthread_self());
+    while (1) {
+	int connfd = sbuf_remove(&sbuf);
+	serve_conn(connfd);
+	Close(connfd);
+    }
+    return NULL;
+}
+
+/*
+ * serve_prefork - nworkers processes each accept and serve connections
+ *     on the shared listening socket. The parent replaces any that die.
+ */
+void serve_prefork(int listenfd, int nworkers)
+{
+    int i;
+
+    for (i = 0; i < nworkers; i++)
+	spawn_worker(listenfd);
+    while (1) {
+	Wait(NULL); /* a worker died: start another */
+	spawn_worker(listenfd);
+    }
+}
+
+void spawn_worker(int listenfd)
+{
+    if (Fork() == 0) {
+	prctl(PR_SET_PDEATHSIG, SIGTERM); /* go away with the parent */
+	serve_iterative(listenfd);
+    }
+}
+
+/*
+ * serve_epoll - a single thread watches all connections with epoll and
+ *     runs doit on each once its whole request has arrived, so clients
+ *     that are slow to send a request hold up nobody. doit still writes
+ *     the response with blocking calls.
+ */
+void serve_epoll(int listenfd)
+{
+    int epfd, n, i, fd, clientlen, ready;
+    struct sockaddr_in clientaddr;
+    struct epoll_event ev, events[MAXEVENTS];
+    time_t now, swept = 0;
+    conn_t *c;
+
+    if ((epfd = epoll_create1(0)) < 0)
+	unix_error("epoll_create1 error");
+    ev.events = EPOLLIN;
+    ev.data.fd = listenfd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+	unix_error("epoll_ctl error");
+
+    while (1) {
+	if ((n = epoll_wait(epfd, events, MAXEVENTS, 1000)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    unix_error("epoll_wait error");
+	}
+	now = time(NULL);
+	for (i = 0; i < n; i++) {
+	    fd = events[i].data.fd;
+	    if (fd == listenfd) {
+		clientlen = sizeof(clientaddr);
+		if ((fd = accept(listenfd, (SA *)&clientaddr,
+				 (socklen_t *)&clientlen)) >= 0)
+		    open_conn(epfd, fd);
+		continue;
+	    }
+
+	    /* Answer every complete request, pipelined ones included */
+	    c = conns[fd];
+	    while ((ready = request_ready(c)) > 0 && doit(fd, &c->rio))
+		c->last = now;
+	    if (ready != 0) /* closed, or not to be kept */
+		close_conn(epfd, fd);
+	}
+
+	/* Once a second, close the connections idle for too long */
+	if (now != swept) {
+	    for (fd = 0; fd < nconns; fd++)
+		if (conns[fd] && now - conns[fd]->last >= IDLE_TIMEOUT)
+		    close_conn(epfd, fd);
+	    swept = now;
+	}
+    }
+}
+
+/* Watch the new connection fd */
+void open_conn(int epfd, int fd)
+{
+    struct epoll_event ev;
+    int one = 1;
+
+    if (fd >= nconns) {
+	int n = nconns ? nconns : 64;
+	while (n <= fd)
+	    n *= 2;
+	conns = Realloc(conns, n * sizeof(conn_t *));
+	memset(conns + nconns, 0, (n - nconns) * sizeof(conn_t *));
+	nconns = n;
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+	Close(fd);
+	return;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    conns[fd] = Malloc(sizeof(conn_t));
+    rio_readinitb_n(&conns[fd]->rio, fd, rio_size);
+    conns[fd]->last = time(NULL);
+}
+
+/* Stop watching connection fd and close it */
+void close_conn(int epfd, int fd)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    Close(fd);
+    rio_freeb(&conns[fd]->rio);
+    Free(conns[fd]);
+    conns[fd] = NULL;
+}
+
+/*
+ * request_ready - return 1 once a whole request line and headers have
+ *     arrived on c, read ahead into its buffer or still in the socket
+ *     (or they fill a buffer), 0 if they have not yet, and -1 if the
+ *     client closed the connection without sending them
+ */
+int request_ready(conn_t *c)
+{
+    char buf[MAXBUF];
+    int n, have = c->rio.rio_cnt;
+
+    if (have > (int)sizeof(buf) - 1) /* -b larger than buf */
+	have = sizeof(buf) - 1;
+    memcpy(buf, c->rio.rio_bufptr, have);
+    n = recv(c->rio.rio_fd, buf + have, sizeof(buf) - 1 - have,
+	     MSG_PEEK | MSG_DONTWAIT);
+    if (n < 0) {
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
+	    return -1;
+	n = 0;
+    }
+    else if (n == 0 && !have)
+	return -1;
+    buf[have + n] = '\0';
+    return (strstr(buf, "\r\n\r\n") || have + n == sizeof(buf) - 1) ? 1 : 0;
+}
+
+void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-m iterative|threads|prefork|epoll] "
+	    "[-n workers]\n"
+	    "       [-s sendfile|mmap] [-c cgi_program]... [-w cgi_workers]\n"
+	    "       [-b bufsize] <port>\n",
+	    prog);
+    fprintf(stderr, "  -m  how to serve concurrent clients (default iterative)\n");
+    fprintf(stderr, "  -n  threads or processes for -m threads|prefork "
+	    "(default %d)\n", NWORKERS);
+    fprintf(stderr, "  -s  how to send static files (default sendfile)\n");
+    fprintf(stderr, "  -c  CGI program that speaks cgi-bin/tcgi.h, such as "
+	    "cgi-bin/adder,\n      to keep as workers (up to %d)\n", CGI_PROGS);
+    fprintf(stderr, "  -w  workers kept per CGI program, 0 to run one per "
+	    "request (default %d)\n", CGI_WORKERS);
+    fprintf(stderr, "  -b  read buffer per connection in bytes (default %d)\n",
+	    RIO_BUFSIZE);
+    exit(1);
+}
+
+/*
+ * serve_conn - serve the requests on connection fd, one after another
+ *     or pipelined, until doit says the connection is done
+ */
+void serve_conn(int fd)
+{
+    rio_t rio;
+    struct timeval idle = { IDLE_TIMEOUT, 0 };
+    int one = 1;
+
+    /* Reads time out on an idle connection; answers go out unbatched */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    rio_readinitb_n(&rio, fd, rio_size);
+    while (doit(fd, &rio))
+	;
+    rio_freeb(&rio);
+}
+
+/*
+ * doit - handle one HTTP request/response transaction, reading the
+ *     request through rp; return 1 if the connection stays open for
+ *     another request, 0 if it is to be closed
  */
 /* $begin doit */
-void doit(int fd) 
+int doit(int fd, rio_t *rp) 
 {
-    int is_static;
-    struct stat sbuf;
+    int is_static, nranges, rc = 0;
+    struct stat st;
     char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
     char filename[MAXLINE], cgiargs[MAXLINE];
-    rio_t rio;
+    reqhdrs_t hdrs;
+    range_t ranges[MAXRANGES];
+    fc_entry *fe = NULL;
   
     /* Read request line and headers */
-    Rio_readinitb(&rio, fd);
-    Rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%s %s %s", method, uri, version);
+    if (Rio_readlineb(rp, buf, MAXLINE) <= 0) /* closed, or idle too long */
+	return 0;
+    if (!strcmp(buf, "\r\n")) /* stray CRLF after the last request */
+	return 1;
+    if (sscanf(buf, "%s %s %s", method, uri, version) != 3) {
+	clienterror(fd, buf, "400", "Bad Request",
+		    "Tiny couldn't parse the request", 0);
+	return 0;
+    }
+    read_requesthdrs(rp, version, &hdrs);
     if (strcasecmp(method, "GET")) { 
        clienterror(fd, method, "501", "Not Implemented",
-                "Tiny does not implement this method");
-        return;
+                "Tiny does not implement this method", 0);
+        return 0; /* a body we cannot skip may follow */
     }
-    read_requesthdrs(&rio);
 
     /* Parse URI from GET request */
     is_static = parse_uri(uri, filename, cgiargs);
-    if (stat(filename, &sbuf) < 0) {
+    if (is_static && !use_mmap)
+	fe = fc_open(filename); /* NULL: fall back to stat and mmap */
+    if (fe)
+	st = fe->st;
+    else if (stat(filename, &st) < 0) {
 	clienterror(fd, filename, "404", "Not found",
-		    "Tiny couldn't find this file");
-	return;
+		    "Tiny couldn't find this file", hdrs.keepalive);
+	return hdrs.keepalive;
     }
 
     if (is_static) { /* Serve static content */
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
+	if (!(S_ISREG(st.st_mode)) || !(S_IRUSR & st.st_mode)) {
 	    clienterror(fd, filename, "403", "Forbidden",
-			"Tiny couldn't read the file");
-	    return;
+			"Tiny couldn't read the file", hdrs.keepalive);
+	    fc_close(fe);
+	    return hdrs.keepalive;
 	}
-	serve_static(fd, filename, sbuf.st_size);
+	if (not_modified(&st, &hdrs))
+	    serve_not_modified(fd, &st, hdrs.keepalive);
+	else if ((nranges = parse_ranges(&hdrs, &st, ranges)) != 0)
+	    rc = serve_ranges(fd, filename, &st, fe, ranges, nranges,
+			      hdrs.keepalive);
+	else if (fe)
+	    rc = serve_sendfile(fd, filename, fe, hdrs.keepalive);
+	else
+	    serve_static(fd, filename, &st, hdrs.keepalive);
+	fc_close(fe);
+	return rc < 0 ? 0 : hdrs.keepalive; /* a cut-short body ends it */
     }
     else { /* Serve dynamic content */
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
+	if (!(S_ISREG(st.st_mode)) || !(S_IXUSR & st.st_mode)) {
 	    clienterror(fd, filename, "403", "Forbidden",
-			"Tiny couldn't run the CGI program");
-	    return;
+			"Tiny couldn't run the CGI program", hdrs.keepalive);
+	    return hdrs.keepalive;
 	}
 	serve_dynamic(fd, filename, cgiargs);
+	return 0; /* the end of CGI output is the end of the connection */
     }
 }
 /* $end doit */
 
 /*
- * read_requesthdrs - read and parse HTTP request headers
+ * read_requesthdrs - read HTTP request headers and fill in hdrs from the
+ *     ones Tiny acts on; version is from the request line
  */
 /* $begin read_requesthdrs */
-void read_requesthdrs(rio_t *rp) 
+void read_requesthdrs(rio_t *rp, char *version, reqhdrs_t *hdrs) 
 {
-    char buf[MAXLINE];
+    char buf[MAXLINE], *value;
 
-    Rio_readlineb(rp, buf, MAXLINE);
+    /* HTTP/1.1 connections persist unless the client says otherwise */
+    hdrs->keepalive = !strcasecmp(version, "HTTP/1.1");
+    hdrs->range[0] = hdrs->ifrange[0] = hdrs->inm[0] = '\0';
+    hdrs->ims = -1;
+
+    if (Rio_readlineb(rp, buf, MAXLINE) <= 0)
+	goto closed;
     printf("%s", buf);
     while(strcmp(buf, "\r\n")) {
-	Rio_readlineb(rp, buf, MAXLINE);
+	if ((value = strchr(buf, ':')) != NULL) {
+	    for (value++; *value == ' ' || *value == '\t'; value++)
+		;
+	    value[strcspn(value, "\r\n")] = '\0';
+	    if (!strncasecmp(buf, "Connection:", 11)) {
+		if (strcasestr(value, "close"))
+		    hdrs->keepalive = 0;
+		else if (strcasestr(value, "keep-alive"))
+		    hdrs->keepalive = 1;
+	    }
+	    else if (!strncasecmp(buf, "Range:", 6))
+		strcpy(hdrs->range, value);
+	    else if (!strncasecmp(buf, "If-Range:", 9))
+		strcpy(hdrs->ifrange, value);
+	    else if (!strncasecmp(buf, "If-None-Match:", 14))
+		strcpy(hdrs->inm, value);
+	    else if (!strncasecmp(buf, "If-Modified-Since:", 18))
+		hdrs->ims = parse_date(value);
+	}
+	if (Rio_readlineb(rp, buf, MAXLINE) <= 0) /* client closed early */
+	    goto closed;
 	printf("%s", buf);
     }
     return;
+
+ closed:
+    hdrs->keepalive = 0;
 }
 /* $end read_requesthdrs */
 
+/*
+ * parse_date - return the time in an HTTP date such as
+ *     "Sun, 06 Nov 1994 08:49:37 GMT", or -1 if it is not one
+ */
+time_t parse_date(char *date)
+{
+    struct tm tm;
+    char *end;
+
+    memset(&tm, 0, sizeof(tm));
+    if ((end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm)) == NULL ||
+	*end != '\0')
+	return -1;
+    return timegm(&tm);
+}
+
 /*
  * parse_uri - parse URI into filename and CGI args
  *             return 0 if dynamic content, 1 if static
@@ -140,40 +551,376 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
  * serve_static - copy a file back to the client 
  */
 /* $begin serve_static */
-void serve_static(int fd, char *filename, int filesize) 
+void serve_static(int fd, char *filename, struct stat *st, int keepalive) 
 {
-    int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
+    int srcfd, filesize = st->st_size;
+    char *srcp, buf[MAXBUF];
+    rio_batch_t out;
  
-    /* Send response headers to client */
-    get_filetype(filename, filetype);
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
-    sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
-    Rio_writen(fd, buf, strlen(buf));
-
-    /* Send response body to client */
+    /* Send response headers and body to client in one writev */
+    rio_batchinit(&out);
+    rio_batchadd(&out, buf, static_header(buf, filename, st, keepalive));
     srcfd = Open(filename, O_RDONLY, 0);
     srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
     Close(srcfd);
-    Rio_writen(fd, srcp, filesize);
+    rio_batchadd(&out, srcp, filesize);
+    Rio_batchflush(fd, &out);
     Munmap(srcp, filesize);
 }
 
 /*
- * get_filetype - derive file type from file name
+ * serve_sendfile - send a file held open by the fd cache. A small file
+ *     goes out as one write of the response the cache keeps for it;
+ *     otherwise the body goes from the page cache to the socket without
+ *     passing through tiny. Return -1 if the body was cut short.
  */
-void get_filetype(char *filename, char *filetype) 
+int serve_sendfile(int fd, char *filename, fc_entry *fe, int keepalive)
 {
-    if (strstr(filename, ".html"))
-	strcpy(filetype, "text/html");
-    else if (strstr(filename, ".gif"))
-	strcpy(filetype, "image/gif");
-    else if (strstr(filename, ".jpg"))
-	strcpy(filetype, "image/jpeg");
-    else
-	strcpy(filetype, "text/plain");
+    char *resp, buf[MAXBUF];
+    int len, hdrlen;
+
+    if ((resp = fc_response(fe, keepalive, &len)) != NULL) {
+	Rio_writen(fd, resp, len);
+	return 0;
+    }
+
+    /* Send response headers to client */
+    hdrlen = static_header(buf, filename, &fe->st, keepalive);
+    if (fe->st.st_size <= FC_INLINE &&
+	(resp = fc_fill(fe, keepalive, buf, hdrlen, &len)) != NULL) {
+	Rio_writen(fd, resp, len);
+	return 0;
+    }
+    Rio_writen(fd, buf, hdrlen);
+    return send_range(fd, fe, NULL, 0, fe->st.st_size);
+}
+
+/*
+ * send_range - send len bytes of a file from offset start: with sendfile
+ *     from the fd cache entry fe, or from srcp, the file mapped in memory,
+ *     if fe is NULL. Return -1 if the client is gone, the file shrank or
+ *     sendfile failed.
+ */
+int send_range(int fd, fc_entry *fe, char *srcp, off_t start, off_t len)
+{
+    off_t offset = start, end = start + len;
+    ssize_t n;
+
+    if (!fe) {
+	Rio_writen(fd, srcp + start, len);
+	return 0;
+    }
+
+    /* The offset keeps the shared fd's own file position out of it, */
+    /* so threads can send one file at once                           */
+    while (offset < end) {
+	if ((n = sendfile(fd, fe->fd, &offset, end - offset)) > 0)
+	    continue;
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n == 0 || errno == EPIPE || errno == ECONNRESET)
+	    return -1; /* file truncated under us, or client gone */
+	fprintf(stderr, "sendfile error: %s\n", strerror(errno));
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * static_header - write the response headers for the whole file st is
+ *     about to buf and return their length
+ */
+int static_header(char *buf, char *filename, struct stat *st, int keepalive)
+{
+    char etag[64], date[64];
+
+    make_etag(etag, st);
+    http_date(date, st->st_mtime);
+    return sprintf(buf, "HTTP/1.1 200 OK\r\n"
+		   "Server: Tiny Web Server\r\n"
+		   "Connection: %s\r\n"
+		   "Accept-Ranges: bytes\r\n"
+		   "ETag: %s\r\n"
+		   "Last-Modified: %s\r\n"
+		   "Content-length: %lld\r\n"
+		   "Content-type: %s\r\n\r\n",
+		   keepalive ? "keep-alive" : "close", etag, date,
+		   (long long)st->st_size, get_filetype(filename));
+}
+
+/*
+ * make_etag - write the entity tag of the file st is about to buf: it
+ *     changes whenever the file is replaced, resized or written to
+ */
+void make_etag(char *buf, struct stat *st)
+{
+    sprintf(buf, "\"%lx-%llx-%llx\"", (unsigned long)st->st_ino,
+	    (unsigned long long)st->st_size,
+	    (unsigned long long)st->st_mtim.tv_sec * 1000000000ULL +
+	    st->st_mtim.tv_nsec);
+}
+
+/*
+ * http_date - write t to buf as an HTTP date, the format parse_date reads
+ */
+void http_date(char *buf, time_t t)
+{
+    struct tm tm;
+
+    strftime(buf, 64, "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&t, &tm));
+}
+
+/*
+ * not_modified - return 1 if the client's copy of the file st is about
+ *     is current: its If-None-Match names our ETag or, without one, its
+ *     If-Modified-Since is no older than the file
+ */
+int not_modified(struct stat *st, reqhdrs_t *hdrs)
+{
+    char etag[64];
+
+    if (hdrs->inm[0]) {
+	make_etag(etag, st);
+	return !strcmp(hdrs->inm, "*") || strstr(hdrs->inm, etag) != NULL;
+    }
+    return hdrs->ims != -1 && st->st_mtime <= hdrs->ims;
+}
+
+/*
+ * serve_not_modified - tell the client its copy of the file is current
+ */
+void serve_not_modified(int fd, struct stat *st, int keepalive)
+{
+    char buf[MAXBUF], etag[64], date[64];
+
+    make_etag(etag, st);
+    http_date(date, st->st_mtime);
+    sprintf(buf, "HTTP/1.1 304 Not Modified\r\n"
+	    "Server: Tiny Web Server\r\n"
+	    "Connection: %s\r\n"
+	    "ETag: %s\r\n"
+	    "Last-Modified: %s\r\n\r\n",
+	    keepalive ? "keep-alive" : "close", etag, date);
+    Rio_writen(fd, buf, strlen(buf));
+}
+
+/*
+ * parse_ranges - fill ranges from the Range header in hdrs for the file
+ *     st is about. Return how many there are; -1 if none of them is in
+ *     the file; or 0 to send the whole file, because there is no Range
+ *     header, If-Range names another version of the file, or the header
+ *     cannot be parsed or asks for more than MAXRANGES ranges.
+ */
+int parse_ranges(reqhdrs_t *hdrs, struct stat *st, range_t *ranges)
+{
+    long long first, last, size = st->st_size;
+    char *p, *end, etag[64];
+    int n = 0, specs = 0;
+
+    if (strncasecmp(hdrs->range, "bytes=", 6))
+	return 0;
+    if (hdrs->ifrange[0]) {
+	make_etag(etag, st);
+	if (hdrs->ifrange[0] == '"' ? strcmp(hdrs->ifrange, etag) :
+	    parse_date(hdrs->ifrange) != st->st_mtime)
+	    return 0;
+    }
+
+    for (p = hdrs->range + 6; *p; specs++) {
+	while (*p == ' ' || *p == ',')
+	    p++;
+	if (!*p)
+	    break;
+	if (*p == '-') { /* the last bytes */
+	    last = strtoll(p + 1, &end, 10);
+	    if (end == p + 1)
+		return 0;
+	    first = (last >= size) ? 0 : size - last;
+	    last = (last > 0) ? size - 1 : -1;
+	}
+	else {
+	    first = strtoll(p, &end, 10);
+	    if (end == p || *end != '-')
+		return 0;
+	    p = end + 1;
+	    if (isdigit((unsigned char)*p)) {
+		last = strtoll(p, &end, 10);
+		if (last < first)
+		    return 0;
+	    }
+	    else
+		last = size - 1, end = p;
+	    if (last >= size)
+		last = size - 1;
+	}
+	if (first <= last && first < size) { /* in the file */
+	    if (n == MAXRANGES)
+		return 0;
+	    ranges[n].start = first;
+	    ranges[n++].len = last - first + 1;
+	}
+	for (p = end; *p == ' '; p++)
+	    ;
+	if (*p && *p != ',')
+	    return 0;
+    }
+    if (!specs)
+	return 0;
+    return n ? n : -1;
+}
+
+/* Write the header of a multipart/byteranges part to buf, return its size */
+static int part_header(char *buf, char *boundary, char *type, range_t *r,
+		       off_t size)
+{
+    return sprintf(buf, "\r\n--%s\r\n"
+		   "Content-type: %s\r\n"
+		   "Content-range: bytes %lld-%lld/%lld\r\n\r\n",
+		   boundary, type, (long long)r->start,
+		   (long long)(r->start + r->len - 1), (long long)size);
+}
+
+/*
+ * serve_ranges - answer a Range request with the nranges ranges of the
+ *     file: one range as a 206 response, several as the parts of a
+ *     multipart/byteranges body, and none (nranges is -1) with a 416.
+ *     Return -1 if a range was cut short.
+ */
+int serve_ranges(int fd, char *filename, struct stat *st, fc_entry *fe,
+		 range_t *ranges, int nranges, int keepalive)
+{
+    char buf[MAXBUF], part[MAXLINE], etag[64], date[64], boundary[32];
+    char *srcp = NULL, *type = get_filetype(filename);
+    char *conn = keepalive ? "keep-alive" : "close";
+    long long size = st->st_size, total;
+    int i, srcfd, rc = 0;
+    rio_batch_t out;
+
+    if (nranges < 0) {
+	sprintf(buf, "HTTP/1.1 416 Range Not Satisfiable\r\n"
+		"Server: Tiny Web Server\r\n"
+		"Connection: %s\r\n"
+		"Content-range: bytes */%lld\r\n"
+		"Content-length: 0\r\n\r\n", conn, size);
+	Rio_writen(fd, buf, strlen(buf));
+	return 0;
+    }
+    if (!fe) { /* -s mmap */
+	srcfd = Open(filename, O_RDONLY, 0);
+	srcp = Mmap(0, size, PROT_READ, MAP_PRIVATE, srcfd, 0);
+	Close(srcfd);
+    }
+    make_etag(etag, st);
+    http_date(date, st->st_mtime);
+    sprintf(buf, "HTTP/1.1 206 Partial Content\r\n"
+	    "Server: Tiny Web Server\r\n"
+	    "Connection: %s\r\n"
+	    "Accept-Ranges: bytes\r\n"
+	    "ETag: %s\r\n"
+	    "Last-Modified: %s\r\n", conn, etag, date);
+
+    if (nranges == 1) {
+	sprintf(buf + strlen(buf), "Content-range: bytes %lld-%lld/%lld\r\n"
+		"Content-length: %lld\r\n"
+		"Content-type: %s\r\n\r\n",
+		(long long)ranges[0].start,
+		(long long)(ranges[0].start + ranges[0].len - 1), size,
+		(long long)ranges[0].len, type);
+	if (fe) {
+	    Rio_writen(fd, buf, strlen(buf));
+	    rc = send_range(fd, fe, srcp, ranges[0].start, ranges[0].len);
+	}
+	else { /* headers and range in one writev */
+	    rio_batchinit(&out);
+	    rio_batchadd(&out, buf, strlen(buf));
+	    rio_batchadd(&out, srcp + ranges[0].start, ranges[0].len);
+	    Rio_batchflush(fd, &out);
+	}
+    }
+    else {
+	/* A boundary that the file's own bytes are unlikely to contain */
+	sprintf(boundary, "tiny-%llx", (unsigned long long)
+		(time(NULL) ^ st->st_ino ^ ((long long)st->st_size << 20)));
+	for (total = 0, i = 0; i < nranges; i++)
+	    total += part_header(part, boundary, type, &ranges[i], size) +
+		ranges[i].len;
+	total += strlen(boundary) + 8; /* "\r\n--" boundary "--\r\n" */
+	sprintf(buf + strlen(buf), "Content-length: %lld\r\n"
+		"Content-type: multipart/byteranges; boundary=%s\r\n\r\n",
+		total, boundary);
+	Rio_writen(fd, buf, strlen(buf));
+	for (i = 0; i < nranges; i++) {
+	    Rio_writen(fd, buf, part_header(buf, boundary, type, &ranges[i],
+					    size));
+	    if ((rc = send_range(fd, fe, srcp, ranges[i].start,
+				 ranges[i].len)) < 0)
+		break;
+	}
+	if (i == nranges) {
+	    sprintf(buf, "\r\n--%s--\r\n", boundary);
+	    Rio_writen(fd, buf, strlen(buf));
+	}
+    }
+    if (srcp)
+	Munmap(srcp, size);
+    return rc;
+}
+
+/* File name extensions and their MIME types, looked up by get_filetype */
+struct {
+    char *ext, *type;
+} mime_types[] = {
+    { "html", "text/html" },       { "htm", "text/html" },
+    { "css", "text/css" },         { "js", "application/javascript" },
+    { "json", "application/json" }, { "txt", "text/plain" },
+    { "gif", "image/gif" },        { "jpg", "image/jpeg" },
+    { "jpeg", "image/jpeg" },      { "png", "image/png" },
+    { "svg", "image/svg+xml" },    { "ico", "image/x-icon" },
+    { "pdf", "application/pdf" },  { "mpg", "video/mpeg" },
+    { "mp4", "video/mp4" },        { NULL, NULL }
+};
+int mime_table[MIMESLOTS]; /* index + 1 into mime_types, 0 if empty */
+
+static unsigned mime_hash(char *ext)
+{
+    unsigned h = 5381;
+
+    while (*ext)
+	h = h * 33 + tolower((unsigned char)*ext++);
+    return h & (MIMESLOTS - 1);
+}
+
+/*
+ * mime_init - hash mime_types into mime_table, with linear probing
+ */
+void mime_init(void)
+{
+    unsigned h;
+    int i;
+
+    for (i = 0; mime_types[i].ext; i++) {
+	for (h = mime_hash(mime_types[i].ext); mime_table[h];
+	     h = (h + 1) & (MIMESLOTS - 1))
+	    ;
+	mime_table[h] = i + 1;
+    }
+}
+
+/*
+ * get_filetype - derive file type from file name extension
+ */
+char *get_filetype(char *filename) 
+{
+    char *ext = strrchr(filename, '.');
+    unsigned h;
+
+    if (!ext || strchr(ext, '/')) /* no extension on the last component */
+	return "text/plain";
+    ext++;
+    for (h = mime_hash(ext); mime_table[h]; h = (h + 1) & (MIMESLOTS - 1))
+	if (!strcasecmp(mime_types[mime_table[h] - 1].ext, ext))
+	    return mime_types[mime_table[h] - 1].type;
+    return "text/plain";
 }  
 /* $end serve_static */
 
@@ -183,21 +930,16 @@ void get_filetype(char *filename, char *filetype)
 /* $begin serve_dynamic */
 void serve_dynamic(int fd, char *filename, char *cgiargs) 
 {
-    char buf[MAXLINE], *emptylist[] = { NULL };
+    char buf[MAXLINE];
 
     /* Return first part of HTTP response */
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
+    sprintf(buf, "HTTP/1.1 200 OK\r\n"
+	    "Server: Tiny Web Server\r\nConnection: close\r\n");
     Rio_writen(fd, buf, strlen(buf));
-  
-    if (Fork() == 0) { /* child */
-	/* Real server would set all CGI vars here */
-	setenv("QUERY_STRING", cgiargs, 1); 
-	Dup2(fd, STDOUT_FILENO);         /* Redirect stdout to client */
-	Execve(filename, emptylist, environ); /* Run CGI program */
-    }
-    Wait(NULL); /* Parent waits for and reaps child */
+
+    /* Real server would set all CGI vars here */
+    if (cgi_serve(fd, filename, cgiargs) < 0) /* no worker for it */
+	cgi_spawn(fd, filename, cgiargs);     /* run it just for this */
 }
 /* $end serve_dynamic */
 
@@ -206,24 +948,28 @@ void serve_dynamic(int fd, char *filename, char *cgiargs)
  */
 /* $begin clienterror */
 void clienterror(int fd, char *cause, char *errnum, 
-		 char *shortmsg, char *longmsg) 
+		 char *shortmsg, char *longmsg, int keepalive) 
 {
     char buf[MAXLINE], body[MAXBUF];
+    rio_batch_t out;
 
     /* Build the HTTP response body */
-    sprintf(body, "<html><title>Tiny Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
-
-    /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+    snprintf(body, sizeof(body), "<html><title>Tiny Error</title>"
+	     "<body bgcolor=""ffffff"">\r\n"
+	     "%s: %s\r\n"
+	     "<p>%s: %s\r\n"
+	     "<hr><em>The Tiny Web server</em>\r\n",
+	     errnum, shortmsg, longmsg, cause);
+
+    /* Print the HTTP response, headers and body in one writev */
+    sprintf(buf, "HTTP/1.1 %s %s\r\n"
+	    "Connection: %s\r\n"
+	    "Content-type: text/html\r\n"
+	    "Content-length: %d\r\n\r\n", errnum, shortmsg,
+	    keepalive ? "keep-alive" : "close", (int)strlen(body));
+    rio_batchinit(&out);
+    rio_batchadd(&out, buf, strlen(buf));
+    rio_batchadd(&out, body, strlen(body));
+    Rio_batchflush(fd, &out);
 }
 /* $end clienterror */
@@ -0,0 +1,182 @@
+#include "csapp.h"
+#include "trace.h"
+#include "metrics.h"
+
+/*
+ * trace.c - sampled per-phase request traces
+ *
+ * A worker keeps the trace of its current request on its stack and
+ * appends a span each time a phase ends. When the request is done the
+ * trace is copied into a ring of the last TRACE_RING traces. The ring is
+ * served from GET /trace, and written to TRACE_FILE on SIGUSR1, in the
+ * Chrome trace-event format (load it in chrome://tracing or Perfetto).
+ * Each request gets its own row so that queueing, which overlaps the
+ * worker's previous request, still nests correctly.
+ */
+
+int trace_sample = TRACE_SAMPLE;
+
+static char *phase_name[PH_NPHASES] = {
+    "queue", "parse", "cache", "reply", "dns", "connect", "first_byte", "relay"
+};
+
+static trace_t ring[TRACE_RING];
+static long long ring_next;   /* traces ever committed */
+static long long seq;         /* requests seen, for sampling */
+static sem_t mutex;           /* protects ring and ring_next */
+
+static void *dumper(void *vargp);
+
+/* Must run before other threads start: they inherit the blocked SIGUSR1 */
+void trace_init(void) {
+    sigset_t set;
+    pthread_t tid;
+
+    Sem_init(&mutex, 0, 1);
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    Pthread_create(&tid, NULL, dumper, NULL);
+}
+
+/* Start the trace of a request that arrived at begin (us) */
+void trace_begin(trace_t *t, int worker, long long begin) {
+    t->sampled = trace_sample > 0 &&
+                 __sync_fetch_and_add(&seq, 1) % trace_sample == 0;
+    if(!t->sampled)
+        return;
+    t->worker = worker;
+    t->begin = begin;
+    t->nspan = 0;
+    t->uri[0] = '\0';
+}
+
+/* Current time if t is sampled, else 0 */
+long long trace_mark(trace_t *t) {
+    return (t && t->sampled) ? now_us() : 0;
+}
+
+/* Record phase as running from begin until now. Return now (0 if not */
+/* sampled), which callers pass as the begin of the next phase.       */
+long long trace_span(trace_t *t, int phase, long long begin) {
+    span_t *s;
+
+    if(!t || !t->sampled)
+        return 0;
+    if(t->nspan == TRACE_MAXSPANS)
+        return now_us();
+    s = &t->span[t->nspan++];
+    s->phase = phase;
+    s->begin = begin;
+    s->end = now_us();
+    return s->end;
+}
+
+void trace_uri(trace_t *t, char *uri) {
+    if(t->sampled)
+        snprintf(t->uri, TRACE_URILEN, "%s", uri);
+}
+
+/* Finish the request and keep its trace */
+void trace_end(trace_t *t) {
+    if(!t->sampled)
+        return;
+    t->end = now_us();
+    P(&mutex);
+    ring[ring_next % TRACE_RING] = *t;
+    ring_next++;
+    V(&mutex);
+}
+
+/* Append s to buf as the body of a JSON string */
+static int json_string(char *buf, int size, char *s) {
+    int len = 0;
+
+    for(; *s && len < size - 2; s++) {
+        if(*s == '"' || *s == '\\')
+            buf[len++] = '\\';
+        buf[len++] = ((unsigned char)*s < 0x20) ? '?' : *s;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+/* Format the ring as a Chrome trace. Return a Malloc'ed buffer with */
+/* the JSON starting at offset headroom, and its length in *len.     */
+static char *format_json(int headroom, int *len) {
+    int size = headroom + 64 +
+               TRACE_RING * ((TRACE_MAXSPANS + 1) * 160 + 2 * TRACE_URILEN);
+    char *buf = Malloc(size), uri[2 * TRACE_URILEN];
+    long long i, first;
+    trace_t *t;
+    int n = headroom, j, pid = getpid();
+
+    n += stats_printf(buf + n, size - n, "{\"traceEvents\":[");
+    P(&mutex);
+    first = (ring_next > TRACE_RING) ? ring_next - TRACE_RING : 0;
+    for(i = first; i < ring_next; i++) {
+        t = &ring[i % TRACE_RING];
+        json_string(uri, sizeof(uri), t->uri);
+        n += stats_printf(buf + n, size - n,
+                          "%s\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\","
+                          "\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%lld,"
+                          "\"args\":{\"worker\":%d}}",
+                          (i == first) ? "" : ",", uri, t->begin,
+                          t->end - t->begin, pid, i, t->worker);
+        for(j = 0; j < t->nspan; j++) {
+            n += stats_printf(buf + n, size - n,
+                              ",\n{\"name\":\"%s\",\"cat\":\"phase\",\"ph\":\"X\","
+                              "\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%lld}",
+                              phase_name[t->span[j].phase], t->span[j].begin,
+                              t->span[j].end - t->span[j].begin, pid, i);
+        }
+    }
+    V(&mutex);
+    n += stats_printf(buf + n, size - n, "\n]}\n");
+    *len = n - headroom;
+    return buf;
+}
+
+/* Build the HTTP response for GET /trace in a Malloc'ed *resp. */
+/* Return its length.                                          */
+int trace_response(char **resp) {
+    char hdr[MAXLINE];
+    int  hlen, len;
+    char *buf = format_json(MAXLINE, &len);
+
+    hlen = sprintf(hdr, "HTTP/1.0 200 OK\r\nContent-type: application/json\r\n"
+                   "Content-length: %d\r\n\r\n", len);
+    memmove(buf + hlen, buf + MAXLINE, len);
+    memcpy(buf, hdr, hlen);
+    *resp = buf;
+    return hlen + len;
+}
+
+/* Write the ring to TRACE_FILE whenever SIGUSR1 arrives */
+static void *dumper(void *vargp) {
+    sigset_t set;
+    char *buf;
+    int  sig, fd, len;
+
+    Pthread_detach(pthread_self());
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    while(1) {
+        if(sigwait(&set, &sig) != 0)
+            continue;
+        buf = format_json(0, &len);
+        if((fd = open(TRACE_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+            printf("[Error] cannot write %s\n", TRACE_FILE);
+        }
+        else {
+            if(rio_writen(fd, buf, len) != len)
+                printf("[Error] short write to %s\n", TRACE_FILE);
+            close(fd);
+            printf("Wrote %lld traces to %s\n",
+                   (ring_next < TRACE_RING) ? ring_next : TRACE_RING,
+                   TRACE_FILE);
+        }
+        Free(buf);
+    }
+    return NULL;
+}
@@ -0,0 +1,49 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include "csapp.h"
+
+#define TRACE_SAMPLE    16   /* trace 1 in TRACE_SAMPLE requests by default */
+#define TRACE_RING      256  /* completed traces kept in memory */
+#define TRACE_MAXSPANS  16   /* phases recorded per request */
+#define TRACE_URILEN    128  /* prefix of the uri kept with a trace */
+#define TRACE_FILE      "proxy-trace.json"  /* written on SIGUSR1 */
+
+/* Phases of a request */
+#define PH_QUEUE       0  /* waiting in the fairq queue for a worker */
+#define PH_PARSE       1  /* request line and headers */
+#define PH_CACHE       2  /* cache lookup */
+#define PH_REPLY       3  /* writing a cached or local response */
+#define PH_DNS         4  /* getaddrinfo */
+#define PH_CONNECT     5  /* connect to the origin */
+#define PH_FIRST_BYTE  6  /* request sent -> first response byte */
+#define PH_RELAY       7  /* copying the response to the client */
+#define PH_NPHASES     8
+
+typedef struct {
+    long long begin, end;  /* us, monotonic */
+    int phase;
+} span_t;
+
+/* Trace of one request, filled in on the worker's stack. Only sampled */
+/* requests read the clock; the others pay one branch per phase.       */
+typedef struct {
+    int sampled;
+    int worker;                    /* thread index */
+    long long begin, end;          /* whole request */
+    int nspan;
+    span_t span[TRACE_MAXSPANS];
+    char uri[TRACE_URILEN];
+} trace_t;
+
+extern int trace_sample;  /* 1-in-N sampling, 0 disables tracing */
+
+void trace_init(void);
+void trace_begin(trace_t *t, int worker, long long begin);
+long long trace_mark(trace_t *t);
+long long trace_span(trace_t *t, int phase, long long begin);
+void trace_uri(trace_t *t, char *uri);
+void trace_end(trace_t *t);
+int  trace_response(char **resp);
+
+#endif /* __TRACE_H__ */
@@ -0,0 +1,254 @@
+#include <poll.h>
+#include "csapp.h"
+#include "upstream.h"
+#include "metrics.h"
+
+/*
+ * upstream.c - connections to origin servers with bounded waiting
+ *
+ * Every phase that used to block forever has a limit: connect(), the
+ * wait for the first response byte, and (through SO_RCVTIMEO) each read
+ * of the relay loop. Connecting races the origin's IPv6 and IPv4
+ * addresses (connect_he in csapp.c), so one address that does not answer
+ * costs attempt_delay_ms rather than the whole connect timeout.
+ * Idempotent requests that fail before any byte came back are retried
+ * starting from the next resolved address. With hedging enabled,
+ * a request that has not answered within the p95 first-byte latency is
+ * sent again to the next address and whichever answers first is used.
+ * An origin with a single address gets the hedge on a second connection
+ * to that address, which still gets around a lost packet or a request
+ * stuck behind a slow one on the origin's side.
+ */
+
+upstream_conf_t upstream_conf = {
+    CONNECT_TIMEOUT_MS, FIRST_BYTE_TIMEOUT_MS, IDLE_TIMEOUT_MS,
+    UPSTREAM_RETRIES, 0, HEDGE_MIN_DELAY_MS, HE_DELAY_MS
+};
+
+static hist_t first_byte;   /* request sent -> first byte (us) */
+static hist_t recent;       /* the same, halved every HEDGE_WINDOW samples */
+static sem_t  stat_mutex;   /* protects the counters below */
+static long long n_attempts, n_retries, n_connect_fail, n_first_byte_timeout;
+static long long n_idle_timeout, n_hedges, n_hedge_wins;
+
+static void count(long long *counter) {
+    P(&stat_mutex);
+    (*counter)++;
+    V(&stat_mutex);
+}
+
+void upstream_init(void) {
+    hist_init(&first_byte);
+    hist_init(&recent);
+    Sem_init(&stat_mutex, 0, 1);
+}
+
+/* Time left until deadline (us) as a poll() timeout, -1 if no deadline */
+static int remaining_ms(long long deadline) {
+    long long left;
+
+    if(deadline == 0)
+        return -1;
+    left = deadline - now_us();
+    return (left > 0) ? (int)((left + 999) / 1000) : 0;
+}
+
+/* Send the whole request. MSG_NOSIGNAL turns a dead origin into an */
+/* EPIPE return value instead of a SIGPIPE that unwinds the worker. */
+static int send_request(int fd, char *req, int reqlen) {
+    int n;
+
+    while(reqlen > 0) {
+        if((n = send(fd, req, reqlen, MSG_NOSIGNAL)) < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        req += n;
+        reqlen -= n;
+    }
+    return 0;
+}
+
+/* Connect to addr, or the addresses after it if they win the race, */
+/* and send the request. Return the socket or -1.                   */
+static int start_attempt(struct addrinfo *addr, char *req, int reqlen,
+                         trace_t *trace) {
+    int fd;
+    long long mark = trace_mark(trace);
+
+    count(&n_attempts);
+    fd = connect_he(addr, upstream_conf.attempt_delay_ms,
+                    upstream_conf.connect_ms);
+    trace_span(trace, PH_CONNECT, mark);
+    if(fd < 0) {
+        count(&n_connect_fail);
+        return -1;
+    }
+    if(send_request(fd, req, reqlen) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Wait until one of the n sockets in fds has response bytes to read or  */
+/* the deadline passes. Sockets that fail (EOF, reset) are closed and    */
+/* set to -1. Return the index of the first answering socket, or -1.     */
+static int wait_first_byte(int *fds, int n, long long deadline) {
+    struct pollfd pfd[2];
+    char c;
+    int  i, live, rc;
+
+    while(1) {
+        live = 0;
+        for(i = 0; i < n; i++) {
+            pfd[i].fd = fds[i];       /* poll() ignores negative fds */
+            pfd[i].events = POLLIN;
+            pfd[i].revents = 0;
+            if(fds[i] >= 0)
+                live++;
+        }
+        if(live == 0)
+            return -1;
+        rc = poll(pfd, n, remaining_ms(deadline));
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc <= 0)
+            return -1;        /* timed out */
+        for(i = 0; i < n; i++) {
+            if(!pfd[i].revents)
+                continue;
+            if(recv(fds[i], &c, 1, MSG_PEEK | MSG_DONTWAIT) == 1)
+                return i;
+            close(fds[i]);    /* closed without answering */
+            fds[i] = -1;
+        }
+    }
+}
+
+/* The hedge delay tracks the p95 first-byte latency of recent requests: */
+/* older ones lose half their weight every HEDGE_WINDOW requests         */
+static long long hedge_delay_us(void) {
+    long long delay = hist_percentile(&recent, 0.95);
+
+    if(delay < upstream_conf.hedge_min_ms * 1000LL)
+        delay = upstream_conf.hedge_min_ms * 1000LL;
+    return delay;
+}
+
+/* Open a connection to hostname:port, send req and wait for the first  */
+/* byte of the response. Idempotent requests are retried and, if        */
+/* enabled, hedged. Return a socket positioned at the response, whose   */
+/* reads time out after idle_ms, or UPSTREAM_EDNS / UPSTREAM_EFAIL.      */
+/* The DNS, connect and first-byte phases are recorded in trace.        */
+int upstream_open(char *hostname, int port, char *req, int reqlen,
+                  int idempotent, trace_t *trace) {
+    struct addrinfo hints, *addlist, *p;
+    struct addrinfo *addrs[UPSTREAM_MAXADDR];
+    char port_str[MAXLINE];
+    int  naddr = 0, attempts, a, i, won;
+    int  fds[2];
+    long long start, deadline;
+    struct timeval tv;
+    long long mark = trace_mark(trace);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    sprintf(port_str, "%d", port);
+    if(getaddrinfo(hostname, port_str, &hints, &addlist) != 0) {
+        trace_span(trace, PH_DNS, mark);
+        return UPSTREAM_EDNS;
+    }
+    trace_span(trace, PH_DNS, mark);
+    for(p = addlist; p && naddr < UPSTREAM_MAXADDR; p = p->ai_next)
+        addrs[naddr++] = p;
+
+    attempts = idempotent ? 1 + upstream_conf.retries : 1;
+    won = -1;
+    for(a = 0; a < attempts && won < 0; a++) {
+        if(a > 0)
+            count(&n_retries);
+        fds[0] = start_attempt(addrs[a % naddr], req, reqlen, trace);
+        fds[1] = -1;
+        if(fds[0] < 0)
+            continue;
+
+        start = now_us();
+        deadline = upstream_conf.first_byte_ms ?
+                   start + upstream_conf.first_byte_ms * 1000LL : 0;
+
+        if(idempotent && upstream_conf.hedge) {
+            long long hedge_at = start + hedge_delay_us();
+
+            if(deadline == 0 || hedge_at < deadline) {
+                won = wait_first_byte(fds, 1, hedge_at);
+                if(won < 0 && fds[0] >= 0) {
+                    count(&n_hedges);
+                    fds[1] = start_attempt(addrs[(a + 1) % naddr],
+                                           req, reqlen, trace);
+                }
+            }
+        }
+        if(won < 0)
+            won = wait_first_byte(fds, 2, deadline);
+        trace_span(trace, PH_FIRST_BYTE, start);
+
+        if(won < 0) {
+            count(&n_first_byte_timeout);
+        }
+        else {
+            long long us = now_us() - start;
+
+            hist_add(&first_byte, us);
+            hist_add(&recent, us);
+            hist_decay(&recent, HEDGE_WINDOW);
+            if(won == 1)
+                count(&n_hedge_wins);
+        }
+        for(i = 0; i < 2; i++) {
+            if(fds[i] >= 0 && i != won)
+                close(fds[i]);
+        }
+    }
+    freeaddrinfo(addlist);
+
+    if(won < 0)
+        return UPSTREAM_EFAIL;
+
+    /* Bound every later read of the relay loop by the idle timeout */
+    if(upstream_conf.idle_ms) {
+        tv.tv_sec = upstream_conf.idle_ms / 1000;
+        tv.tv_usec = (upstream_conf.idle_ms % 1000) * 1000;
+        setsockopt(fds[won], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+    return fds[won];
+}
+
+/* Called by the relay loop when an origin went quiet for idle_ms */
+void upstream_idle_timeout(void) {
+    count(&n_idle_timeout);
+}
+
+/* Append upstream counters and first-byte latency to buf */
+int upstream_format(char *buf, int size) {
+    int len;
+
+    P(&stat_mutex);
+    len = stats_printf(buf, size,
+                       "upstream.attempts %lld\nupstream.retries %lld\n"
+                       "upstream.connect_failures %lld\n"
+                       "upstream.first_byte_timeouts %lld\n"
+                       "upstream.idle_timeouts %lld\n"
+                       "upstream.hedges %lld\nupstream.hedge_wins %lld\n"
+                       "upstream.hedge_delay_us %lld\n",
+                       n_attempts, n_retries, n_connect_fail,
+                       n_first_byte_timeout, n_idle_timeout,
+                       n_hedges, n_hedge_wins, hedge_delay_us());
+    V(&stat_mutex);
+    len += hist_format(&first_byte, "upstream.first_byte",
+                       buf + len, size - len);
+    return len;
+}
@@ -0,0 +1,38 @@
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include "csapp.h"
+#include "trace.h"
+
+/* Default limits for origin servers. A timeout of 0 waits forever. */
+#define CONNECT_TIMEOUT_MS     2000
+#define FIRST_BYTE_TIMEOUT_MS  5000
+#define IDLE_TIMEOUT_MS        5000
+#define UPSTREAM_RETRIES       1
+#define HEDGE_MIN_DELAY_MS     20
+#define HEDGE_WINDOW           256  /* samples the hedge delay follows */
+#define UPSTREAM_MAXADDR       16
+
+/* upstream_open error codes */
+#define UPSTREAM_EDNS    -2  /* hostname did not resolve */
+#define UPSTREAM_EFAIL   -1  /* every attempt failed or timed out */
+
+typedef struct {
+    int connect_ms;     /* limit on connecting to an origin */
+    int first_byte_ms;  /* limit from request sent to first response byte */
+    int idle_ms;        /* limit on the gap between response bytes */
+    int retries;        /* extra attempts for idempotent requests */
+    int hedge;          /* if set, hedge idempotent requests */
+    int hedge_min_ms;   /* lower bound on the p95-derived hedge delay */
+    int attempt_delay_ms; /* head start of each address over the next */
+} upstream_conf_t;
+
+extern upstream_conf_t upstream_conf;
+
+void upstream_init(void);
+int  upstream_open(char *hostname, int port, char *req, int reqlen,
+                   int idempotent, trace_t *trace);
+void upstream_idle_timeout(void);
+int  upstream_format(char *buf, int size);
+
+#endif /* __UPSTREAM_H__ */